@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+// Linear (bump) arenas. Allocations are never freed one by one, the whole arena is reset at once:
+// every frame for per frame scratch data, on swapchain recreation for swapchain sized arrays.
+
+#define ARENA_ALIGNMENT 16
+
+struct arena {
+    unsigned char* base;
+    size_t capacity;
+    size_t used;
+    size_t peak;
+};
+
+// Heap allocations that the steady state frame must not make go through the counted_ wrappers.
+// Debug builds count them, so the render loop can assert that a frame did not touch the heap.
+// Allocations made with plain malloc, like the profiler's rings, are not counted.
+#ifndef NDEBUG
+_Atomic unsigned long long debug_allocation_count = 0;
+#define assert_no_allocations_since(count) assert(atomic_load(&debug_allocation_count) == (count))
+#define get_allocation_count() atomic_load(&debug_allocation_count)
+#define count_allocation() atomic_fetch_add_explicit(&debug_allocation_count, 1, memory_order_relaxed)
+#else
+#define assert_no_allocations_since(count) ((void)(count))
+#define get_allocation_count() 0ull
+#define count_allocation() ((void)0)
+#endif
+
+static inline void* counted_malloc(size_t size) {
+    count_allocation();
+    return malloc(size);
+}
+
+static inline void* counted_calloc(size_t len, size_t size) {
+    count_allocation();
+    return calloc(len, size);
+}
+
+static inline void* counted_realloc(void* pointer, size_t size) {
+    count_allocation();
+    return realloc(pointer, size);
+}
+
+int create_arena(struct arena *arena, size_t capacity) {
+    arena -> base = counted_malloc(capacity);
+    if (arena -> base == NULL) {
+        perror("failed to allocate arena");
+        return EXIT_FAILURE;
+    }
+    arena -> capacity = capacity;
+    arena -> used = 0;
+    arena -> peak = 0;
+    return EXIT_SUCCESS;
+}
+
+// NULL when the arena is full, arenas never grow since that would move earlier allocations.
+void* arena_alloc(struct arena *arena, size_t size) {
+    size_t start = (arena -> used + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (start + size > arena -> capacity) {
+        fprintf(stderr, "ERR: arena out of space (%zu of %zu bytes used, %zu requested)\n", arena -> used, arena -> capacity, size);
+        return NULL;
+    }
+    arena -> used = start + size;
+    if (arena -> used > arena -> peak) {
+        arena -> peak = arena -> used;
+    }
+    return arena -> base + start;
+}
+
+#define arena_alloc_array(arena, type, len) ((type*)arena_alloc((arena), sizeof(type) * (len)))
+
+void reset_arena(struct arena *arena) {
+    arena -> used = 0;
+}
+
+void destroy_arena(struct arena *arena) {
+    free(arena -> base);
+    *arena = (struct arena) {0};
+}
@@ -0,0 +1,731 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena_handling.h"
+#include "job_handling.h"
+#include "world_handling.h"
+
+// Conveyor belts. Belt tiles that follow each other, straight or around a curve, are merged into
+// lines, one per lane. A line does not store item positions, it stores the gaps between items as
+// runs: a run is a number of items of one kind with the same gap between them. Moving a line walks
+// the runs from the front and stops at the first gap that can shrink, so a line that moves freely
+// and a line pressed against a blocked end both cost O(1) per tick however many items they carry.
+//
+// Lines end in nothing, in the back or side of another line, or in a splitter, which hands each
+// lane's items to its two outputs in turn.
+//
+// Lines that hand items to each other, directly or through a splitter, form a group. Groups share
+// nothing, so a tick runs them on separate threads and still ends with the same belts.
+
+#define BELT_TILE_UNITS 256 // positions along one tile
+#define BELT_ITEM_SPACING 64 // closest two items on a lane can be, four per lane per tile
+#define BELT_SPEED 8 // units per tick, 3.125 tiles per second
+#define BELT_LANE_LEN 2 // left and right, seen in the direction of travel
+#define BELT_NONE UINT32_MAX
+
+enum belt_output_kind {
+    BELT_OUTPUT_NONE,
+    BELT_OUTPUT_LINE,
+    BELT_OUTPUT_SPLITTER
+};
+
+struct belt_run {
+    uint32_t head_gap; // from the first item to the item ahead of it, or to the end of the line for the front run
+    uint32_t gap; // between consecutive items of the run
+    uint32_t count;
+    uint16_t item;
+};
+
+struct belt_line {
+    struct belt_run* run_array;
+    uint32_t run_head; // the front run, popping it only moves this forward
+    uint32_t run_len;
+    uint32_t run_capacity; // one more than the items that fit, so ticks never allocate
+    uint32_t active_run; // runs before this one are pressed against a stopped front
+    uint32_t length; // in units
+    uint32_t tail_distance; // from the end of the line to its last item
+    uint32_t item_len;
+    uint32_t output; // line or splitter index
+    uint32_t output_distance; // where items enter the output line, from its end
+    uint8_t output_kind;
+    uint8_t lane;
+};
+
+// Two tiles wide, side 0 at x, y and side 1 one tile to the left of direction.
+struct belt_splitter {
+    int32_t x;
+    int32_t y;
+    uint8_t direction;
+    uint8_t next_side[BELT_LANE_LEN]; // per lane, the side the next item tries first
+    uint32_t output_line[2][BELT_LANE_LEN]; // [side][lane], BELT_NONE when nothing is connected
+    uint32_t output_distance[2][BELT_LANE_LEN];
+};
+
+struct belt_network {
+    // belt tiles in placement order, the lines are built from these
+    int32_t* belt_position_array; // x, y pairs
+    uint8_t* belt_direction_array;
+    uint32_t* belt_line_array; // the left lane's line, the right lane's is the one after it
+    uint32_t* belt_offset_array; // in tiles from the start of the line
+    uint32_t belt_len;
+    uint32_t belt_capacity;
+    struct belt_splitter* splitter_array;
+    uint32_t splitter_len;
+    uint32_t splitter_capacity;
+    struct belt_line* line_array;
+    uint32_t line_len;
+    uint32_t* group_line_array; // line indices by group, in index order within a group
+    uint32_t* group_offset_array; // where each group starts in group_line_array, group_len + 1 of them
+    uint32_t group_len;
+};
+
+int create_belt_network(struct belt_network *network, uint32_t belt_capacity) {
+    *network = (struct belt_network) {0};
+    network -> belt_capacity = belt_capacity < 16 ? 16 : belt_capacity;
+    network -> splitter_capacity = 16;
+    network -> belt_position_array = counted_malloc(sizeof(int32_t) * 2 * network -> belt_capacity);
+    network -> belt_direction_array = counted_malloc(sizeof(uint8_t) * network -> belt_capacity);
+    network -> belt_line_array = counted_malloc(sizeof(uint32_t) * network -> belt_capacity);
+    network -> belt_offset_array = counted_malloc(sizeof(uint32_t) * network -> belt_capacity);
+    network -> splitter_array = counted_malloc(sizeof(struct belt_splitter) * network -> splitter_capacity);
+    if (network -> belt_position_array == NULL || network -> belt_direction_array == NULL || network -> belt_line_array == NULL
+        || network -> belt_offset_array == NULL || network -> splitter_array == NULL) {
+        fprintf(stderr, "ERR: failed to allocate belt network for %u belts\n", belt_capacity);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void destroy_belt_lines(struct belt_network *network) {
+    for (uint32_t i = 0; i < network -> line_len; i++) {
+        free(network -> line_array[i].run_array);
+    }
+    free(network -> line_array);
+    free(network -> group_line_array);
+    free(network -> group_offset_array);
+    network -> line_array = NULL;
+    network -> line_len = 0;
+    network -> group_line_array = NULL;
+    network -> group_offset_array = NULL;
+    network -> group_len = 0;
+}
+
+void destroy_belt_network(struct belt_network *network) {
+    destroy_belt_lines(network);
+    free(network -> belt_position_array);
+    free(network -> belt_direction_array);
+    free(network -> belt_line_array);
+    free(network -> belt_offset_array);
+    free(network -> splitter_array);
+    *network = (struct belt_network) {0};
+}
+
+// Returns the belt's index, or BELT_NONE when the tile is taken or out of memory. Lines only
+// reflect new belts after build_belt_lines.
+uint32_t add_belt(struct belt_network *network, struct world *world, int32_t x, int32_t y, uint8_t direction) {
+    if (network -> belt_len == network -> belt_capacity) {
+        uint32_t new_capacity = network -> belt_capacity * 2;
+        int32_t* new_position_array = counted_realloc(network -> belt_position_array, sizeof(int32_t) * 2 * new_capacity);
+        if (new_position_array == NULL) {
+            perror("failed to grow belts");
+            return BELT_NONE;
+        }
+        network -> belt_position_array = new_position_array;
+        uint8_t* new_direction_array = counted_realloc(network -> belt_direction_array, sizeof(uint8_t) * new_capacity);
+        if (new_direction_array == NULL) {
+            perror("failed to grow belts");
+            return BELT_NONE;
+        }
+        network -> belt_direction_array = new_direction_array;
+        uint32_t* new_line_array = counted_realloc(network -> belt_line_array, sizeof(uint32_t) * new_capacity);
+        if (new_line_array == NULL) {
+            perror("failed to grow belts");
+            return BELT_NONE;
+        }
+        network -> belt_line_array = new_line_array;
+        uint32_t* new_offset_array = counted_realloc(network -> belt_offset_array, sizeof(uint32_t) * new_capacity);
+        if (new_offset_array == NULL) {
+            perror("failed to grow belts");
+            return BELT_NONE;
+        }
+        network -> belt_offset_array = new_offset_array;
+        network -> belt_capacity = new_capacity;
+    }
+    uint32_t belt = network -> belt_len;
+    if (place_building(world, x, y, TILE_BELT, belt, direction & 3) != EXIT_SUCCESS) {
+        return BELT_NONE;
+    }
+    network -> belt_position_array[belt * 2] = x;
+    network -> belt_position_array[belt * 2 + 1] = y;
+    network -> belt_direction_array[belt] = direction & 3;
+    network -> belt_line_array[belt] = BELT_NONE;
+    network -> belt_offset_array[belt] = 0;
+    network -> belt_len++;
+    return belt;
+}
+
+// Returns the splitter's index, or BELT_NONE when either tile is taken or out of memory.
+uint32_t add_splitter(struct belt_network *network, struct world *world, int32_t x, int32_t y, uint8_t direction) {
+    direction &= 3;
+    if (network -> splitter_len == network -> splitter_capacity) {
+        struct belt_splitter* new_splitter_array = counted_realloc(network -> splitter_array, sizeof(struct belt_splitter) * network -> splitter_capacity * 2);
+        if (new_splitter_array == NULL) {
+            perror("failed to grow splitters");
+            return BELT_NONE;
+        }
+        network -> splitter_array = new_splitter_array;
+        network -> splitter_capacity *= 2;
+    }
+    uint32_t splitter = network -> splitter_len;
+    uint8_t left = (direction + 1) & 3;
+    if (place_building(world, x, y, TILE_SPLITTER, splitter, direction) != EXIT_SUCCESS) {
+        return BELT_NONE;
+    }
+    if (place_building(world, x + direction_dx[left], y + direction_dy[left], TILE_SPLITTER, splitter, direction) != EXIT_SUCCESS) {
+        remove_building(world, x, y);
+        return BELT_NONE;
+    }
+    network -> splitter_array[splitter] = (struct belt_splitter) {.x = x, .y = y, .direction = direction};
+    for (int side = 0; side < 2; side++) {
+        for (int lane = 0; lane < BELT_LANE_LEN; lane++) {
+            network -> splitter_array[splitter].output_line[side][lane] = BELT_NONE;
+        }
+    }
+    network -> splitter_len++;
+    return splitter;
+}
+
+uint32_t belt_at(const struct world *world, int32_t x, int32_t y) {
+    const struct tile *tile = world_tile(world, x, y);
+    return tile != NULL && tile -> kind == TILE_BELT ? tile -> building : BELT_NONE;
+}
+
+// The belt a belt's items come from without changing lane: the one straight behind it, or else
+// its only side input, which makes it a curve. Anything else pointing into it side loads.
+uint32_t belt_predecessor(const struct belt_network *network, const struct world *world, uint32_t belt) {
+    int32_t x = network -> belt_position_array[belt * 2];
+    int32_t y = network -> belt_position_array[belt * 2 + 1];
+    uint8_t direction = network -> belt_direction_array[belt];
+    uint32_t behind = belt_at(world, x - direction_dx[direction], y - direction_dy[direction]);
+    if (behind != BELT_NONE && network -> belt_direction_array[behind] == direction) {
+        return behind;
+    }
+    uint32_t side_input = BELT_NONE;
+    uint32_t side_input_len = 0;
+    for (uint8_t side = 1; side < 4; side += 2) {
+        uint8_t side_direction = (direction + side) & 3;
+        uint32_t neighbour = belt_at(world, x + direction_dx[side_direction], y + direction_dy[side_direction]);
+        // pointing back at this belt, so against side_direction
+        if (neighbour != BELT_NONE && network -> belt_direction_array[neighbour] == ((side_direction + 2) & 3)) {
+            side_input = neighbour;
+            side_input_len++;
+        }
+    }
+    return side_input_len == 1 ? side_input : BELT_NONE;
+}
+
+uint32_t belt_successor(const struct belt_network *network, const struct world *world, uint32_t belt) {
+    uint8_t direction = network -> belt_direction_array[belt];
+    uint32_t next = belt_at(world, network -> belt_position_array[belt * 2] + direction_dx[direction], network -> belt_position_array[belt * 2 + 1] + direction_dy[direction]);
+    return next != BELT_NONE && belt_predecessor(network, world, next) == belt ? next : BELT_NONE;
+}
+
+// Where the items leaving the end of the line ending in belt go.
+void connect_belt_line_output(struct belt_network *network, const struct world *world, uint32_t belt) {
+    int32_t x = network -> belt_position_array[belt * 2];
+    int32_t y = network -> belt_position_array[belt * 2 + 1];
+    uint8_t direction = network -> belt_direction_array[belt];
+    struct belt_line *line_pair = &network -> line_array[network -> belt_line_array[belt]];
+    int32_t front_x = x + direction_dx[direction];
+    int32_t front_y = y + direction_dy[direction];
+    const struct tile *front = world_tile(world, front_x, front_y);
+    if (front == NULL) {
+        return;
+    }
+
+    if (front -> kind == TILE_BELT) {
+        uint32_t next = front -> building;
+        uint32_t next_line = network -> belt_line_array[next];
+        uint32_t next_length = network -> line_array[next_line].length;
+        uint32_t next_start = network -> belt_offset_array[next] * BELT_TILE_UNITS;
+        if (belt_successor(network, world, belt) == next) {
+            // only when the line loops back onto itself, otherwise next would have joined the line
+            for (int lane = 0; lane < BELT_LANE_LEN; lane++) {
+                line_pair[lane].output_kind = BELT_OUTPUT_LINE;
+                line_pair[lane].output = next_line + lane;
+                line_pair[lane].output_distance = next_length - next_start;
+            }
+        } else if (((network -> belt_direction_array[next] + 2) & 3) != direction) {
+            // side loading puts both lanes onto the near lane, in the middle of the tile
+            uint8_t next_left = (network -> belt_direction_array[next] + 1) & 3;
+            int from_left = x == front_x + direction_dx[next_left] && y == front_y + direction_dy[next_left];
+            for (int lane = 0; lane < BELT_LANE_LEN; lane++) {
+                line_pair[lane].output_kind = BELT_OUTPUT_LINE;
+                line_pair[lane].output = next_line + (from_left ? 0 : 1);
+                line_pair[lane].output_distance = next_length - next_start - BELT_TILE_UNITS / 2;
+            }
+        }
+    } else if (front -> kind == TILE_SPLITTER && network -> splitter_array[front -> building].direction == direction) {
+        for (int lane = 0; lane < BELT_LANE_LEN; lane++) {
+            line_pair[lane].output_kind = BELT_OUTPUT_SPLITTER;
+            line_pair[lane].output = front -> building;
+        }
+    }
+}
+
+static inline uint32_t find_belt_group_root(uint32_t* parent_array, uint32_t node) {
+    while (parent_array[node] != node) {
+        parent_array[node] = parent_array[parent_array[node]];
+        node = parent_array[node];
+    }
+    return node;
+}
+
+static inline void join_belt_groups(uint32_t* parent_array, uint32_t a, uint32_t b) {
+    a = find_belt_group_root(parent_array, a);
+    b = find_belt_group_root(parent_array, b);
+    // the lower root wins, so group roots do not depend on the order lines are joined in
+    if (a < b) {
+        parent_array[b] = a;
+    } else {
+        parent_array[a] = b;
+    }
+}
+
+// Splits the connected lines into groups with union find, splitters are nodes after the lines.
+int build_belt_groups(struct belt_network *network) {
+    uint32_t node_len = network -> line_len + network -> splitter_len;
+    uint32_t* parent_array = counted_malloc(sizeof(uint32_t) * (node_len > 0 ? node_len : 1));
+    network -> group_line_array = counted_malloc(sizeof(uint32_t) * (network -> line_len > 0 ? network -> line_len : 1));
+    network -> group_offset_array = counted_malloc(sizeof(uint32_t) * (network -> line_len + 1));
+    if (parent_array == NULL || network -> group_line_array == NULL || network -> group_offset_array == NULL) {
+        perror("failed to allocate belt groups");
+        free(parent_array);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t node = 0; node < node_len; node++) {
+        parent_array[node] = node;
+    }
+    for (uint32_t i = 0; i < network -> line_len; i++) {
+        const struct belt_line *line = &network -> line_array[i];
+        if (line -> output_kind == BELT_OUTPUT_LINE) {
+            join_belt_groups(parent_array, i, line -> output);
+        } else if (line -> output_kind == BELT_OUTPUT_SPLITTER) {
+            join_belt_groups(parent_array, i, network -> line_len + line -> output);
+        }
+    }
+    for (uint32_t i = 0; i < network -> splitter_len; i++) {
+        for (int side = 0; side < 2; side++) {
+            for (int lane = 0; lane < BELT_LANE_LEN; lane++) {
+                uint32_t output = network -> splitter_array[i].output_line[side][lane];
+                if (output != BELT_NONE) {
+                    join_belt_groups(parent_array, network -> line_len + i, output);
+                }
+            }
+        }
+    }
+
+    // a group's root is its lowest line, so numbering roots in line order numbers every group
+    // before any line of it is looked at, then a counting sort lays the groups out
+    uint32_t* group_array = counted_malloc(sizeof(uint32_t) * (network -> line_len > 0 ? network -> line_len : 1));
+    if (group_array == NULL) {
+        perror("failed to allocate belt groups");
+        free(parent_array);
+        return EXIT_FAILURE;
+    }
+    network -> group_len = 0;
+    memset(network -> group_offset_array, 0, sizeof(uint32_t) * (network -> line_len + 1));
+    for (uint32_t i = 0; i < network -> line_len; i++) {
+        uint32_t root = find_belt_group_root(parent_array, i);
+        if (root == i) {
+            group_array[i] = network -> group_len++;
+        } else {
+            group_array[i] = group_array[root];
+        }
+        network -> group_offset_array[group_array[i] + 1]++;
+    }
+    for (uint32_t group = 0; group < network -> group_len; group++) {
+        network -> group_offset_array[group + 1] += network -> group_offset_array[group];
+    }
+    // fills each group from its start, which leaves every offset at the start of the next group
+    for (uint32_t i = 0; i < network -> line_len; i++) {
+        network -> group_line_array[network -> group_offset_array[group_array[i]]++] = i;
+    }
+    for (uint32_t group = network -> group_len; group > 0; group--) {
+        network -> group_offset_array[group] = network -> group_offset_array[group - 1];
+    }
+    network -> group_offset_array[0] = 0;
+    free(group_array);
+    free(parent_array);
+    return EXIT_SUCCESS;
+}
+
+// Merges the belts into lines and connects them. Rebuilding clears every item off the belts.
+int build_belt_lines(struct belt_network *network, const struct world *world) {
+    destroy_belt_lines(network);
+    // at most one line pair per belt
+    network -> line_array = counted_malloc(sizeof(struct belt_line) * BELT_LANE_LEN * (network -> belt_len > 0 ? network -> belt_len : 1));
+    if (network -> line_array == NULL) {
+        perror("failed to allocate belt lines");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < network -> belt_len; i++) {
+        network -> belt_line_array[i] = BELT_NONE;
+    }
+
+    // lines start at belts nothing feeds straight into, whatever is left after that are closed loops
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t start = 0; start < network -> belt_len; start++) {
+            if (network -> belt_line_array[start] != BELT_NONE || (pass == 0 && belt_predecessor(network, world, start) != BELT_NONE)) {
+                continue;
+            }
+            uint32_t line = network -> line_len;
+            uint32_t tile_len = 0;
+            for (uint32_t belt = start; belt != BELT_NONE && network -> belt_line_array[belt] == BELT_NONE; belt = belt_successor(network, world, belt)) {
+                network -> belt_line_array[belt] = line;
+                network -> belt_offset_array[belt] = tile_len++;
+            }
+            for (uint8_t lane = 0; lane < BELT_LANE_LEN; lane++) {
+                struct belt_line *belt_line = &network -> line_array[line + lane];
+                *belt_line = (struct belt_line) {
+                    .length = tile_len * BELT_TILE_UNITS,
+                    .run_capacity = tile_len * BELT_TILE_UNITS / BELT_ITEM_SPACING + 2,
+                    .output = BELT_NONE,
+                    .output_kind = BELT_OUTPUT_NONE,
+                    .lane = lane
+                };
+                belt_line -> run_array = counted_malloc(sizeof(struct belt_run) * belt_line -> run_capacity);
+                network -> line_len++;
+                if (belt_line -> run_array == NULL) {
+                    perror("failed to allocate belt line");
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    for (uint32_t belt = 0; belt < network -> belt_len; belt++) {
+        const struct belt_line *line = &network -> line_array[network -> belt_line_array[belt]];
+        if ((network -> belt_offset_array[belt] + 1) * BELT_TILE_UNITS == line -> length) {
+            connect_belt_line_output(network, world, belt);
+        }
+    }
+
+    for (uint32_t i = 0; i < network -> splitter_len; i++) {
+        struct belt_splitter *splitter = &network -> splitter_array[i];
+        uint8_t left = (splitter -> direction + 1) & 3;
+        for (int side = 0; side < 2; side++) {
+            int32_t x = splitter -> x + side * direction_dx[left] + direction_dx[splitter -> direction];
+            int32_t y = splitter -> y + side * direction_dy[left] + direction_dy[splitter -> direction];
+            uint32_t belt = belt_at(world, x, y);
+            int connected = belt != BELT_NONE && network -> belt_direction_array[belt] == splitter -> direction;
+            for (int lane = 0; lane < BELT_LANE_LEN; lane++) {
+                uint32_t line = connected ? network -> belt_line_array[belt] + lane : BELT_NONE;
+                splitter -> output_line[side][lane] = line;
+                splitter -> output_distance[side][lane] = connected ? network -> line_array[line].length - network -> belt_offset_array[belt] * BELT_TILE_UNITS : 0;
+            }
+        }
+    }
+    return build_belt_groups(network);
+}
+
+static inline struct belt_run* belt_runs(struct belt_line *line) {
+    return line -> run_array + line -> run_head;
+}
+
+// Makes room for a run at index. There is always room since a line never has more runs than items.
+void open_belt_run(struct belt_line *line, uint32_t index) {
+    if (line -> run_head + line -> run_len == line -> run_capacity) {
+        memmove(line -> run_array, belt_runs(line), sizeof(struct belt_run) * line -> run_len);
+        line -> run_head = 0;
+    }
+    struct belt_run *runs = belt_runs(line);
+    memmove(runs + index + 1, runs + index, sizeof(struct belt_run) * (line -> run_len - index));
+    line -> run_len++;
+}
+
+void close_belt_run(struct belt_line *line, uint32_t index) {
+    if (index == 0) {
+        line -> run_head++;
+    } else {
+        struct belt_run *runs = belt_runs(line);
+        memmove(runs + index, runs + index + 1, sizeof(struct belt_run) * (line -> run_len - index - 1));
+    }
+    line -> run_len--;
+    if (line -> run_len == 0) {
+        line -> run_head = 0;
+    }
+}
+
+// Leaves the first item_len items in run index and moves the rest into a run of their own after it.
+void split_belt_run(struct belt_line *line, uint32_t index, uint32_t item_len) {
+    open_belt_run(line, index + 1);
+    struct belt_run *runs = belt_runs(line);
+    runs[index + 1] = (struct belt_run) {
+        .head_gap = runs[index].gap,
+        .gap = runs[index].gap,
+        .count = runs[index].count - item_len,
+        .item = runs[index].item
+    };
+    runs[index].count = item_len;
+}
+
+// Returns 1 when the item fit at distance from the end of the line, at least BELT_ITEM_SPACING
+// from the items on either side of it.
+int insert_belt_item(struct belt_line *line, uint32_t distance, uint16_t item) {
+    if (line -> run_len == 0) {
+        line -> run_head = 0;
+        line -> run_array[0] = (struct belt_run) {.head_gap = distance, .gap = BELT_ITEM_SPACING, .count = 1, .item = item};
+        line -> run_len = 1;
+        line -> active_run = 0;
+        line -> tail_distance = distance;
+        line -> item_len = 1;
+        return 1;
+    }
+
+    struct belt_run *runs = belt_runs(line);
+    uint32_t index;
+    if (distance >= line -> tail_distance) {
+        // behind every item, which is where items from straight on and from splitters enter
+        uint32_t gap = distance - line -> tail_distance;
+        if (gap < BELT_ITEM_SPACING) {
+            return 0;
+        }
+        index = line -> run_len - 1;
+        struct belt_run *last = &runs[index];
+        if (last -> item == item && (last -> count == 1 || last -> gap == gap)) {
+            last -> gap = gap;
+            last -> count++;
+        } else {
+            index = line -> run_len;
+            open_belt_run(line, index);
+            belt_runs(line)[index] = (struct belt_run) {.head_gap = gap, .gap = BELT_ITEM_SPACING, .count = 1, .item = item};
+        }
+        line -> tail_distance = distance;
+    } else {
+        // between two items, which only side loading does
+        uint32_t ahead = 0; // distance of the item in front of the current run, 0 for the end of the line
+        for (index = 0; index < line -> run_len; index++) {
+            uint32_t first = ahead + runs[index].head_gap;
+            uint32_t last = first + (runs[index].count - 1) * runs[index].gap;
+            if (last < distance) {
+                ahead = last;
+                continue;
+            }
+            // items before behind_item are ahead of distance
+            uint32_t behind_item = first > distance ? 0 : (distance - first) / runs[index].gap + 1;
+            if (behind_item == runs[index].count) {
+                return 0; // the last item sits right on distance
+            }
+            if (behind_item > 0) {
+                ahead = first + (behind_item - 1) * runs[index].gap;
+            }
+            uint32_t behind = first + behind_item * runs[index].gap;
+            int has_ahead = index > 0 || behind_item > 0;
+            if ((has_ahead && distance - ahead < BELT_ITEM_SPACING) || behind - distance < BELT_ITEM_SPACING) {
+                return 0;
+            }
+            if (behind_item > 0) {
+                split_belt_run(line, index, behind_item);
+                index++;
+            }
+            open_belt_run(line, index);
+            runs = belt_runs(line);
+            runs[index] = (struct belt_run) {.head_gap = distance - ahead, .gap = BELT_ITEM_SPACING, .count = 1, .item = item};
+            runs[index + 1].head_gap = behind - distance;
+            break;
+        }
+    }
+    line -> item_len++;
+    if (index < line -> active_run) {
+        line -> active_run = index;
+    }
+    return 1;
+}
+
+void pop_belt_front(struct belt_line *line) {
+    struct belt_run *front = belt_runs(line);
+    if (front -> count == 1) {
+        close_belt_run(line, 0);
+    } else {
+        // the popped item was at the end, so the next one is its gap away from it
+        front -> count--;
+        front -> head_gap = front -> gap;
+    }
+    line -> item_len--;
+    line -> active_run = 0;
+    if (line -> item_len == 0) {
+        line -> tail_distance = 0;
+    }
+}
+
+// Shrinks the gaps from the front: the front item stops at the end of the line, every other item
+// stops BELT_ITEM_SPACING behind the one ahead, and whatever an item could not move the items
+// behind it still can, up to their own gaps.
+void move_belt_line(struct belt_line *line) {
+    uint32_t deficit = BELT_SPEED; // how much less than a full step the items from here on move
+    uint32_t index = line -> active_run;
+    if (index >= line -> run_len) {
+        return;
+    }
+    while (index < line -> run_len) {
+        struct belt_run *runs = belt_runs(line);
+        struct belt_run *run = &runs[index];
+        uint32_t slack = run -> head_gap - (index == 0 ? 0 : BELT_ITEM_SPACING);
+        uint32_t take = slack < deficit ? slack : deficit;
+        run -> head_gap -= take;
+        deficit -= take;
+        if (deficit == 0) {
+            break;
+        }
+        // the run's first item stopped, the ones behind it may still have room between them
+        if (run -> count > 1 && run -> gap > BELT_ITEM_SPACING) {
+            split_belt_run(line, index, 1);
+            runs = belt_runs(line);
+            run = &runs[index];
+        }
+        // a run that closed up joins the compressed run in front of it
+        if (index > 0 && runs[index - 1].item == run -> item && (runs[index - 1].count == 1 || runs[index - 1].gap == BELT_ITEM_SPACING)) {
+            runs[index - 1].gap = BELT_ITEM_SPACING;
+            runs[index - 1].count += run -> count;
+            close_belt_run(line, index);
+        } else {
+            index++;
+        }
+    }
+    line -> active_run = index;
+    line -> tail_distance -= BELT_SPEED - deficit;
+}
+
+// Hands the front item on once it reached the end of the line, if its output has room for it.
+void transfer_belt_front(struct belt_network *network, struct belt_line *line) {
+    if (line -> run_len == 0 || belt_runs(line) -> head_gap != 0) {
+        return;
+    }
+    uint16_t item = belt_runs(line) -> item;
+    if (line -> output_kind == BELT_OUTPUT_LINE) {
+        if (insert_belt_item(&network -> line_array[line -> output], line -> output_distance, item)) {
+            pop_belt_front(line);
+        }
+    } else if (line -> output_kind == BELT_OUTPUT_SPLITTER) {
+        struct belt_splitter *splitter = &network -> splitter_array[line -> output];
+        uint8_t side = splitter -> next_side[line -> lane];
+        for (int attempt = 0; attempt < 2; attempt++, side ^= 1) {
+            uint32_t target = splitter -> output_line[side][line -> lane];
+            if (target != BELT_NONE && insert_belt_item(&network -> line_array[target], splitter -> output_distance[side][line -> lane], item)) {
+                splitter -> next_side[line -> lane] = side ^ 1;
+                pop_belt_front(line);
+                return;
+            }
+        }
+    }
+}
+
+void tick_belt_group(void *data, uint32_t group, uint32_t thread) {
+    (void)thread;
+    struct belt_network *network = data;
+    for (uint32_t g = network -> group_offset_array[group]; g < network -> group_offset_array[group + 1]; g++) {
+        struct belt_line *line = &network -> line_array[network -> group_line_array[g]];
+        move_belt_line(line);
+        transfer_belt_front(network, line);
+    }
+}
+
+// Lines are updated in index order, or in index order within each group when groups are spread
+// over threads, which moves every line the same way since groups do not interact.
+void belt_tick(struct belt_network *network, struct job_system *jobs) {
+    if (jobs != NULL && jobs -> thread_len > 1) {
+        run_jobs(jobs, tick_belt_group, network, network -> group_len);
+        return;
+    }
+    for (uint32_t i = 0; i < network -> line_len; i++) {
+        struct belt_line *line = &network -> line_array[i];
+        move_belt_line(line);
+        transfer_belt_front(network, line);
+    }
+}
+
+uint64_t belt_item_len(const struct belt_network *network) {
+    uint64_t item_len = 0;
+    for (uint32_t i = 0; i < network -> line_len; i++) {
+        item_len += network -> line_array[i].item_len;
+    }
+    return item_len;
+}
+
+// Lays belts out as closed loops two tiles wide, running east along the bottom row and west
+// along the top, fills both lanes of every loop and times ticks. The right lane alternates two
+// items so its runs cannot merge, which is the worst case for the run arrays.
+int benchmark_belts(uint32_t belt_len, uint32_t loop_length, uint32_t tick_len, uint32_t thread_len) {
+    struct world world;
+    struct belt_network network;
+    struct job_system job_system;
+    struct job_system *jobs = NULL;
+    if (create_world(&world, belt_len / CHUNK_TILE_LEN + 1) != EXIT_SUCCESS || create_belt_network(&network, belt_len) != EXIT_SUCCESS) {
+        destroy_world(&world);
+        destroy_belt_network(&network);
+        return EXIT_FAILURE;
+    }
+    int error_code = EXIT_SUCCESS;
+    uint32_t loop_len = belt_len / (loop_length * 2);
+    for (uint32_t loop = 0; loop < loop_len && error_code == EXIT_SUCCESS; loop++) {
+        int32_t y = (int32_t)loop * 2;
+        for (int32_t x = 0; x < (int32_t)loop_length; x++) {
+            // east, with the last tile turning north, then west, with the last tile turning south
+            uint8_t bottom_direction = x == (int32_t)loop_length - 1 ? 1 : 0;
+            uint8_t top_direction = x == 0 ? 3 : 2;
+            if (add_belt(&network, &world, x, y, bottom_direction) == BELT_NONE || add_belt(&network, &world, x, y + 1, top_direction) == BELT_NONE) {
+                error_code = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+    if (error_code != EXIT_SUCCESS || build_belt_lines(&network, &world) != EXIT_SUCCESS) {
+        destroy_belt_network(&network);
+        destroy_world(&world);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < network.line_len; i++) {
+        struct belt_line *line = &network.line_array[i];
+        for (uint32_t distance = 0; distance + BELT_ITEM_SPACING <= line -> length; distance += BELT_ITEM_SPACING) {
+            uint16_t item = line -> lane == 0 ? 1 : (uint16_t)(1 + (distance / BELT_ITEM_SPACING) % 2);
+            insert_belt_item(line, distance, item);
+        }
+    }
+    uint64_t item_len = belt_item_len(&network);
+    if (thread_len > 1) {
+        if (create_job_system(&job_system, thread_len) != EXIT_SUCCESS) {
+            destroy_belt_network(&network);
+            destroy_world(&world);
+            return EXIT_FAILURE;
+        }
+        jobs = &job_system;
+    }
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (uint32_t i = 0; i < tick_len; i++) {
+        belt_tick(&network, jobs);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+    uint64_t run_len = 0;
+    for (uint32_t i = 0; i < network.line_len; i++) {
+        run_len += network.line_array[i].run_len;
+    }
+    printf("Moved %llu items on %u belts in %u lines (%llu runs, %u groups) on %u threads for %u ticks: %.3f ms per tick, %.0f million item moves/s%s\n",
+        (unsigned long long)item_len, network.belt_len, network.line_len, (unsigned long long)run_len, network.group_len,
+        jobs != NULL ? jobs -> thread_len : 1, tick_len,
+        seconds * 1000.0 / tick_len, (double)item_len * tick_len / seconds / 1000000.0,
+        belt_item_len(&network) == item_len ? "" : ", ITEMS LOST");
+
+    if (jobs != NULL) {
+        destroy_job_system(jobs);
+    }
+    destroy_belt_network(&network);
+    destroy_world(&world);
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
 C:\VulkanSDK\1.4.313.2\Bin\glslc.exe shaders\shader.vert -o build\shaders\vert.spv
 C:\VulkanSDK\1.4.313.2\Bin\glslc.exe shaders\shader.frag -o build\shaders\frag.spv
+C:\VulkanSDK\1.4.313.2\Bin\glslc.exe shaders\cull.comp -o build\shaders\cull.spv
 pause
\ No newline at end of file
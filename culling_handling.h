@@ -0,0 +1,309 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "arena_handling.h"
+#include "cglm/cglm.h"
+
+// Dynamic AABB tree (a bounding volume hierarchy) over static objects such as placed buildings.
+// Every leaf holds one object. Placing or removing a building only touches one root to leaf path,
+// which is kept roughly balanced with tree rotations, so the tree never has to be rebuilt.
+// Culling walks the tree against the view frustum: subtrees outside it are skipped and subtrees
+// completely inside it are accepted without further tests, so a frame costs what is on screen
+// rather than what is in the factory.
+
+#define AABB_TREE_NULL UINT32_MAX
+#define AABB_TREE_STACK_SIZE 128 // far above the height of a balanced tree of 2^32 leaves
+
+struct aabb_tree_node {
+    vec3 box[2]; // min, max
+    uint32_t parent; // next free node while on the free list
+    uint32_t child[2]; // AABB_TREE_NULL for leaves
+    int32_t height; // 0 for leaves
+    uint32_t item; // object index for leaves
+};
+
+struct aabb_tree {
+    struct aabb_tree_node* node_array;
+    uint32_t node_len; // nodes in use
+    uint32_t node_capacity;
+    uint32_t root;
+    uint32_t free_node;
+};
+
+void link_aabb_tree_free_nodes(struct aabb_tree *tree, uint32_t first, uint32_t last) {
+    for (uint32_t i = first; i < last; i++) {
+        tree -> node_array[i].parent = i + 1 < last ? i + 1 : tree -> free_node;
+        tree -> node_array[i].height = -1;
+    }
+    if (first < last) {
+        tree -> free_node = first;
+    }
+}
+
+int create_aabb_tree(struct aabb_tree *tree, uint32_t capacity) {
+    *tree = (struct aabb_tree) {0};
+    tree -> node_capacity = capacity < 16 ? 16 : capacity;
+    tree -> node_array = counted_malloc(sizeof(struct aabb_tree_node) * tree -> node_capacity);
+    if (tree -> node_array == NULL) {
+        perror("failed to allocate aabb tree");
+        return EXIT_FAILURE;
+    }
+    tree -> root = AABB_TREE_NULL;
+    tree -> free_node = AABB_TREE_NULL;
+    link_aabb_tree_free_nodes(tree, 0, tree -> node_capacity);
+    return EXIT_SUCCESS;
+}
+
+void destroy_aabb_tree(struct aabb_tree *tree) {
+    free(tree -> node_array);
+    *tree = (struct aabb_tree) {0};
+}
+
+// Removes every object but keeps the nodes for reuse.
+void clear_aabb_tree(struct aabb_tree *tree) {
+    tree -> node_len = 0;
+    tree -> root = AABB_TREE_NULL;
+    tree -> free_node = AABB_TREE_NULL;
+    link_aabb_tree_free_nodes(tree, 0, tree -> node_capacity);
+}
+
+// Grows up front so node pointers stay valid for the rest of an insert.
+int reserve_aabb_tree_nodes(struct aabb_tree *tree, uint32_t len) {
+    if (tree -> node_len + len <= tree -> node_capacity) {
+        return EXIT_SUCCESS;
+    }
+    uint32_t new_capacity = tree -> node_capacity * 2;
+    while (new_capacity < tree -> node_len + len) {
+        new_capacity *= 2;
+    }
+    struct aabb_tree_node* new_node_array = counted_realloc(tree -> node_array, sizeof(struct aabb_tree_node) * new_capacity);
+    if (new_node_array == NULL) {
+        perror("failed to grow aabb tree");
+        return EXIT_FAILURE;
+    }
+    tree -> node_array = new_node_array;
+    link_aabb_tree_free_nodes(tree, tree -> node_capacity, new_capacity);
+    tree -> node_capacity = new_capacity;
+    return EXIT_SUCCESS;
+}
+
+uint32_t allocate_aabb_tree_node(struct aabb_tree *tree) {
+    uint32_t node = tree -> free_node;
+    assert(node != AABB_TREE_NULL);
+    tree -> free_node = tree -> node_array[node].parent;
+    tree -> node_array[node] = (struct aabb_tree_node) {
+        .parent = AABB_TREE_NULL,
+        .child = {AABB_TREE_NULL, AABB_TREE_NULL},
+        .height = 0,
+        .item = AABB_TREE_NULL
+    };
+    tree -> node_len++;
+    return node;
+}
+
+void free_aabb_tree_node(struct aabb_tree *tree, uint32_t node) {
+    tree -> node_array[node].parent = tree -> free_node;
+    tree -> node_array[node].height = -1;
+    tree -> free_node = node;
+    tree -> node_len--;
+}
+
+float aabb_surface_area(vec3 box[2]) {
+    float x = box[1][0] - box[0][0];
+    float y = box[1][1] - box[0][1];
+    float z = box[1][2] - box[0][2];
+    return 2.0f * (x * y + y * z + z * x);
+}
+
+void refit_aabb_tree_node(struct aabb_tree_node* node_array, uint32_t node) {
+    struct aabb_tree_node* a = &node_array[node];
+    struct aabb_tree_node* b = &node_array[a -> child[0]];
+    struct aabb_tree_node* c = &node_array[a -> child[1]];
+    glm_aabb_merge(b -> box, c -> box, a -> box);
+    a -> height = 1 + (b -> height > c -> height ? b -> height : c -> height);
+}
+
+// Rotates the taller child of node up when the children's heights differ by more than one,
+// returns the node now at this position.
+uint32_t balance_aabb_tree_node(struct aabb_tree *tree, uint32_t node) {
+    struct aabb_tree_node* node_array = tree -> node_array;
+    struct aabb_tree_node* a = &node_array[node];
+    if (a -> height < 2) {
+        return node;
+    }
+    int32_t balance = node_array[a -> child[1]].height - node_array[a -> child[0]].height;
+    if (balance >= -1 && balance <= 1) {
+        return node;
+    }
+
+    // side is the taller child, it takes a's place and a takes its shorter grandchild
+    int side = balance > 1 ? 1 : 0;
+    uint32_t up = a -> child[side];
+    struct aabb_tree_node* b = &node_array[up];
+    uint32_t tall = b -> child[0];
+    uint32_t short_child = b -> child[1];
+    if (node_array[tall].height < node_array[short_child].height) {
+        tall = b -> child[1];
+        short_child = b -> child[0];
+    }
+
+    b -> parent = a -> parent;
+    if (b -> parent == AABB_TREE_NULL) {
+        tree -> root = up;
+    } else if (node_array[b -> parent].child[0] == node) {
+        node_array[b -> parent].child[0] = up;
+    } else {
+        node_array[b -> parent].child[1] = up;
+    }
+    b -> child[0] = node;
+    b -> child[1] = tall;
+    a -> parent = up;
+    a -> child[side] = short_child;
+    node_array[short_child].parent = node;
+
+    refit_aabb_tree_node(node_array, node);
+    refit_aabb_tree_node(node_array, up);
+    return up;
+}
+
+// Walks from node to the root restoring boxes, heights and balance.
+void refit_aabb_tree_path(struct aabb_tree *tree, uint32_t node) {
+    while (node != AABB_TREE_NULL) {
+        node = balance_aabb_tree_node(tree, node);
+        refit_aabb_tree_node(tree -> node_array, node);
+        node = tree -> node_array[node].parent;
+    }
+}
+
+// Returns the leaf, which is the handle for aabb_tree_remove, or AABB_TREE_NULL when out of memory.
+uint32_t aabb_tree_insert(struct aabb_tree *tree, vec3 box[2], uint32_t item) {
+    if (reserve_aabb_tree_nodes(tree, 2) != EXIT_SUCCESS) {
+        return AABB_TREE_NULL;
+    }
+    uint32_t leaf = allocate_aabb_tree_node(tree);
+    struct aabb_tree_node* node_array = tree -> node_array;
+    glm_vec3_copy(box[0], node_array[leaf].box[0]);
+    glm_vec3_copy(box[1], node_array[leaf].box[1]);
+    node_array[leaf].item = item;
+    if (tree -> root == AABB_TREE_NULL) {
+        tree -> root = leaf;
+        return leaf;
+    }
+
+    // descend towards the sibling that grows the total surface area the least
+    uint32_t sibling = tree -> root;
+    while (node_array[sibling].height > 0) {
+        struct aabb_tree_node* node = &node_array[sibling];
+        vec3 combined_box[2];
+        glm_aabb_merge(node -> box, box, combined_box);
+        float combined_area = aabb_surface_area(combined_box);
+        float cost = 2.0f * combined_area;
+        float inheritance_cost = 2.0f * (combined_area - aabb_surface_area(node -> box));
+        float child_cost[2];
+        for (int i = 0; i < 2; i++) {
+            struct aabb_tree_node* child = &node_array[node -> child[i]];
+            vec3 child_box[2];
+            glm_aabb_merge(child -> box, box, child_box);
+            child_cost[i] = aabb_surface_area(child_box) + inheritance_cost;
+            if (child -> height > 0) {
+                child_cost[i] -= aabb_surface_area(child -> box);
+            }
+        }
+        if (cost < child_cost[0] && cost < child_cost[1]) {
+            break;
+        }
+        sibling = node -> child[child_cost[0] < child_cost[1] ? 0 : 1];
+    }
+
+    uint32_t old_parent = node_array[sibling].parent;
+    uint32_t new_parent = allocate_aabb_tree_node(tree);
+    node_array[new_parent].parent = old_parent;
+    node_array[new_parent].child[0] = sibling;
+    node_array[new_parent].child[1] = leaf;
+    if (old_parent == AABB_TREE_NULL) {
+        tree -> root = new_parent;
+    } else if (node_array[old_parent].child[0] == sibling) {
+        node_array[old_parent].child[0] = new_parent;
+    } else {
+        node_array[old_parent].child[1] = new_parent;
+    }
+    node_array[sibling].parent = new_parent;
+    node_array[leaf].parent = new_parent;
+    refit_aabb_tree_path(tree, new_parent);
+    return leaf;
+}
+
+void aabb_tree_remove(struct aabb_tree *tree, uint32_t leaf) {
+    struct aabb_tree_node* node_array = tree -> node_array;
+    uint32_t parent = node_array[leaf].parent;
+    free_aabb_tree_node(tree, leaf);
+    if (parent == AABB_TREE_NULL) {
+        tree -> root = AABB_TREE_NULL;
+        return;
+    }
+
+    // the sibling takes the parent's place
+    uint32_t grandparent = node_array[parent].parent;
+    uint32_t sibling = node_array[parent].child[0] == leaf ? node_array[parent].child[1] : node_array[parent].child[0];
+    node_array[sibling].parent = grandparent;
+    free_aabb_tree_node(tree, parent);
+    if (grandparent == AABB_TREE_NULL) {
+        tree -> root = sibling;
+        return;
+    }
+    if (node_array[grandparent].child[0] == parent) {
+        node_array[grandparent].child[0] = sibling;
+    } else {
+        node_array[grandparent].child[1] = sibling;
+    }
+    refit_aabb_tree_path(tree, grandparent);
+}
+
+// The counterpart to glm_aabb_frustum: true only if the box is on the inner side of every plane.
+int aabb_inside_frustum(vec3 box[2], vec4 planes[6]) {
+    for (int i = 0; i < 6; i++) {
+        float* p = planes[i];
+        float dp = p[0] * box[p[0] < 0.0f][0]
+                 + p[1] * box[p[1] < 0.0f][1]
+                 + p[2] * box[p[2] < 0.0f][2];
+        if (dp < -p[3]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writes the items of every leaf whose box touches the frustum, visible_array holds one entry per object.
+uint32_t aabb_tree_cull(struct aabb_tree *tree, vec4 planes[6], uint32_t* visible_array) {
+    uint32_t visible_len = 0;
+    if (tree -> root == AABB_TREE_NULL) {
+        return 0;
+    }
+    struct aabb_tree_node* node_array = tree -> node_array;
+    // the top half of each stack entry flags a subtree already known to be inside
+    uint64_t stack[AABB_TREE_STACK_SIZE];
+    uint32_t stack_len = 0;
+    stack[stack_len++] = tree -> root;
+    while (stack_len > 0) {
+        uint64_t entry = stack[--stack_len];
+        uint32_t node = (uint32_t)entry;
+        uint64_t inside = entry >> 32;
+        struct aabb_tree_node* n = &node_array[node];
+        if (!inside) {
+            if (!glm_aabb_frustum(n -> box, planes)) {
+                continue;
+            }
+            inside = (uint64_t)aabb_inside_frustum(n -> box, planes);
+        }
+        if (n -> height == 0) {
+            visible_array[visible_len++] = n -> item;
+            continue;
+        }
+        assert(stack_len + 2 <= AABB_TREE_STACK_SIZE);
+        stack[stack_len++] = (inside << 32) | n -> child[1];
+        stack[stack_len++] = (inside << 32) | n -> child[0];
+    }
+    return visible_len;
+}
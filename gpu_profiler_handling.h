@@ -0,0 +1,292 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+#include "error_handling.h"
+#include "graphics_handling.h"
+
+// GPU time per pass from timestamp queries. Every frame slot owns a range of a single timestamp
+// query pool. Scopes write a timestamp at their start and end, and the range is read back right
+// after the slot's fence wait, frame_len frames later, when the results are already there and
+// reading them never stalls. Each scope keeps a rolling window of its durations for min/avg/max,
+// and every scope instance goes into a preallocated trace for chrome://tracing.
+
+#define GPU_PROFILER_MAX_SCOPES 32 // per frame
+#define GPU_PROFILER_WINDOW_LEN 240 // frames in the rolling min/avg/max
+#define GPU_PROFILER_TRACE_LEN 65536 // scope instances kept for the trace, later ones are dropped
+#define GPU_PROFILER_NO_SCOPE UINT32_MAX
+
+struct gpu_profiler_scope {
+    const char *name;
+    uint32_t depth;
+    float window_array[GPU_PROFILER_WINDOW_LEN]; // ms, a ring
+    uint32_t window_len;
+    uint32_t window_next;
+    uint64_t sample_len;
+};
+
+// One scope instance recorded into a frame slot.
+struct gpu_profiler_record {
+    uint32_t scope;
+    uint32_t first_query; // the end timestamp is the next query
+};
+
+struct gpu_profiler_trace_event {
+    uint32_t scope;
+    uint64_t frame_serial;
+    uint64_t start_tick;
+    uint64_t end_tick;
+};
+
+struct gpu_profiler_frame {
+    struct gpu_profiler_record record_array[GPU_PROFILER_MAX_SCOPES];
+    uint32_t record_len;
+    uint32_t depth; // of the next scope to begin
+    uint64_t frame_serial;
+    int issued;
+};
+
+struct gpu_profiler {
+    VkQueryPool query_pool;
+    uint32_t frame_len;
+    double tick_ns; // timestampPeriod
+    uint64_t tick_mask; // timestampValidBits wide
+    struct gpu_profiler_frame frame_array[MAX_FRAMES_IN_FLIGHT];
+    struct gpu_profiler_scope scope_array[GPU_PROFILER_MAX_SCOPES];
+    uint32_t scope_len;
+    struct gpu_profiler_trace_event* trace_event_array;
+    uint32_t trace_event_len;
+    uint64_t trace_start_tick;
+};
+
+int create_gpu_profiler(struct graphics_state *graphics_state, struct gpu_profiler *profiler) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    *profiler = (struct gpu_profiler) {0};
+    profiler -> frame_len = graphics_state -> frame_len;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(graphics_state -> physical_device, &properties);
+    uint32_t queue_family_len;
+    vkGetPhysicalDeviceQueueFamilyProperties(graphics_state -> physical_device, &queue_family_len, NULL);
+    VkQueueFamilyProperties* queue_family_properties = counted_malloc(sizeof(VkQueueFamilyProperties) * queue_family_len);
+    if (queue_family_properties == NULL) {
+        perror("failed to allocate queue family properties");
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+    vkGetPhysicalDeviceQueueFamilyProperties(graphics_state -> physical_device, &queue_family_len, queue_family_properties);
+    uint32_t valid_bits = queue_family_properties[graphics_state -> queue_family_index].timestampValidBits;
+    free(queue_family_properties);
+    if (valid_bits == 0 || properties.limits.timestampPeriod == 0.0f) {
+        fprintf(stderr, "%s", "ERR: the graphics queue does not support timestamps\n");
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+    profiler -> tick_ns = (double)properties.limits.timestampPeriod;
+    profiler -> tick_mask = valid_bits >= 64 ? UINT64_MAX : (1ull << valid_bits) - 1;
+
+    profiler -> trace_event_array = counted_malloc(sizeof(struct gpu_profiler_trace_event) * GPU_PROFILER_TRACE_LEN);
+    if (profiler -> trace_event_array == NULL) {
+        perror("failed to allocate gpu trace");
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+
+    handle_error(vkCreateQueryPool(
+        graphics_state -> device,
+        &(VkQueryPoolCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = profiler -> frame_len * GPU_PROFILER_MAX_SCOPES * 2,
+            .pipelineStatistics = 0x0
+        },
+        NULL,
+        &profiler -> query_pool
+    ), free_trace);
+    printf("GPU profiler created (%.3f ns per tick, %u valid bits)\n", profiler -> tick_ns, valid_bits);
+
+    return error_code;
+free_trace:
+    free(profiler -> trace_event_array);
+    profiler -> trace_event_array = NULL;
+exit_function:
+    return error_code;
+}
+
+void destroy_gpu_profiler(struct graphics_state *graphics_state, struct gpu_profiler *profiler) {
+    vkDestroyQueryPool(graphics_state -> device, profiler -> query_pool, NULL);
+    free(profiler -> trace_event_array);
+    *profiler = (struct gpu_profiler) {0};
+}
+
+// Scopes are keyed by name, which is expected to be a string literal, so the pointer usually matches.
+uint32_t find_gpu_profiler_scope(struct gpu_profiler *profiler, const char *name, uint32_t depth) {
+    for (uint32_t i = 0; i < profiler -> scope_len; i++) {
+        if (profiler -> scope_array[i].name == name || strcmp(profiler -> scope_array[i].name, name) == 0) {
+            return i;
+        }
+    }
+    if (profiler -> scope_len == GPU_PROFILER_MAX_SCOPES) {
+        return GPU_PROFILER_NO_SCOPE;
+    }
+    profiler -> scope_array[profiler -> scope_len] = (struct gpu_profiler_scope) {
+        .name = name,
+        .depth = depth
+    };
+    return profiler -> scope_len++;
+}
+
+// Recorded at the start of the frame's command buffer, outside any rendering.
+void begin_gpu_profiler_frame(struct gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t frame_index, uint64_t frame_serial) {
+    struct gpu_profiler_frame *frame = &profiler -> frame_array[frame_index];
+    frame -> record_len = 0;
+    frame -> depth = 0;
+    frame -> frame_serial = frame_serial;
+    frame -> issued = 1;
+    vkCmdResetQueryPool(command_buffer, profiler -> query_pool, frame_index * GPU_PROFILER_MAX_SCOPES * 2, GPU_PROFILER_MAX_SCOPES * 2);
+}
+
+// Returns the record to pass to end_gpu_scope, or GPU_PROFILER_NO_SCOPE once the frame is full.
+// Inside rendering with secondary command buffer contents only the primary's commands around the
+// rendering can be timed, so scopes must not begin there.
+uint32_t begin_gpu_scope(struct gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t frame_index, const char *name) {
+    struct gpu_profiler_frame *frame = &profiler -> frame_array[frame_index];
+    if (frame -> record_len == GPU_PROFILER_MAX_SCOPES) {
+        return GPU_PROFILER_NO_SCOPE;
+    }
+    uint32_t scope = find_gpu_profiler_scope(profiler, name, frame -> depth);
+    if (scope == GPU_PROFILER_NO_SCOPE) {
+        return GPU_PROFILER_NO_SCOPE;
+    }
+    uint32_t record = frame -> record_len++;
+    frame -> record_array[record] = (struct gpu_profiler_record) {
+        .scope = scope,
+        .first_query = (frame_index * GPU_PROFILER_MAX_SCOPES + record) * 2
+    };
+    frame -> depth++;
+    vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, profiler -> query_pool, frame -> record_array[record].first_query);
+    return record;
+}
+
+void end_gpu_scope(struct gpu_profiler *profiler, VkCommandBuffer command_buffer, uint32_t frame_index, uint32_t record) {
+    if (record == GPU_PROFILER_NO_SCOPE) {
+        return;
+    }
+    struct gpu_profiler_frame *frame = &profiler -> frame_array[frame_index];
+    frame -> depth--;
+    vkCmdWriteTimestamp2(command_buffer, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, profiler -> query_pool, frame -> record_array[record].first_query + 1);
+}
+
+// Call once the frame slot's fence has signalled. Scopes whose timestamps are not available yet,
+// which only happens after a device error, are skipped rather than waited for.
+void read_gpu_profiler_frame(struct graphics_state *graphics_state, struct gpu_profiler *profiler, uint32_t frame_index) {
+    struct gpu_profiler_frame *frame = &profiler -> frame_array[frame_index];
+    if (!frame -> issued) {
+        return;
+    }
+    frame -> issued = 0;
+    for (uint32_t i = 0; i < frame -> record_len; i++) {
+        struct gpu_profiler_record *record = &frame -> record_array[i];
+        uint64_t tick_array[2];
+        if (vkGetQueryPoolResults(graphics_state -> device, profiler -> query_pool, record -> first_query, 2, sizeof(tick_array), tick_array, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+            continue;
+        }
+        uint64_t start_tick = tick_array[0] & profiler -> tick_mask;
+        uint64_t end_tick = tick_array[1] & profiler -> tick_mask;
+        uint64_t elapsed_tick = (end_tick - start_tick) & profiler -> tick_mask;
+
+        struct gpu_profiler_scope *scope = &profiler -> scope_array[record -> scope];
+        scope -> window_array[scope -> window_next] = (float)((double)elapsed_tick * profiler -> tick_ns / 1000000.0);
+        scope -> window_next = (scope -> window_next + 1) % GPU_PROFILER_WINDOW_LEN;
+        if (scope -> window_len < GPU_PROFILER_WINDOW_LEN) {
+            scope -> window_len++;
+        }
+        scope -> sample_len++;
+
+        if (profiler -> trace_event_len < GPU_PROFILER_TRACE_LEN) {
+            if (profiler -> trace_event_len == 0) {
+                profiler -> trace_start_tick = start_tick;
+            }
+            profiler -> trace_event_array[profiler -> trace_event_len++] = (struct gpu_profiler_trace_event) {
+                .scope = record -> scope,
+                .frame_serial = frame -> frame_serial,
+                .start_tick = start_tick,
+                .end_tick = start_tick + elapsed_tick
+            };
+        }
+    }
+}
+
+void gpu_scope_window_stats(const struct gpu_profiler_scope *scope, double *min_ms, double *avg_ms, double *max_ms) {
+    *min_ms = 0.0;
+    *avg_ms = 0.0;
+    *max_ms = 0.0;
+    if (scope -> window_len == 0) {
+        return;
+    }
+    double total = 0.0;
+    *min_ms = scope -> window_array[0];
+    for (uint32_t i = 0; i < scope -> window_len; i++) {
+        double sample = scope -> window_array[i];
+        total += sample;
+        *min_ms = sample < *min_ms ? sample : *min_ms;
+        *max_ms = sample > *max_ms ? sample : *max_ms;
+    }
+    *avg_ms = total / (double)scope -> window_len;
+}
+
+void print_gpu_profiler(const struct gpu_profiler *profiler) {
+    printf("GPU time over the last %u frames:\n", GPU_PROFILER_WINDOW_LEN);
+    for (uint32_t i = 0; i < profiler -> scope_len; i++) {
+        const struct gpu_profiler_scope *scope = &profiler -> scope_array[i];
+        double min_ms, avg_ms, max_ms;
+        gpu_scope_window_stats(scope, &min_ms, &avg_ms, &max_ms);
+        printf("  %*s%-*s %8.3f min %8.3f avg %8.3f max ms\n", scope -> depth * 2, "", 24 - (int)scope -> depth * 2, scope -> name, min_ms, avg_ms, max_ms);
+    }
+}
+
+int write_gpu_profiler_csv(const struct gpu_profiler *profiler, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("failed to open gpu profile csv");
+        return EXIT_FAILURE;
+    }
+    fprintf(file, "%s", "scope,depth,samples,window_min_ms,window_avg_ms,window_max_ms\n");
+    for (uint32_t i = 0; i < profiler -> scope_len; i++) {
+        const struct gpu_profiler_scope *scope = &profiler -> scope_array[i];
+        double min_ms, avg_ms, max_ms;
+        gpu_scope_window_stats(scope, &min_ms, &avg_ms, &max_ms);
+        fprintf(file, "%s,%u,%llu,%.6f,%.6f,%.6f\n", scope -> name, scope -> depth, (unsigned long long)scope -> sample_len, min_ms, avg_ms, max_ms);
+    }
+    fclose(file);
+    printf("GPU profile written to %s\n", path);
+    return EXIT_SUCCESS;
+}
+
+// Complete events in the Trace Event Format, which chrome://tracing and Perfetto open directly.
+int write_gpu_profiler_trace(const struct gpu_profiler *profiler, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("failed to open gpu trace");
+        return EXIT_FAILURE;
+    }
+    fprintf(file, "%s", "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "%s", "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"GPU graphics queue\"}}");
+    for (uint32_t i = 0; i < profiler -> trace_event_len; i++) {
+        const struct gpu_profiler_trace_event *event = &profiler -> trace_event_array[i];
+        double start_us = (double)((event -> start_tick - profiler -> trace_start_tick) & profiler -> tick_mask) * profiler -> tick_ns / 1000.0;
+        double duration_us = (double)(event -> end_tick - event -> start_tick) * profiler -> tick_ns / 1000.0;
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu}}",
+            profiler -> scope_array[event -> scope].name, start_us, duration_us, (unsigned long long)event -> frame_serial);
+    }
+    fprintf(file, "%s", "\n]}\n");
+    fclose(file);
+    printf("GPU trace of %u scopes written to %s\n", profiler -> trace_event_len, path);
+    return EXIT_SUCCESS;
+}
@@ -1,14 +1,21 @@
+#pragma once
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <stddef.h>
+#include <threads.h>
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan_core.h>
 #include "error_handling.h"
+#include "arena_handling.h"
+#include "memory_handling.h"
+#include "mesh_handling.h"
 #include "cglm/cglm.h"
+#include "profiler_handling.h"
 
 void error_handle_glfw(int e, const char* msg) {
     fprintf(stderr, "GLFW ERR: %d, MSG: %s", e, msg);
@@ -17,9 +24,156 @@ void error_handle_glfw(int e, const char* msg) {
 struct graphics_buffer {
     VkBuffer buffer;
     VkDeviceMemory memory;
+    VkDeviceSize offset; // into memory, which is shared with other buffers
+    void* mapped; // NULL unless the memory is host visible
     VkBufferUsageFlagBits usage;
     VkMemoryPropertyFlagBits properties;
     unsigned long long size;
+    struct memory_allocation allocation;
+};
+
+struct graphics_mesh {
+    struct graphics_buffer vertex_buffer;
+    struct graphics_buffer index_buffer;
+    VkIndexType index_type; // 16 bit whenever the vertex count allows it
+    uint32_t index_len;
+};
+
+// Per entity data read by the vertex shader through an instance rate binding.
+struct instance_data {
+    mat4 model;
+    vec4 color; // tint for the entity's state
+};
+
+// A run of consecutive instances drawn with one mesh, so draws scale with mesh types.
+struct instance_batch {
+    struct graphics_mesh *mesh;
+    uint32_t first_instance;
+    uint32_t instance_len;
+};
+
+// Bounding sphere and batch of one instance, as read by shaders/cull.comp.
+struct gpu_cull_instance {
+    vec4 sphere; // center, radius
+    uint32_t batch;
+    uint32_t padding[3];
+};
+
+struct gpu_cull_push_constants {
+    vec4 plane_array[6];
+    uint32_t instance_len;
+};
+
+#define GPU_CULL_WORKGROUP_SIZE 64 // local_size_x in shaders/cull.comp
+#define GPU_CULL_MAX_BATCH_LEN 64
+
+// Frustum culling in a compute shader feeding vkCmdDrawIndexedIndirectCount, so the CPU records
+// the same handful of commands no matter how many instances there are. The shader appends each
+// visible instance to its batch's range of visible_instance_buffer and counts it in the batch's
+// indirect command. There is one set of buffers for all frames in flight, ordered by barriers.
+struct gpu_culling {
+    VkShaderModule shader_module;
+    VkDescriptorSetLayout descriptor_set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_set;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+    struct graphics_buffer source_instance_buffer; // every instance, device local
+    struct graphics_buffer cull_instance_buffer;
+    struct graphics_buffer visible_instance_buffer; // written by the shader, read as instance vertex data
+    struct graphics_buffer draw_buffer; // one VkDrawIndexedIndirectCommand per batch
+    struct graphics_buffer draw_count_buffer;
+    uint32_t instance_capacity;
+    uint32_t instance_len;
+    struct gpu_cull_instance *cull_instance_array; // staged for cull_instance_buffer, sized once so uploads never allocate
+    VkDrawIndexedIndirectCommand draw_template_array[GPU_CULL_MAX_BATCH_LEN]; // copied into draw_buffer with zero instances every frame
+    uint32_t batch_len;
+    struct graphics_mesh *mesh; // indirect draws share one vertex and index buffer
+};
+
+#define UPLOAD_RING_SIZE (32ull * 1024ull * 1024ull)
+#define UPLOAD_BATCH_LEN 16
+#define UPLOAD_ALIGNMENT 16ull
+
+// One submit worth of copies out of the staging ring. The batch's ticket is the timeline
+// semaphore value signalled once its copies are done, at which point the ring space up to
+// ring_end can be reused.
+struct upload_batch {
+    VkCommandBuffer command_buffer;
+    uint64_t ticket;
+    VkDeviceSize ring_end;
+    uint32_t copy_len;
+};
+
+// head and tail are monotonic byte counters, the position in the staging buffer is head % size
+struct upload_ring {
+    struct graphics_buffer staging_buffer;
+    VkDeviceSize head;
+    VkDeviceSize tail;
+    VkCommandPool command_pool;
+    VkSemaphore timeline_semaphore;
+    uint64_t next_ticket;
+    uint64_t completed_ticket;
+    uint64_t failed_ticket; // of a batch that failed to submit, 0 if none. It never signals, so the ring takes no more uploads
+    struct upload_batch batch_array[UPLOAD_BATCH_LEN];
+    uint32_t batch_first;
+    uint32_t batch_len;
+    int recording;
+};
+
+#define PIPELINE_CACHE_PATH "pipeline_cache.bin"
+
+#define FRAME_ARENA_SIZE (256ull * 1024ull)
+// holds every swapchain image sized array, reset when the swapchain is recreated
+#define SWAPCHAIN_ARENA_SIZE (64ull * 1024ull)
+
+// Every frame in flight owns one slice of a single persistently mapped uniform buffer. Uniform
+// data is bump allocated out of the slice and bound through a dynamic offset, so the descriptor
+// set is written once and nothing is ever rewritten per frame.
+#define UNIFORM_SLICE_SIZE (64ull * 1024ull)
+#define UNIFORM_BLOCK_SIZE sizeof(mat4) // the range visible through each dynamic offset
+
+enum retired_object_kind {
+    RETIRED_SWAPCHAIN,
+    RETIRED_IMAGE_VIEW,
+    RETIRED_SEMAPHORE,
+    RETIRED_IMAGE,
+    RETIRED_ALLOCATION
+};
+
+// An object that submitted frames may still be using. It is destroyed once the last frame
+// submitted before it was retired has completed, in the order objects were retired.
+struct retired_object {
+    enum retired_object_kind kind;
+    uint64_t frame_serial;
+    union {
+        VkSwapchainKHR swapchain;
+        VkImageView image_view;
+        VkSemaphore semaphore;
+        VkImage image;
+        struct memory_allocation allocation;
+    };
+};
+
+#define MIN_FRAMES_IN_FLIGHT 2
+#define MAX_FRAMES_IN_FLIGHT 3
+
+// Everything the CPU touches while recording a frame lives in its own slot so
+// frame N+1 can be recorded while the GPU is still executing frame N.
+struct frame_state {
+    VkCommandPool command_pool;
+    VkCommandBuffer command_buffer;
+    VkSemaphore image_available_semaphore;
+    VkFence in_flight_fence;
+    VkDeviceSize uniform_offset; // start of this frame's slice of the shared uniform buffer
+    VkDeviceSize uniform_used;
+    struct graphics_buffer instance_buffer;
+    struct instance_data* instance_data;
+    uint32_t instance_capacity;
+    struct arena arena; // scratch for recording, reset once the frame's fence has signalled
+    uint64_t frame_serial; // of the last submit from this slot
+    int statistics_query_issued;
+    uint32_t statistics_query_pixel_len; // framebuffer area when the query was recorded
 };
 
 struct graphics_state {
@@ -31,6 +185,7 @@ struct graphics_state {
     uint32_t physical_device_len;
     VkPhysicalDevice physical_device;
     int queue_family_index;
+    int transfer_queue_family_index; // same as queue_family_index when there is no dedicated transfer family
     VkDevice device;
     GLFWmonitor* monitor;
     GLFWwindow* window;
@@ -41,40 +196,58 @@ struct graphics_state {
     VkPresentModeKHR present_mode;
     VkSwapchainKHR swapchain;
     VkQueue queue;
+    VkQueue transfer_queue;
     VkCommandPool command_pool;
-    VkCommandBuffer command_buffer;
-    VkRenderPass render_pass;
+    struct frame_state* frame_array;
+    uint32_t frame_len;
     VkImage* swapchain_image_array;
     uint32_t swapchain_image_len;
     VkImageView* swapchain_image_view_array;
     uint32_t swapchain_image_view_len;
-    VkSemaphore* swapchain_image_available_semaphore_array;
-    uint32_t swapchain_image_available_semaphore_len;
     VkSemaphore* swapchain_render_finished_semaphore_array;
     uint32_t swapchain_render_finished_semaphore_len;
-    VkFence* swapchain_in_flight_fence_array;
-    uint32_t swapchain_in_flight_fence_len;
-    VkFramebuffer* framebuffer_array;
-    uint32_t framebuffer_len;
-    struct graphics_buffer* buffer_array;
-    uint32_t buffer_len;
+    VkFence* swapchain_image_fence_array; // fence of the frame slot that last rendered to each image
+    struct arena swapchain_arena;
+    VkFormat depth_format;
+    VkImage depth_image; // one is enough, the barrier at the start of each frame orders it after the previous frame
+    VkImageView depth_image_view;
+    struct memory_allocation depth_allocation;
+    VkQueryPool statistics_query_pool; // fragment shader invocations, one query per frame slot, VK_NULL_HANDLE if unsupported
+    struct memory_allocator allocator;
+    struct upload_ring upload_ring;
     VkShaderModule vertex_shader_module;
     VkShaderModule fragment_shader_module;
     VkDescriptorSetLayout descriptor_set_layout;
     VkDescriptorPool descriptor_pool;
-    VkDescriptorSet* descriptor_set_array;
-    uint32_t descriptor_set_len;
+    VkDescriptorSet descriptor_set; // binding 0 is the uniform buffer with a dynamic offset
+    struct graphics_buffer uniform_buffer; // one UNIFORM_SLICE_SIZE slice per frame in flight
+    VkDeviceSize uniform_alignment; // minUniformBufferOffsetAlignment
     VkPipelineLayout pipeline_layout;
+    VkPipelineCache pipeline_cache;
     VkPipeline pipeline;
+    VkPipeline depth_prepass_pipeline; // VK_NULL_HANDLE unless the depth pre-pass is enabled
+    int gpu_culling_supported; // drawIndirectCount and drawIndirectFirstInstance are enabled
+    int inherited_queries_supported; // secondary command buffers may run inside the statistics query
+    int present_wait_supported; // VK_KHR_present_id and VK_KHR_present_wait are enabled
+    PFN_vkWaitForPresentKHR wait_for_present; // NULL unless present_wait_supported
+    struct retired_object* retired_array; // in frame_serial order
+    uint32_t retired_len;
+    uint32_t retired_capacity;
+    uint64_t submitted_frame_serial; // frames submitted so far
+    uint64_t completed_frame_serial; // every frame up to this one has finished on the GPU
 };
 
-int create_graphics_buffer(struct graphics_state *graphics_state, VkBufferUsageFlagBits usage, unsigned long long size, VkMemoryPropertyFlagBits memory_property_flags, struct graphics_buffer *graphics_buffer) {
-    printf("%s", "Creating graphics buffer\n");
+int create_graphics_buffer(struct graphics_state *graphics_state, VkBufferUsageFlagBits usage, unsigned long long size, VkMemoryPropertyFlagBits memory_property_flags, enum memory_strategy strategy, struct graphics_buffer *graphics_buffer) {
     int error_code = EXIT_SUCCESS;
     VkResult vk_result;
 
     graphics_buffer -> size = size;
     graphics_buffer -> usage = usage;
+    graphics_buffer -> properties = memory_property_flags;
+
+    // buffers filled from the transfer queue are read on the graphics queue without ownership transfers
+    uint32_t queue_family_index_array[2] = {graphics_state -> queue_family_index, graphics_state -> transfer_queue_family_index};
+    int concurrent = (usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT) && graphics_state -> transfer_queue_family_index != graphics_state -> queue_family_index;
 
     handle_error(vkCreateBuffer(
         graphics_state -> device,
@@ -84,249 +257,1826 @@ int create_graphics_buffer(struct graphics_state *graphics_state, VkBufferUsageF
             .flags = 0x0,
             .size = graphics_buffer -> size,
             .usage = graphics_buffer -> usage,
-            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-            .queueFamilyIndexCount = 0,
-            .pQueueFamilyIndices = NULL
+            .sharingMode = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = concurrent ? 2 : 0,
+            .pQueueFamilyIndices = concurrent ? queue_family_index_array : NULL
         },
         NULL,
         &graphics_buffer -> buffer
     ), exit_function);
-    printf("%s", "Graphics buffer created\n");
 
     VkMemoryRequirements memory_requirements;
     vkGetBufferMemoryRequirements(graphics_state -> device, graphics_buffer -> buffer, &memory_requirements);
 
-    VkPhysicalDeviceMemoryProperties memory_properties;
-    vkGetPhysicalDeviceMemoryProperties(graphics_state -> physical_device, &memory_properties);
-
-    int memory_index;
-    for (memory_index = 0; memory_index < memory_properties.memoryTypeCount; memory_index++) {
-        if ((memory_requirements.memoryTypeBits & (1 << memory_index)) && (memory_properties.memoryTypes[memory_index].propertyFlags & memory_property_flags) == memory_property_flags) {
-            break;
-        }
+    if (allocate_memory(&graphics_state -> allocator, &memory_requirements, memory_property_flags, strategy, MEMORY_RESOURCE_LINEAR, &graphics_buffer -> allocation) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERR: failed to allocate %llu bytes for graphics buffer\n", (unsigned long long)memory_requirements.size);
+        error_code = EXIT_FAILURE;
+        goto destroy_buffer;
     }
+    graphics_buffer -> memory = graphics_buffer -> allocation.memory;
+    graphics_buffer -> offset = graphics_buffer -> allocation.offset;
+    graphics_buffer -> mapped = graphics_buffer -> allocation.mapped;
 
-    handle_error(vkAllocateMemory(
-        graphics_state -> device,
-        &(VkMemoryAllocateInfo) {
-            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-            .pNext = NULL,
-            .allocationSize = memory_requirements.size,
-            .memoryTypeIndex = memory_index
-        },
-        NULL,
-        &graphics_buffer -> memory
-    ), destroy_buffer);
-    printf("%s", "Graphics buffer allocated\n");
-
-    handle_error(vkBindBufferMemory(graphics_state -> device, graphics_buffer -> buffer, graphics_buffer -> memory, 0), free_buffer_memory);
-    printf("%s", "Graphics buffer bound\n");
-
-    graphics_state -> buffer_array[graphics_state -> buffer_len] = *graphics_buffer;
-    graphics_state -> buffer_len += 1;
+    handle_error(vkBindBufferMemory(graphics_state -> device, graphics_buffer -> buffer, graphics_buffer -> memory, graphics_buffer -> offset), free_buffer_memory);
 
     return error_code;
 free_buffer_memory:
-    vkFreeMemory(graphics_state -> device, graphics_buffer -> memory, NULL);
+    free_memory(&graphics_state -> allocator, &graphics_buffer -> allocation);
 destroy_buffer:
     vkDestroyBuffer(graphics_state -> device, graphics_buffer -> buffer, NULL);
 exit_function:
     return error_code;
 }
 
-int copy_graphics_buffer(struct graphics_state graphics_state, struct graphics_buffer source_buffer, struct graphics_buffer destination_buffer, unsigned long long size) {
-    printf("%s", "Copying graphics buffer\n");
+void destroy_graphics_buffer(struct graphics_state *graphics_state, struct graphics_buffer *graphics_buffer) {
+    vkDestroyBuffer(graphics_state -> device, graphics_buffer -> buffer, NULL);
+    free_memory(&graphics_state -> allocator, &graphics_buffer -> allocation);
+    graphics_buffer -> buffer = VK_NULL_HANDLE;
+    graphics_buffer -> memory = VK_NULL_HANDLE;
+    graphics_buffer -> mapped = NULL;
+}
+
+int create_upload_ring(struct graphics_state *graphics_state) {
     int error_code = EXIT_SUCCESS;
     VkResult vk_result;
+    struct upload_ring *ring = &graphics_state -> upload_ring;
 
-    VkCommandBuffer command_buffer;
+    *ring = (struct upload_ring) {0};
+    ring -> next_ticket = 1;
+
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, UPLOAD_RING_SIZE, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_STRATEGY_DEDICATED, &ring -> staging_buffer) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    handle_error(vkCreateSemaphore(
+        graphics_state -> device,
+        &(VkSemaphoreCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            .pNext = &(VkSemaphoreTypeCreateInfo) {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+                .pNext = NULL,
+                .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+                .initialValue = 0
+            },
+            .flags = 0x0
+        },
+        NULL,
+        &ring -> timeline_semaphore
+    ), destroy_staging_buffer);
+
+    handle_error(vkCreateCommandPool(
+        graphics_state -> device,
+        &(VkCommandPoolCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+            .pNext = NULL,
+            .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+            .queueFamilyIndex = graphics_state -> transfer_queue_family_index
+        },
+        NULL,
+        &ring -> command_pool
+    ), destroy_timeline_semaphore);
+
+    VkCommandBuffer command_buffer_array[UPLOAD_BATCH_LEN];
     handle_error(vkAllocateCommandBuffers(
-        graphics_state.device,
+        graphics_state -> device,
         &(VkCommandBufferAllocateInfo) {
             .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
             .pNext = NULL,
-            .commandPool = graphics_state.command_pool,
+            .commandPool = ring -> command_pool,
             .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1
+            .commandBufferCount = UPLOAD_BATCH_LEN
         },
-        &command_buffer
-    ), exit_function);
+        command_buffer_array
+    ), destroy_command_pool);
+    for (int i = 0; i < UPLOAD_BATCH_LEN; i++) {
+        ring -> batch_array[i].command_buffer = command_buffer_array[i];
+    }
+    printf("Upload ring created (%llu bytes, %s queue)\n", UPLOAD_RING_SIZE, graphics_state -> transfer_queue_family_index == graphics_state -> queue_family_index ? "graphics" : "dedicated transfer");
 
-    handle_error(vkBeginCommandBuffer(
-        command_buffer,
-        &(VkCommandBufferBeginInfo) {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-            .pNext = NULL,
-            .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-            .pInheritanceInfo = NULL,
+    return error_code;
+destroy_command_pool:
+    vkDestroyCommandPool(graphics_state -> device, ring -> command_pool, NULL);
+destroy_timeline_semaphore:
+    vkDestroySemaphore(graphics_state -> device, ring -> timeline_semaphore, NULL);
+destroy_staging_buffer:
+    destroy_graphics_buffer(graphics_state, &ring -> staging_buffer);
+    return error_code;
+}
+
+// Returns ring space of batches whose copies have finished, without blocking.
+void reclaim_upload_ring(struct graphics_state *graphics_state) {
+    struct upload_ring *ring = &graphics_state -> upload_ring;
+    vkGetSemaphoreCounterValue(graphics_state -> device, ring -> timeline_semaphore, &ring -> completed_ticket);
+    while (ring -> batch_len > 0) {
+        struct upload_batch *batch = &ring -> batch_array[ring -> batch_first];
+        if (batch -> ticket > ring -> completed_ticket) {
+            break;
         }
-    ), free_command_buffer);
+        ring -> tail = batch -> ring_end;
+        ring -> batch_first = (ring -> batch_first + 1) % UPLOAD_BATCH_LEN;
+        ring -> batch_len -= 1;
+    }
+}
 
-    VkBufferCopy copy_region = (VkBufferCopy) {
-        .srcOffset = 0,
-        .dstOffset = 0,
-        .size = size
-    };
+int upload_ticket_complete(struct graphics_state *graphics_state, uint64_t ticket) {
+    uint64_t failed_ticket = graphics_state -> upload_ring.failed_ticket;
+    if (failed_ticket != 0 && ticket >= failed_ticket) {
+        return 0;
+    }
+    if (ticket <= graphics_state -> upload_ring.completed_ticket) {
+        return 1;
+    }
+    reclaim_upload_ring(graphics_state);
+    return ticket <= graphics_state -> upload_ring.completed_ticket;
+}
+
+int wait_upload_ticket(struct graphics_state *graphics_state, uint64_t ticket) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    uint64_t failed_ticket = graphics_state -> upload_ring.failed_ticket;
+    if (failed_ticket != 0 && ticket >= failed_ticket) {
+        fprintf(stderr, "ERR: upload %llu waits on a batch that failed to submit\n", (unsigned long long)ticket);
+        return EXIT_FAILURE;
+    }
+
+    handle_error(vkWaitSemaphores(
+        graphics_state -> device,
+        &(VkSemaphoreWaitInfo) {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .semaphoreCount = 1,
+            .pSemaphores = &graphics_state -> upload_ring.timeline_semaphore,
+            .pValues = &ticket
+        },
+        UINT64_MAX
+    ), exit_function);
+    reclaim_upload_ring(graphics_state);
+exit_function:
+    return error_code;
+}
 
-    vkCmdCopyBuffer(command_buffer, source_buffer.buffer, destination_buffer.buffer, 1, &copy_region);
-    vkEndCommandBuffer(command_buffer);
+// Submits every copy recorded since the last flush as a single batch. Cheap to call when
+// nothing is pending, so the render loop calls it once per frame. Returns 0 when the batch could
+// not be submitted, its copies are dropped and its ring space is handed back. Its ticket was
+// already handed out, so it is never reused: every later upload, flush and wait on it fails.
+uint64_t flush_uploads(struct graphics_state *graphics_state) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+    struct upload_ring *ring = &graphics_state -> upload_ring;
+
+    if (ring -> failed_ticket != 0) {
+        return 0;
+    }
+    if (!ring -> recording) {
+        return ring -> next_ticket - 1;
+    }
+    struct upload_batch *batch = &ring -> batch_array[(ring -> batch_first + ring -> batch_len - 1) % UPLOAD_BATCH_LEN];
+    batch -> ring_end = ring -> head;
+    ring -> recording = 0;
 
-    vkQueueSubmit(
-        graphics_state.queue,
+    handle_error(vkEndCommandBuffer(batch -> command_buffer), exit_function);
+    handle_error(vkQueueSubmit(
+        graphics_state -> transfer_queue,
         1,
-            &(VkSubmitInfo) {
+        &(VkSubmitInfo) {
             .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-            .pNext = NULL,
+            .pNext = &(VkTimelineSemaphoreSubmitInfo) {
+                .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+                .pNext = NULL,
+                .waitSemaphoreValueCount = 0,
+                .pWaitSemaphoreValues = NULL,
+                .signalSemaphoreValueCount = 1,
+                .pSignalSemaphoreValues = &batch -> ticket
+            },
             .waitSemaphoreCount = 0,
             .pWaitSemaphores = NULL,
             .pWaitDstStageMask = NULL,
             .commandBufferCount = 1,
-            .pCommandBuffers = &command_buffer,
-            .signalSemaphoreCount = 0,
-            .pSignalSemaphores = NULL
+            .pCommandBuffers = &batch -> command_buffer,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &ring -> timeline_semaphore
         },
         VK_NULL_HANDLE
-    );
-    vkQueueWaitIdle(graphics_state.queue);
-    vkFreeCommandBuffers(graphics_state.device, graphics_state.command_pool, 1, &command_buffer);
+    ), exit_function);
+    ring -> next_ticket += 1;
 
-    return error_code;
+exit_function:
+    if (error_code != EXIT_SUCCESS) {
+        fprintf(stderr, "ERR: failed to submit %u uploads\n", batch -> copy_len);
+        ring -> failed_ticket = batch -> ticket;
+        vkResetCommandBuffer(batch -> command_buffer, 0x0);
+        ring -> batch_len -= 1;
+        ring -> head = ring -> batch_len > 0 ? ring -> batch_array[(ring -> batch_first + ring -> batch_len - 1) % UPLOAD_BATCH_LEN].ring_end : ring -> tail;
+        return 0;
+    }
+    return batch -> ticket;
+}
+
+// Copies size bytes into destination_buffer at destination_offset through the staging ring and
+// returns the ticket that will be signalled once the copy has landed. The copy is only recorded
+// here; it goes to the GPU with the next flush_uploads. Returns 0 on failure.
+uint64_t upload_graphics_buffer(struct graphics_state *graphics_state, const void* data, VkDeviceSize size, struct graphics_buffer *destination_buffer, VkDeviceSize destination_offset) {
+    VkResult vk_result;
+    struct upload_ring *ring = &graphics_state -> upload_ring;
+    VkDeviceSize ring_size = ring -> staging_buffer.size;
+    uint64_t ticket = 0;
+
+    if (ring -> failed_ticket != 0) {
+        fprintf(stderr, "%s", "ERR: upload ring stopped after a batch failed to submit\n");
+        return 0;
+    }
+
+    // anything bigger than half the ring goes through in pieces
+    while (size > 0) {
+        VkDeviceSize chunk_size = size < ring_size / 2 ? size : ring_size / 2;
+
+        VkDeviceSize start;
+        for (;;) {
+            reclaim_upload_ring(graphics_state);
+            if (ring -> batch_len == 0) {
+                ring -> head = 0;
+                ring -> tail = 0;
+            }
+            start = (ring -> head + UPLOAD_ALIGNMENT - 1) & ~(UPLOAD_ALIGNMENT - 1);
+            if (start % ring_size + chunk_size > ring_size) {
+                start += ring_size - start % ring_size; // never straddle the end of the buffer
+            }
+            if (start + chunk_size - ring -> tail <= ring_size && (ring -> recording || ring -> batch_len < UPLOAD_BATCH_LEN)) {
+                break;
+            }
+            // the ring is saturated, the only case where an upload blocks
+            if (ring -> recording && flush_uploads(graphics_state) == 0) {
+                return 0;
+            }
+            if (wait_upload_ticket(graphics_state, ring -> batch_array[ring -> batch_first].ticket) != EXIT_SUCCESS) {
+                return 0;
+            }
+        }
+
+        if (!ring -> recording) {
+            struct upload_batch *batch = &ring -> batch_array[(ring -> batch_first + ring -> batch_len) % UPLOAD_BATCH_LEN];
+            batch -> ticket = ring -> next_ticket;
+            batch -> copy_len = 0;
+            vk_result = vkBeginCommandBuffer(
+                batch -> command_buffer,
+                &(VkCommandBufferBeginInfo) {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                    .pNext = NULL,
+                    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                    .pInheritanceInfo = NULL
+                }
+            );
+            if (vk_result < VK_SUCCESS) {
+                fprintf(stderr, "ERR at %s, line %d:  %s", __FILE__, __LINE__, handle_vulkan_error(vk_result));
+                return 0;
+            }
+            ring -> batch_len += 1;
+            ring -> recording = 1;
+        }
+        struct upload_batch *batch = &ring -> batch_array[(ring -> batch_first + ring -> batch_len - 1) % UPLOAD_BATCH_LEN];
+
+        memcpy((char*)ring -> staging_buffer.mapped + start % ring_size, data, chunk_size);
+        vkCmdCopyBuffer(
+            batch -> command_buffer,
+            ring -> staging_buffer.buffer,
+            destination_buffer -> buffer,
+            1,
+            &(VkBufferCopy) {
+                .srcOffset = start % ring_size,
+                .dstOffset = destination_offset,
+                .size = chunk_size
+            }
+        );
+        batch -> copy_len += 1;
+        ring -> head = start + chunk_size;
+        ticket = batch -> ticket;
+
+        data = (const char*)data + chunk_size;
+        destination_offset += chunk_size;
+        size -= chunk_size;
+    }
+    return ticket;
+}
+
+void destroy_upload_ring(struct graphics_state *graphics_state) {
+    struct upload_ring *ring = &graphics_state -> upload_ring;
+    if (ring -> recording) {
+        flush_uploads(graphics_state);
+    }
+    // a failed batch never signals, everything before it does
+    wait_upload_ticket(graphics_state, (ring -> failed_ticket != 0 ? ring -> failed_ticket : ring -> next_ticket) - 1);
+    vkDestroyCommandPool(graphics_state -> device, ring -> command_pool, NULL);
+    vkDestroySemaphore(graphics_state -> device, ring -> timeline_semaphore, NULL);
+    destroy_graphics_buffer(graphics_state, &ring -> staging_buffer);
+}
+
+// Creates device local vertex and index buffers for the mesh and queues their upload, the
+// returned ticket has to complete before the mesh is drawn.
+int create_graphics_mesh(struct graphics_state *graphics_state, const struct mesh *mesh, struct graphics_mesh *graphics_mesh, uint64_t *upload_ticket) {
+    int error_code = EXIT_SUCCESS;
+
+    graphics_mesh -> index_len = mesh -> index_len;
+    graphics_mesh -> index_type = mesh -> vertex_len <= UINT16_MAX + 1 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+    VkDeviceSize index_size = graphics_mesh -> index_type == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, sizeof(struct mesh_vertex) * mesh -> vertex_len, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &graphics_mesh -> vertex_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, index_size * mesh -> index_len, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &graphics_mesh -> index_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_vertex_buffer;
+    }
+
+    // the upload copies into the staging ring right away, so the narrowed indices can be freed after
+    const void* index_data = mesh -> index_array;
+    uint16_t* narrow_index_array = NULL;
+    if (graphics_mesh -> index_type == VK_INDEX_TYPE_UINT16) {
+        narrow_index_array = counted_malloc(sizeof(uint16_t) * mesh -> index_len);
+        if (narrow_index_array == NULL) {
+            error_code = EXIT_FAILURE;
+            goto destroy_index_buffer;
+        }
+        for (uint32_t i = 0; i < mesh -> index_len; i++) {
+            narrow_index_array[i] = (uint16_t)mesh -> index_array[i];
+        }
+        index_data = narrow_index_array;
+    }
+
+    uint64_t vertex_ticket = upload_graphics_buffer(graphics_state, mesh -> vertex_array, sizeof(struct mesh_vertex) * mesh -> vertex_len, &graphics_mesh -> vertex_buffer, 0);
+    uint64_t index_ticket = upload_graphics_buffer(graphics_state, index_data, index_size * mesh -> index_len, &graphics_mesh -> index_buffer, 0);
+    free(narrow_index_array);
+    if (vertex_ticket == 0 || index_ticket == 0) {
+        fprintf(stderr, "%s", "ERR: failed to upload mesh\n");
+        error_code = EXIT_FAILURE;
+        goto destroy_index_buffer;
+    }
+    // tickets complete in order
+    *upload_ticket = index_ticket > vertex_ticket ? index_ticket : vertex_ticket;
 
-free_command_buffer:
-    vkFreeCommandBuffers(graphics_state.device, graphics_state.command_pool, 1, &command_buffer);
+    return error_code;
+destroy_index_buffer:
+    destroy_graphics_buffer(graphics_state, &graphics_mesh -> index_buffer);
+destroy_vertex_buffer:
+    destroy_graphics_buffer(graphics_state, &graphics_mesh -> vertex_buffer);
 exit_function:
     return error_code;
 }
 
-int recreate_swapchain(struct graphics_state *graphics_state) {
-    printf("%s", "Recreating swapchain\n");
-    int error_code = EXIT_SUCCESS;
-    VkResult vk_result;
+void destroy_graphics_mesh(struct graphics_state *graphics_state, struct graphics_mesh *graphics_mesh) {
+    destroy_graphics_buffer(graphics_state, &graphics_mesh -> index_buffer);
+    destroy_graphics_buffer(graphics_state, &graphics_mesh -> vertex_buffer);
+}
 
-    handle_error(vkDeviceWaitIdle(graphics_state -> device), exit_function);
+// Grows the frame's host visible instance buffer. Only call after waiting on the frame's fence,
+// the old buffer is destroyed right away.
+int reserve_instance_buffer(struct graphics_state *graphics_state, struct frame_state *frame, uint32_t instance_len) {
+    if (instance_len <= frame -> instance_capacity) {
+        return EXIT_SUCCESS;
+    }
+    uint32_t capacity = frame -> instance_capacity < 1024 ? 1024 : frame -> instance_capacity;
+    while (capacity < instance_len) {
+        capacity *= 2;
+    }
+    if (frame -> instance_buffer.buffer != VK_NULL_HANDLE) {
+        destroy_graphics_buffer(graphics_state, &frame -> instance_buffer);
+        frame -> instance_data = NULL;
+        frame -> instance_capacity = 0;
+    }
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, sizeof(struct instance_data) * capacity, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_STRATEGY_BUDDY, &frame -> instance_buffer) != EXIT_SUCCESS) {
+        frame -> instance_buffer.buffer = VK_NULL_HANDLE;
+        return EXIT_FAILURE;
+    }
+    frame -> instance_data = frame -> instance_buffer.mapped;
+    frame -> instance_capacity = capacity;
+    return EXIT_SUCCESS;
+}
 
-    for (int i = 0; i < graphics_state -> framebuffer_len; i++) {
-        vkDestroyFramebuffer(graphics_state -> device, graphics_state -> framebuffer_array[i], NULL);
+// One indexed instanced draw per batch, the instances come from the frame's instance buffer.
+void draw_instance_batches(VkCommandBuffer command_buffer, struct frame_state *frame, const struct instance_batch *batch_array, uint32_t batch_len) {
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 1, 1, &frame -> instance_buffer.buffer, &offset);
+    struct graphics_mesh *bound_mesh = NULL;
+    for (uint32_t i = 0; i < batch_len; i++) {
+        const struct instance_batch *batch = &batch_array[i];
+        if (batch -> instance_len == 0) {
+            continue;
+        }
+        if (batch -> mesh != bound_mesh) {
+            vkCmdBindVertexBuffers(command_buffer, 0, 1, &batch -> mesh -> vertex_buffer.buffer, &offset);
+            vkCmdBindIndexBuffer(command_buffer, batch -> mesh -> index_buffer.buffer, 0, batch -> mesh -> index_type);
+            bound_mesh = batch -> mesh;
+        }
+        vkCmdDrawIndexed(command_buffer, batch -> mesh -> index_len, batch -> instance_len, 0, 0, batch -> first_instance);
     }
-    graphics_state -> framebuffer_len = 0;
+}
 
-    for(int i = 0; i < graphics_state -> swapchain_image_view_len; i++) {
-        vkDestroyImageView(graphics_state -> device,  graphics_state -> swapchain_image_view_array[i], NULL);
+// Bump allocates from the frame's slice of the uniform buffer. Returns the mapped memory and the
+// dynamic offset to bind it with, or NULL when the slice is full.
+void* uniform_alloc(struct graphics_state *graphics_state, struct frame_state *frame, VkDeviceSize size, uint32_t *dynamic_offset) {
+    VkDeviceSize start = (frame -> uniform_used + graphics_state -> uniform_alignment - 1) / graphics_state -> uniform_alignment * graphics_state -> uniform_alignment;
+    // the descriptor always exposes a whole block, even for smaller allocations
+    VkDeviceSize end = start + (size > UNIFORM_BLOCK_SIZE ? size : UNIFORM_BLOCK_SIZE);
+    if (end > UNIFORM_SLICE_SIZE) {
+        fprintf(stderr, "ERR: uniform slice out of space (%llu of %llu bytes used, %llu requested)\n", (unsigned long long)frame -> uniform_used, UNIFORM_SLICE_SIZE, (unsigned long long)size);
+        return NULL;
     }
-    graphics_state -> swapchain_image_view_len = 0;
+    frame -> uniform_used = end;
+    *dynamic_offset = (uint32_t)(frame -> uniform_offset + start);
+    return (char*)graphics_state -> uniform_buffer.mapped + frame -> uniform_offset + start;
+}
 
-    int width, height;
-    glfwGetFramebufferSize(graphics_state -> window, &width, &height);
-    graphics_state -> image_extent = (VkExtent2D) {
-        .width = width,
-        .height = height
-    };
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(graphics_state -> physical_device, graphics_state -> surface, &graphics_state -> surface_capabilities);
+// Prefers a pure 32 bit float depth format, falling back to the packed depth stencil formats.
+int find_depth_format(struct graphics_state *graphics_state) {
+    VkFormat candidate_array[3] = {VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT};
+    for (int i = 0; i < 3; i++) {
+        VkFormatProperties format_properties;
+        vkGetPhysicalDeviceFormatProperties(graphics_state -> physical_device, candidate_array[i], &format_properties);
+        if (format_properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            graphics_state -> depth_format = candidate_array[i];
+            return EXIT_SUCCESS;
+        }
+    }
+    fprintf(stderr, "%s", "ERR: no supported depth format\n");
+    return EXIT_FAILURE;
+}
 
-    VkSwapchainKHR old_swapchain = graphics_state -> swapchain;
-    handle_error(vkCreateSwapchainKHR(
+// Sized to the swapchain, so it is recreated along with it.
+int create_depth_image(struct graphics_state *graphics_state) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    handle_error(vkCreateImage(
         graphics_state -> device,
-        &(VkSwapchainCreateInfoKHR) {
-            .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        &(VkImageCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
             .pNext = NULL,
             .flags = 0x0,
-            .surface = graphics_state -> surface,
-            .minImageCount = graphics_state -> swapchain_image_len,
-            .imageFormat = graphics_state -> surface_format.format,
-            .imageColorSpace = graphics_state -> surface_format.colorSpace,
-            .imageExtent = graphics_state -> image_extent,
-            .imageArrayLayers = 1,
-            .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-            .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = graphics_state -> depth_format,
+            .extent = (VkExtent3D) {
+                .width = graphics_state -> image_extent.width,
+                .height = graphics_state -> image_extent.height,
+                .depth = 1
+            },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
             .queueFamilyIndexCount = 0,
             .pQueueFamilyIndices = NULL,
-            .preTransform = graphics_state -> surface_capabilities.currentTransform,
-            .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-            .presentMode = graphics_state -> present_mode,
-            .clipped = VK_TRUE,
-            .oldSwapchain = old_swapchain
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
         },
         NULL,
-        &graphics_state -> swapchain
+        &graphics_state -> depth_image
     ), exit_function);
-    vkDestroySwapchainKHR(graphics_state -> device, old_swapchain, NULL);
-    printf("%s", "Swapchain created\n");
 
-    graphics_state -> swapchain_image_array = malloc(sizeof(VkImage) * graphics_state -> swapchain_image_len);
-    vkGetSwapchainImagesKHR(graphics_state -> device, graphics_state -> swapchain, &graphics_state -> swapchain_image_len, graphics_state -> swapchain_image_array);
+    VkMemoryRequirements memory_requirements;
+    vkGetImageMemoryRequirements(graphics_state -> device, graphics_state -> depth_image, &memory_requirements);
+    if (allocate_memory(&graphics_state -> allocator, &memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_DEDICATED, MEMORY_RESOURCE_OPTIMAL, &graphics_state -> depth_allocation) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_image;
+    }
+    handle_error(vkBindImageMemory(graphics_state -> device, graphics_state -> depth_image, graphics_state -> depth_allocation.memory, graphics_state -> depth_allocation.offset), free_image_memory);
 
-    graphics_state -> swapchain_image_view_array = malloc(sizeof(VkImageView) * graphics_state -> swapchain_image_len);
-    for(graphics_state -> swapchain_image_view_len = 0; graphics_state -> swapchain_image_view_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_image_view_len++) {
-        VkImageView image_view;
-        handle_error(vkCreateImageView(
-            graphics_state -> device,
-            &(VkImageViewCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .image = graphics_state -> swapchain_image_array[graphics_state -> swapchain_image_view_len],
-                .viewType = VK_IMAGE_VIEW_TYPE_2D,
-                .format = graphics_state -> surface_format.format,
-                .components = (VkComponentMapping) {
-                    .r = VK_COMPONENT_SWIZZLE_R,
-                    .g = VK_COMPONENT_SWIZZLE_G,
-                    .b = VK_COMPONENT_SWIZZLE_B,
-                    .a = VK_COMPONENT_SWIZZLE_A,
-                },
-                .subresourceRange = (VkImageSubresourceRange) {
-                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                    .baseMipLevel = 0,
-                    .levelCount = 1,
-                    .baseArrayLayer = 0,
-                    .layerCount = 1
-                }
+    int has_stencil = graphics_state -> depth_format != VK_FORMAT_D32_SFLOAT;
+    handle_error(vkCreateImageView(
+        graphics_state -> device,
+        &(VkImageViewCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .image = graphics_state -> depth_image,
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = graphics_state -> depth_format,
+            .components = (VkComponentMapping) {
+                .r = VK_COMPONENT_SWIZZLE_IDENTITY,
+                .g = VK_COMPONENT_SWIZZLE_IDENTITY,
+                .b = VK_COMPONENT_SWIZZLE_IDENTITY,
+                .a = VK_COMPONENT_SWIZZLE_IDENTITY,
             },
-            NULL,
-            &image_view
-        ), destroy_swapchain);
-        graphics_state -> swapchain_image_view_array[graphics_state -> swapchain_image_view_len] = image_view;
+            .subresourceRange = (VkImageSubresourceRange) {
+                .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | (has_stencil ? VK_IMAGE_ASPECT_STENCIL_BIT : 0x0),
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1
+            }
+        },
+        NULL,
+        &graphics_state -> depth_image_view
+    ), free_image_memory);
+
+    return error_code;
+free_image_memory:
+    free_memory(&graphics_state -> allocator, &graphics_state -> depth_allocation);
+destroy_image:
+    vkDestroyImage(graphics_state -> device, graphics_state -> depth_image, NULL);
+exit_function:
+    return error_code;
+}
+
+void destroy_depth_image(struct graphics_state *graphics_state) {
+    vkDestroyImageView(graphics_state -> device, graphics_state -> depth_image_view, NULL);
+    vkDestroyImage(graphics_state -> device, graphics_state -> depth_image, NULL);
+    free_memory(&graphics_state -> allocator, &graphics_state -> depth_allocation);
+}
+
+// Moves the swapchain image and the depth image into attachment layouts and begins rendering to
+// both, cleared. Neither image's old contents are kept, so both come from UNDEFINED. The color
+// transition waits on the stage the acquire semaphore is waited at, the depth transition on the
+// previous frame's depth tests, since every frame shares the one depth image.
+void begin_frame_rendering(VkCommandBuffer command_buffer, struct graphics_state *graphics_state, uint32_t image_index, VkRenderingFlags rendering_flags) {
+    int has_stencil = graphics_state -> depth_format != VK_FORMAT_D32_SFLOAT;
+    VkImageMemoryBarrier2 image_barrier_array[2] = {
+        (VkImageMemoryBarrier2) {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .pNext = NULL,
+            .srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = VK_ACCESS_2_NONE,
+            .dstStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .dstAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = graphics_state -> swapchain_image_array[image_index],
+            .subresourceRange = (VkImageSubresourceRange) {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1
+            }
+        },
+        (VkImageMemoryBarrier2) {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .pNext = NULL,
+            .srcStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+            .srcAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+            .dstAccessMask = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = graphics_state -> depth_image,
+            .subresourceRange = (VkImageSubresourceRange) {
+                .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | (has_stencil ? VK_IMAGE_ASPECT_STENCIL_BIT : 0x0),
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1
+            }
+        }
+    };
+    vkCmdPipelineBarrier2(command_buffer, &(VkDependencyInfo) {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = NULL,
+        .dependencyFlags = 0x0,
+        .memoryBarrierCount = 0,
+        .pMemoryBarriers = NULL,
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers = NULL,
+        .imageMemoryBarrierCount = 2,
+        .pImageMemoryBarriers = image_barrier_array
+    });
+
+    vkCmdBeginRendering(command_buffer, &(VkRenderingInfo) {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+        .pNext = NULL,
+        .flags = rendering_flags,
+        .renderArea = (VkRect2D) {
+            .offset = {0, 0},
+            .extent = graphics_state -> image_extent
+        },
+        .layerCount = 1,
+        .viewMask = 0,
+        .colorAttachmentCount = 1,
+        .pColorAttachments = &(VkRenderingAttachmentInfo) {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+            .pNext = NULL,
+            .imageView = graphics_state -> swapchain_image_view_array[image_index],
+            .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .resolveMode = VK_RESOLVE_MODE_NONE,
+            .resolveImageView = VK_NULL_HANDLE,
+            .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearValue = (VkClearValue) {.color = {.float32 = {0.0f, 0.0f, 0.0f, 1.0f}}}
+        },
+        // depth is only needed within the frame, so it is never stored
+        .pDepthAttachment = &(VkRenderingAttachmentInfo) {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+            .pNext = NULL,
+            .imageView = graphics_state -> depth_image_view,
+            .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+            .resolveMode = VK_RESOLVE_MODE_NONE,
+            .resolveImageView = VK_NULL_HANDLE,
+            .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+            .clearValue = (VkClearValue) {.depthStencil = {1.0f, 0}}
+        },
+        .pStencilAttachment = NULL
+    });
+}
+
+// Ends rendering and hands the swapchain image to the present engine, which waits on the render
+// finished semaphore, so the barrier itself needs no destination stage.
+void end_frame_rendering(VkCommandBuffer command_buffer, struct graphics_state *graphics_state, uint32_t image_index) {
+    vkCmdEndRendering(command_buffer);
+    vkCmdPipelineBarrier2(command_buffer, &(VkDependencyInfo) {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = NULL,
+        .dependencyFlags = 0x0,
+        .memoryBarrierCount = 0,
+        .pMemoryBarriers = NULL,
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers = NULL,
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers = &(VkImageMemoryBarrier2) {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .pNext = NULL,
+            .srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_NONE,
+            .dstAccessMask = VK_ACCESS_2_NONE,
+            .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = graphics_state -> swapchain_image_array[image_index],
+            .subresourceRange = (VkImageSubresourceRange) {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1
+            }
+        }
+    });
+}
+
+// Render finished semaphores are signalled by the submit and waited on by the present of a
+// specific swapchain image, so they are per image rather than per frame slot.
+int create_swapchain_sync_objects(struct graphics_state *graphics_state) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    graphics_state -> swapchain_image_fence_array = arena_alloc_array(&graphics_state -> swapchain_arena, VkFence, graphics_state -> swapchain_image_len);
+    graphics_state -> swapchain_render_finished_semaphore_array = arena_alloc_array(&graphics_state -> swapchain_arena, VkSemaphore, graphics_state -> swapchain_image_len);
+    if (graphics_state -> swapchain_image_fence_array == NULL || graphics_state -> swapchain_render_finished_semaphore_array == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < graphics_state -> swapchain_image_len; i++) {
+        graphics_state -> swapchain_image_fence_array[i] = VK_NULL_HANDLE;
+    }
+
+    for (graphics_state -> swapchain_render_finished_semaphore_len = 0; graphics_state -> swapchain_render_finished_semaphore_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_render_finished_semaphore_len++) {
+        VkSemaphore render_finished_semaphore;
+        handle_error(vkCreateSemaphore(
+            graphics_state -> device,
+            &(VkSemaphoreCreateInfo) {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                .pNext = NULL,
+                .flags = 0x0
+            },
+            NULL,
+            &render_finished_semaphore
+        ), destroy_render_semaphores);
+        graphics_state -> swapchain_render_finished_semaphore_array[graphics_state -> swapchain_render_finished_semaphore_len] = render_finished_semaphore;
+    }
+
+    return error_code;
+destroy_render_semaphores:
+    for(int i = 0; i < graphics_state -> swapchain_render_finished_semaphore_len; i++) {
+        vkDestroySemaphore(graphics_state -> device, graphics_state -> swapchain_render_finished_semaphore_array[i], NULL);
+    }
+    graphics_state -> swapchain_render_finished_semaphore_len = 0;
+    return error_code;
+}
+
+void destroy_swapchain_sync_objects(struct graphics_state *graphics_state) {
+    for(int i = 0; i < graphics_state -> swapchain_render_finished_semaphore_len; i++) {
+        vkDestroySemaphore(graphics_state -> device, graphics_state -> swapchain_render_finished_semaphore_array[i], NULL);
+    }
+    graphics_state -> swapchain_render_finished_semaphore_len = 0;
+}
+
+void destroy_retired_object(struct graphics_state *graphics_state, struct retired_object *object) {
+    switch (object -> kind) {
+    case RETIRED_SWAPCHAIN:
+        vkDestroySwapchainKHR(graphics_state -> device, object -> swapchain, NULL);
+        break;
+    case RETIRED_IMAGE_VIEW:
+        vkDestroyImageView(graphics_state -> device, object -> image_view, NULL);
+        break;
+    case RETIRED_SEMAPHORE:
+        vkDestroySemaphore(graphics_state -> device, object -> semaphore, NULL);
+        break;
+    case RETIRED_IMAGE:
+        vkDestroyImage(graphics_state -> device, object -> image, NULL);
+        break;
+    case RETIRED_ALLOCATION:
+        free_memory(&graphics_state -> allocator, &object -> allocation);
+        break;
+    }
+}
+
+// Queues the object for destruction once every frame submitted so far, and one more round of
+// frame slots after them, has completed. The frame fences do not cover the present engine, the
+// extra round gives it time to release the old images and semaphores. Only when the queue cannot
+// grow does this fall back to idling the device and destroying the object right away.
+void retire_object(struct graphics_state *graphics_state, struct retired_object object) {
+    object.frame_serial = graphics_state -> submitted_frame_serial + graphics_state -> frame_len;
+    if (graphics_state -> retired_len == graphics_state -> retired_capacity) {
+        uint32_t new_capacity = graphics_state -> retired_capacity < 64 ? 64 : graphics_state -> retired_capacity * 2;
+        struct retired_object* new_retired_array = counted_realloc(graphics_state -> retired_array, sizeof(struct retired_object) * new_capacity);
+        if (new_retired_array == NULL) {
+            perror("failed to grow retired objects, waiting for the device instead");
+            vkDeviceWaitIdle(graphics_state -> device);
+            destroy_retired_object(graphics_state, &object);
+            return;
+        }
+        graphics_state -> retired_array = new_retired_array;
+        graphics_state -> retired_capacity = new_capacity;
+    }
+    graphics_state -> retired_array[graphics_state -> retired_len++] = object;
+}
+
+void collect_retired_objects(struct graphics_state *graphics_state) {
+    uint32_t collected_len = 0;
+    while (collected_len < graphics_state -> retired_len && graphics_state -> retired_array[collected_len].frame_serial <= graphics_state -> completed_frame_serial) {
+        destroy_retired_object(graphics_state, &graphics_state -> retired_array[collected_len]);
+        collected_len++;
+    }
+    if (collected_len > 0) {
+        memmove(graphics_state -> retired_array, graphics_state -> retired_array + collected_len, sizeof(struct retired_object) * (graphics_state -> retired_len - collected_len));
+        graphics_state -> retired_len -= collected_len;
+    }
+}
+
+// Call once the frame's fence has signalled. Frames complete in submission order on the one queue,
+// so everything retired before this frame was submitted can go.
+void complete_frame(struct graphics_state *graphics_state, struct frame_state *frame) {
+    if (frame -> frame_serial > graphics_state -> completed_frame_serial) {
+        graphics_state -> completed_frame_serial = frame -> frame_serial;
+    }
+    if (graphics_state -> retired_len > 0) {
+        collect_retired_objects(graphics_state);
+    }
+}
+
+// Reads the surface capabilities and sizes the swapchain images to the surface. A minimized window
+// has a 0x0 framebuffer that no swapchain can be made for, so this waits for it to come back.
+// Returns 0 when the window was closed while waiting.
+int update_image_extent(struct graphics_state *graphics_state) {
+    int width, height;
+    glfwGetFramebufferSize(graphics_state -> window, &width, &height);
+    while ((width == 0 || height == 0) && !glfwWindowShouldClose(graphics_state -> window)) {
+        glfwWaitEvents();
+        glfwGetFramebufferSize(graphics_state -> window, &width, &height);
+    }
+    if (width == 0 || height == 0) {
+        return 0;
+    }
+    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(graphics_state -> physical_device, graphics_state -> surface, &graphics_state -> surface_capabilities);
+    const VkSurfaceCapabilitiesKHR *capabilities = &graphics_state -> surface_capabilities;
+    // the surface dictates the extent unless it reports the special value
+    if (capabilities -> currentExtent.width != UINT32_MAX) {
+        graphics_state -> image_extent = capabilities -> currentExtent;
+        return 1;
+    }
+    uint32_t clamped_width = (uint32_t)width;
+    uint32_t clamped_height = (uint32_t)height;
+    clamped_width = clamped_width < capabilities -> minImageExtent.width ? capabilities -> minImageExtent.width : clamped_width > capabilities -> maxImageExtent.width ? capabilities -> maxImageExtent.width : clamped_width;
+    clamped_height = clamped_height < capabilities -> minImageExtent.height ? capabilities -> minImageExtent.height : clamped_height > capabilities -> maxImageExtent.height ? capabilities -> maxImageExtent.height : clamped_height;
+    graphics_state -> image_extent = (VkExtent2D) {
+        .width = clamped_width,
+        .height = clamped_height
+    };
+    return 1;
+}
+
+// Builds the new swapchain while frames using the old one are still in flight. Everything sized
+// to the old swapchain is retired rather than destroyed, so the device never has to go idle. The
+// old objects are only retired once all the new ones exist, on failure the state still holds the
+// old ones, though the old swapchain can no longer acquire and the caller has to stop rendering.
+int recreate_swapchain(struct graphics_state *graphics_state) {
+    printf("%s", "Recreating swapchain\n");
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+    VkExtent2D old_image_extent = graphics_state -> image_extent;
+    if (!update_image_extent(graphics_state)) {
+        // closed while minimized, the render loop ends before it needs a new swapchain
+        return error_code;
+    }
+    struct timespec recreate_start_time, recreate_end_time;
+    clock_gettime(CLOCK_MONOTONIC, &recreate_start_time);
+
+    // the new arrays go above the old ones in the arena until the old handles are retired
+    size_t arena_mark = graphics_state -> swapchain_arena.used;
+    VkSwapchainKHR old_swapchain = graphics_state -> swapchain;
+    VkImage* old_image_array = graphics_state -> swapchain_image_array;
+    uint32_t old_image_len = graphics_state -> swapchain_image_len;
+    VkImageView* old_image_view_array = graphics_state -> swapchain_image_view_array;
+    uint32_t old_image_view_len = graphics_state -> swapchain_image_view_len;
+    VkSemaphore* old_render_finished_semaphore_array = graphics_state -> swapchain_render_finished_semaphore_array;
+    uint32_t old_render_finished_semaphore_len = graphics_state -> swapchain_render_finished_semaphore_len;
+    VkFence* old_image_fence_array = graphics_state -> swapchain_image_fence_array;
+    VkImage old_depth_image = graphics_state -> depth_image;
+    VkImageView old_depth_image_view = graphics_state -> depth_image_view;
+    struct memory_allocation old_depth_allocation = graphics_state -> depth_allocation;
+
+    // the old swapchain is retired by this call even when it fails
+    handle_error(vkCreateSwapchainKHR(
+        graphics_state -> device,
+        &(VkSwapchainCreateInfoKHR) {
+            .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+            .pNext = NULL,
+            .flags = 0x0,
+            .surface = graphics_state -> surface,
+            .minImageCount = graphics_state -> swapchain_image_len,
+            .imageFormat = graphics_state -> surface_format.format,
+            .imageColorSpace = graphics_state -> surface_format.colorSpace,
+            .imageExtent = graphics_state -> image_extent,
+            .imageArrayLayers = 1,
+            .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+            .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .queueFamilyIndexCount = 0,
+            .pQueueFamilyIndices = NULL,
+            .preTransform = graphics_state -> surface_capabilities.currentTransform,
+            .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+            .presentMode = graphics_state -> present_mode,
+            .clipped = VK_TRUE,
+            .oldSwapchain = old_swapchain
+        },
+        NULL,
+        &graphics_state -> swapchain
+    ), restore_old_state);
+    printf("%s", "Swapchain created\n");
+
+    graphics_state -> swapchain_image_view_len = 0;
+    graphics_state -> swapchain_render_finished_semaphore_len = 0;
+    vkGetSwapchainImagesKHR(graphics_state -> device, graphics_state -> swapchain, &graphics_state -> swapchain_image_len, NULL);
+    graphics_state -> swapchain_image_array = arena_alloc_array(&graphics_state -> swapchain_arena, VkImage, graphics_state -> swapchain_image_len);
+    graphics_state -> swapchain_image_view_array = arena_alloc_array(&graphics_state -> swapchain_arena, VkImageView, graphics_state -> swapchain_image_len);
+    if (graphics_state -> swapchain_image_array == NULL || graphics_state -> swapchain_image_view_array == NULL) {
+        error_code = EXIT_FAILURE;
+        goto destroy_swapchain;
+    }
+    vkGetSwapchainImagesKHR(graphics_state -> device, graphics_state -> swapchain, &graphics_state -> swapchain_image_len, graphics_state -> swapchain_image_array);
+
+    for(graphics_state -> swapchain_image_view_len = 0; graphics_state -> swapchain_image_view_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_image_view_len++) {
+        VkImageView image_view;
+        handle_error(vkCreateImageView(
+            graphics_state -> device,
+            &(VkImageViewCreateInfo) {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                .pNext = NULL,
+                .flags = 0x0,
+                .image = graphics_state -> swapchain_image_array[graphics_state -> swapchain_image_view_len],
+                .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                .format = graphics_state -> surface_format.format,
+                .components = (VkComponentMapping) {
+                    .r = VK_COMPONENT_SWIZZLE_R,
+                    .g = VK_COMPONENT_SWIZZLE_G,
+                    .b = VK_COMPONENT_SWIZZLE_B,
+                    .a = VK_COMPONENT_SWIZZLE_A,
+                },
+                .subresourceRange = (VkImageSubresourceRange) {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .baseMipLevel = 0,
+                    .levelCount = 1,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1
+                }
+            },
+            NULL,
+            &image_view
+        ), destroy_image_views);
+        graphics_state -> swapchain_image_view_array[graphics_state -> swapchain_image_view_len] = image_view;
+    }
+    printf("%s", "Image views created\n");
+
+    if (create_depth_image(graphics_state) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_image_views;
+    }
+
+    if (create_swapchain_sync_objects(graphics_state) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_depth_image;
+    }
+
+    // everything new exists, so the old objects go, retired in the order they have to be destroyed in
+    for (uint32_t i = 0; i < old_render_finished_semaphore_len; i++) {
+        retire_object(graphics_state, (struct retired_object) {.kind = RETIRED_SEMAPHORE, .semaphore = old_render_finished_semaphore_array[i]});
+    }
+    retire_object(graphics_state, (struct retired_object) {.kind = RETIRED_IMAGE_VIEW, .image_view = old_depth_image_view});
+    retire_object(graphics_state, (struct retired_object) {.kind = RETIRED_IMAGE, .image = old_depth_image});
+    retire_object(graphics_state, (struct retired_object) {.kind = RETIRED_ALLOCATION, .allocation = old_depth_allocation});
+    for (uint32_t i = 0; i < old_image_view_len; i++) {
+        retire_object(graphics_state, (struct retired_object) {.kind = RETIRED_IMAGE_VIEW, .image_view = old_image_view_array[i]});
+    }
+    retire_object(graphics_state, (struct retired_object) {.kind = RETIRED_SWAPCHAIN, .swapchain = old_swapchain});
+
+    // the handles now live in the retired objects, so the new arrays move down over the old ones,
+    // keeping their offsets from an aligned start so they stay aligned
+    size_t arena_shift = (arena_mark + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    unsigned char* arena_base = graphics_state -> swapchain_arena.base;
+    memmove(arena_base, arena_base + arena_shift, graphics_state -> swapchain_arena.used - arena_shift);
+    graphics_state -> swapchain_arena.used -= arena_shift;
+    graphics_state -> swapchain_image_array = (VkImage*)((unsigned char*)graphics_state -> swapchain_image_array - arena_shift);
+    graphics_state -> swapchain_image_view_array = (VkImageView*)((unsigned char*)graphics_state -> swapchain_image_view_array - arena_shift);
+    graphics_state -> swapchain_render_finished_semaphore_array = (VkSemaphore*)((unsigned char*)graphics_state -> swapchain_render_finished_semaphore_array - arena_shift);
+    graphics_state -> swapchain_image_fence_array = (VkFence*)((unsigned char*)graphics_state -> swapchain_image_fence_array - arena_shift);
+
+    clock_gettime(CLOCK_MONOTONIC, &recreate_end_time);
+    printf("Swapchain recreated in %.3f ms without idling the device, %u old objects awaiting retirement\n",
+        (double)(recreate_end_time.tv_sec - recreate_start_time.tv_sec) * 1000.0 + (double)(recreate_end_time.tv_nsec - recreate_start_time.tv_nsec) / 1000000.0,
+        graphics_state -> retired_len);
+    return error_code;
+destroy_depth_image:
+    destroy_depth_image(graphics_state);
+destroy_image_views:
+    for(uint32_t i = 0; i < graphics_state -> swapchain_image_view_len; i++) {
+        vkDestroyImageView(graphics_state -> device, graphics_state -> swapchain_image_view_array[i], NULL);
+    }
+destroy_swapchain:
+    vkDestroySwapchainKHR(graphics_state -> device, graphics_state -> swapchain, NULL);
+restore_old_state:
+    graphics_state -> swapchain_arena.used = arena_mark;
+    graphics_state -> image_extent = old_image_extent;
+    graphics_state -> swapchain = old_swapchain;
+    graphics_state -> swapchain_image_array = old_image_array;
+    graphics_state -> swapchain_image_len = old_image_len;
+    graphics_state -> swapchain_image_view_array = old_image_view_array;
+    graphics_state -> swapchain_image_view_len = old_image_view_len;
+    graphics_state -> swapchain_render_finished_semaphore_array = old_render_finished_semaphore_array;
+    graphics_state -> swapchain_render_finished_semaphore_len = old_render_finished_semaphore_len;
+    graphics_state -> swapchain_image_fence_array = old_image_fence_array;
+    graphics_state -> depth_image = old_depth_image;
+    graphics_state -> depth_image_view = old_depth_image_view;
+    graphics_state -> depth_allocation = old_depth_allocation;
+    return error_code;
+}
+
+// Seeds the pipeline cache from disk when the saved data was produced by this exact device and
+// driver, otherwise starts empty. warm is set when saved data was used.
+int create_pipeline_cache(struct graphics_state *graphics_state, int *warm) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+    *warm = 0;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(graphics_state -> physical_device, &properties);
+
+    void* cache_data = NULL;
+    size_t cache_size = 0;
+    FILE *f_cache = fopen(PIPELINE_CACHE_PATH, "rb");
+    if (f_cache != NULL) {
+        fseek(f_cache, 0, SEEK_END);
+        long file_size = ftell(f_cache);
+        fseek(f_cache, 0, SEEK_SET);
+        if (file_size > 0) {
+            cache_data = counted_malloc(file_size);
+            if (cache_data != NULL && fread(cache_data, 1, file_size, f_cache) == (size_t)file_size) {
+                cache_size = (size_t)file_size;
+            }
+        }
+        fclose(f_cache);
+    }
+
+    // VkPipelineCacheHeaderVersionOne, read field by field since the file may be truncated
+    if (cache_size > 0) {
+        uint32_t header_size = 0, header_version = 0, vendor_id = 0, device_id = 0;
+        uint8_t cache_uuid[VK_UUID_SIZE];
+        if (cache_size >= 16 + VK_UUID_SIZE) {
+            memcpy(&header_size, (char*)cache_data, sizeof(uint32_t));
+            memcpy(&header_version, (char*)cache_data + 4, sizeof(uint32_t));
+            memcpy(&vendor_id, (char*)cache_data + 8, sizeof(uint32_t));
+            memcpy(&device_id, (char*)cache_data + 12, sizeof(uint32_t));
+            memcpy(cache_uuid, (char*)cache_data + 16, VK_UUID_SIZE);
+        }
+        if (header_size < 16 + VK_UUID_SIZE || header_size > cache_size
+            || header_version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+            || vendor_id != properties.vendorID
+            || device_id != properties.deviceID
+            || memcmp(cache_uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+            printf("%s", "Pipeline cache on disk is from another device or driver, ignoring it\n");
+            cache_size = 0;
+        }
+    }
+
+    handle_error(vkCreatePipelineCache(
+        graphics_state -> device,
+        &(VkPipelineCacheCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .initialDataSize = cache_size,
+            .pInitialData = cache_size > 0 ? cache_data : NULL
+        },
+        NULL,
+        &graphics_state -> pipeline_cache
+    ), free_cache_data);
+    *warm = cache_size > 0;
+    printf("Pipeline cache created (%zu bytes loaded)\n", cache_size);
+
+free_cache_data:
+    free(cache_data);
+    return error_code;
+}
+
+// Written to a temporary file first so an interrupted save never leaves a torn cache behind.
+int save_pipeline_cache(struct graphics_state *graphics_state) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    size_t cache_size = 0;
+    handle_error(vkGetPipelineCacheData(graphics_state -> device, graphics_state -> pipeline_cache, &cache_size, NULL), exit_function);
+    void* cache_data = counted_malloc(cache_size);
+    if (cache_data == NULL) {
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+    handle_error(vkGetPipelineCacheData(graphics_state -> device, graphics_state -> pipeline_cache, &cache_size, cache_data), free_cache_data);
+
+    FILE *f_cache = fopen(PIPELINE_CACHE_PATH ".tmp", "wb");
+    if (f_cache == NULL) {
+        perror("failed to open pipeline cache for writing");
+        error_code = EXIT_FAILURE;
+        goto free_cache_data;
+    }
+    size_t written = fwrite(cache_data, 1, cache_size, f_cache);
+    fclose(f_cache);
+    if (written != cache_size) {
+        remove(PIPELINE_CACHE_PATH ".tmp");
+        error_code = EXIT_FAILURE;
+        goto free_cache_data;
+    }
+    remove(PIPELINE_CACHE_PATH); // rename does not replace existing files on Windows
+    if (rename(PIPELINE_CACHE_PATH ".tmp", PIPELINE_CACHE_PATH) != 0) {
+        perror("failed to replace pipeline cache");
+        error_code = EXIT_FAILURE;
+        goto free_cache_data;
+    }
+    printf("Pipeline cache saved (%zu bytes)\n", cache_size);
+
+free_cache_data:
+    free(cache_data);
+exit_function:
+    return error_code;
+}
+
+int load_shader_module(struct graphics_state *graphics_state, const char* path, VkShaderModule *shader_module) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    FILE *f_shader = fopen(path, "rb");
+    if (f_shader == NULL) {
+        perror("failed to open shader");
+        return EXIT_FAILURE;
+    }
+    fseek(f_shader, 0, SEEK_END);
+    long fsize_shader = ftell(f_shader);
+    fseek(f_shader, 0, SEEK_SET);
+    uint32_t *shader_code = counted_malloc(fsize_shader);
+    if (shader_code == NULL || fread(shader_code, 1, fsize_shader, f_shader) != (size_t)fsize_shader) {
+        fprintf(stderr, "ERR: failed to read shader %s\n", path);
+        error_code = EXIT_FAILURE;
+        goto free_shader_code;
+    }
+
+    handle_error(vkCreateShaderModule(
+        graphics_state -> device,
+        &(VkShaderModuleCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .codeSize = fsize_shader,
+            .pCode = shader_code
+        },
+        NULL,
+        shader_module
+    ), free_shader_code);
+
+free_shader_code:
+    free(shader_code);
+    fclose(f_shader);
+    return error_code;
+}
+
+// Creates the culling pipeline and buffers for up to instance_capacity instances, which are
+// then supplied with upload_gpu_culling_instances.
+int create_gpu_culling(struct graphics_state *graphics_state, struct gpu_culling *gpu_culling, uint32_t instance_capacity) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    *gpu_culling = (struct gpu_culling) {0};
+    gpu_culling -> instance_capacity = instance_capacity < 1 ? 1 : instance_capacity;
+    if (!graphics_state -> gpu_culling_supported) {
+        fprintf(stderr, "%s", "ERR: GPU culling needs drawIndirectCount and drawIndirectFirstInstance\n");
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+
+    if (load_shader_module(graphics_state, "shaders/cull.spv", &gpu_culling -> shader_module) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto exit_function;
+    }
+
+    // source, cull, visible, draws, draw count
+    VkDescriptorSetLayoutBinding binding_array[5];
+    for (uint32_t i = 0; i < 5; i++) {
+        binding_array[i] = (VkDescriptorSetLayoutBinding) {
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+            .pImmutableSamplers = NULL
+        };
+    }
+    handle_error(vkCreateDescriptorSetLayout(
+        graphics_state -> device,
+        &(VkDescriptorSetLayoutCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .bindingCount = 5,
+            .pBindings = binding_array
+        },
+        NULL,
+        &gpu_culling -> descriptor_set_layout
+    ), destroy_shader_module);
+
+    handle_error(vkCreateDescriptorPool(
+        graphics_state -> device,
+        &(VkDescriptorPoolCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .maxSets = 1,
+            .poolSizeCount = 1,
+            .pPoolSizes = &(VkDescriptorPoolSize) {
+                .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .descriptorCount = 5
+            }
+        },
+        NULL,
+        &gpu_culling -> descriptor_pool
+    ), destroy_descriptor_set_layout);
+
+    handle_error(vkAllocateDescriptorSets(
+        graphics_state -> device,
+        &(VkDescriptorSetAllocateInfo) {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .pNext = NULL,
+            .descriptorPool = gpu_culling -> descriptor_pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &gpu_culling -> descriptor_set_layout
+        },
+        &gpu_culling -> descriptor_set
+    ), destroy_descriptor_pool);
+
+    handle_error(vkCreatePipelineLayout(
+        graphics_state -> device,
+        &(VkPipelineLayoutCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .setLayoutCount = 1,
+            .pSetLayouts = &gpu_culling -> descriptor_set_layout,
+            .pushConstantRangeCount = 1,
+            .pPushConstantRanges = &(VkPushConstantRange) {
+                .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                .offset = 0,
+                .size = offsetof(struct gpu_cull_push_constants, instance_len) + sizeof(uint32_t)
+            }
+        },
+        NULL,
+        &gpu_culling -> pipeline_layout
+    ), destroy_descriptor_pool);
+
+    handle_error(vkCreateComputePipelines(
+        graphics_state -> device,
+        graphics_state -> pipeline_cache,
+        1,
+        &(VkComputePipelineCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .stage = (VkPipelineShaderStageCreateInfo) {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .pNext = NULL,
+                .flags = 0x0,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = gpu_culling -> shader_module,
+                .pName = "main",
+                .pSpecializationInfo = NULL
+            },
+            .layout = gpu_culling -> pipeline_layout,
+            .basePipelineHandle = VK_NULL_HANDLE,
+            .basePipelineIndex = -1
+        },
+        NULL,
+        &gpu_culling -> pipeline
+    ), destroy_pipeline_layout);
+
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, sizeof(struct instance_data) * gpu_culling -> instance_capacity, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &gpu_culling -> source_instance_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_pipeline;
+    }
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, sizeof(struct gpu_cull_instance) * gpu_culling -> instance_capacity, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &gpu_culling -> cull_instance_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_source_instance_buffer;
+    }
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, sizeof(struct instance_data) * gpu_culling -> instance_capacity, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &gpu_culling -> visible_instance_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_cull_instance_buffer;
+    }
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, sizeof(VkDrawIndexedIndirectCommand) * GPU_CULL_MAX_BATCH_LEN, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &gpu_culling -> draw_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_visible_instance_buffer;
+    }
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, sizeof(uint32_t), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_STRATEGY_BUDDY, &gpu_culling -> draw_count_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_draw_buffer;
+    }
+    gpu_culling -> cull_instance_array = counted_malloc(sizeof(struct gpu_cull_instance) * gpu_culling -> instance_capacity);
+    if (gpu_culling -> cull_instance_array == NULL) {
+        perror("failed to allocate cull instances");
+        error_code = EXIT_FAILURE;
+        goto destroy_draw_count_buffer;
+    }
+
+    // the buffers never change, so neither does the descriptor set
+    struct graphics_buffer *storage_buffer_array[5] = {
+        &gpu_culling -> source_instance_buffer,
+        &gpu_culling -> cull_instance_buffer,
+        &gpu_culling -> visible_instance_buffer,
+        &gpu_culling -> draw_buffer,
+        &gpu_culling -> draw_count_buffer
+    };
+    VkDescriptorBufferInfo buffer_info_array[5];
+    VkWriteDescriptorSet write_array[5];
+    for (uint32_t i = 0; i < 5; i++) {
+        buffer_info_array[i] = (VkDescriptorBufferInfo) {
+            .buffer = storage_buffer_array[i] -> buffer,
+            .offset = 0,
+            .range = VK_WHOLE_SIZE
+        };
+        write_array[i] = (VkWriteDescriptorSet) {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = NULL,
+            .dstSet = gpu_culling -> descriptor_set,
+            .dstBinding = i,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pImageInfo = NULL,
+            .pBufferInfo = &buffer_info_array[i],
+            .pTexelBufferView = NULL
+        };
+    }
+    vkUpdateDescriptorSets(graphics_state -> device, 5, write_array, 0, NULL);
+    printf("GPU culling created for %u instances\n", gpu_culling -> instance_capacity);
+
+    return error_code;
+destroy_draw_count_buffer:
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> draw_count_buffer);
+destroy_draw_buffer:
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> draw_buffer);
+destroy_visible_instance_buffer:
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> visible_instance_buffer);
+destroy_cull_instance_buffer:
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> cull_instance_buffer);
+destroy_source_instance_buffer:
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> source_instance_buffer);
+destroy_pipeline:
+    vkDestroyPipeline(graphics_state -> device, gpu_culling -> pipeline, NULL);
+destroy_pipeline_layout:
+    vkDestroyPipelineLayout(graphics_state -> device, gpu_culling -> pipeline_layout, NULL);
+destroy_descriptor_pool:
+    vkDestroyDescriptorPool(graphics_state -> device, gpu_culling -> descriptor_pool, NULL);
+destroy_descriptor_set_layout:
+    vkDestroyDescriptorSetLayout(graphics_state -> device, gpu_culling -> descriptor_set_layout, NULL);
+destroy_shader_module:
+    vkDestroyShaderModule(graphics_state -> device, gpu_culling -> shader_module, NULL);
+exit_function:
+    return error_code;
+}
+
+void destroy_gpu_culling(struct graphics_state *graphics_state, struct gpu_culling *gpu_culling) {
+    free(gpu_culling -> cull_instance_array);
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> draw_count_buffer);
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> draw_buffer);
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> visible_instance_buffer);
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> cull_instance_buffer);
+    destroy_graphics_buffer(graphics_state, &gpu_culling -> source_instance_buffer);
+    vkDestroyPipeline(graphics_state -> device, gpu_culling -> pipeline, NULL);
+    vkDestroyPipelineLayout(graphics_state -> device, gpu_culling -> pipeline_layout, NULL);
+    vkDestroyDescriptorPool(graphics_state -> device, gpu_culling -> descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(graphics_state -> device, gpu_culling -> descriptor_set_layout, NULL);
+    vkDestroyShaderModule(graphics_state -> device, gpu_culling -> shader_module, NULL);
+}
+
+// Replaces the instances that are culled and queues their upload, the returned ticket has to
+// complete before the next dispatch. The batches must cover the instances in order and share
+// one mesh. No submitted frame may still be reading the old instances. Returns 0 on failure.
+uint64_t upload_gpu_culling_instances(struct graphics_state *graphics_state, struct gpu_culling *gpu_culling, const struct instance_data *instance_array, uint32_t instance_len, float instance_radius, const struct instance_batch *batch_array, uint32_t batch_len) {
+    if (instance_len > gpu_culling -> instance_capacity || batch_len == 0 || batch_len > GPU_CULL_MAX_BATCH_LEN) {
+        fprintf(stderr, "ERR: %u instances in %u batches do not fit GPU culling\n", instance_len, batch_len);
+        return 0;
+    }
+    struct gpu_cull_instance *cull_instance_array = gpu_culling -> cull_instance_array;
+    uint32_t covered_len = 0;
+    for (uint32_t b = 0; b < batch_len; b++) {
+        const struct instance_batch *batch = &batch_array[b];
+        if (batch -> mesh != batch_array[0].mesh || batch -> first_instance != covered_len || batch -> first_instance + batch -> instance_len > instance_len) {
+            fprintf(stderr, "%s", "ERR: GPU culled batches must cover the instances in order with one mesh\n");
+            return 0;
+        }
+        gpu_culling -> draw_template_array[b] = (VkDrawIndexedIndirectCommand) {
+            .indexCount = batch -> mesh -> index_len,
+            .instanceCount = 0,
+            .firstIndex = 0,
+            .vertexOffset = 0,
+            .firstInstance = batch -> first_instance
+        };
+        for (uint32_t i = batch -> first_instance; i < batch -> first_instance + batch -> instance_len; i++) {
+            cull_instance_array[i] = (struct gpu_cull_instance) {
+                .sphere = {instance_array[i].model[3][0], instance_array[i].model[3][1], instance_array[i].model[3][2], instance_radius},
+                .batch = b
+            };
+        }
+        covered_len += batch -> instance_len;
+    }
+    if (covered_len != instance_len) {
+        fprintf(stderr, "%s", "ERR: GPU culled batches must cover the instances in order with one mesh\n");
+        return 0;
+    }
+
+    // the upload copies into the staging ring right away, so the array is free for the next call
+    uint64_t source_ticket = upload_graphics_buffer(graphics_state, instance_array, sizeof(struct instance_data) * instance_len, &gpu_culling -> source_instance_buffer, 0);
+    uint64_t cull_ticket = upload_graphics_buffer(graphics_state, cull_instance_array, sizeof(struct gpu_cull_instance) * instance_len, &gpu_culling -> cull_instance_buffer, 0);
+    if (source_ticket == 0 || cull_ticket == 0) {
+        fprintf(stderr, "%s", "ERR: failed to upload GPU culled instances\n");
+        return 0;
+    }
+    gpu_culling -> instance_len = instance_len;
+    gpu_culling -> batch_len = batch_len;
+    gpu_culling -> mesh = batch_array[0].mesh;
+    // tickets complete in order
+    return cull_ticket > source_ticket ? cull_ticket : source_ticket;
+}
+
+// Resets the indirect draws and dispatches the culling shader, recorded before rendering begins.
+void record_gpu_culling(VkCommandBuffer command_buffer, struct gpu_culling *gpu_culling, vec4 plane_array[6]) {
+    // the previous frame's draws read these buffers, which only needs an execution dependency
+    vkCmdPipelineBarrier2(command_buffer, &(VkDependencyInfo) {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = NULL,
+        .dependencyFlags = 0x0,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &(VkMemoryBarrier2) {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+            .pNext = NULL,
+            .srcStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+            .srcAccessMask = VK_ACCESS_2_NONE,
+            .dstStageMask = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask = VK_ACCESS_2_NONE
+        },
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers = NULL,
+        .imageMemoryBarrierCount = 0,
+        .pImageMemoryBarriers = NULL
+    });
+    vkCmdUpdateBuffer(command_buffer, gpu_culling -> draw_buffer.buffer, 0, sizeof(VkDrawIndexedIndirectCommand) * gpu_culling -> batch_len, gpu_culling -> draw_template_array);
+    vkCmdFillBuffer(command_buffer, gpu_culling -> draw_count_buffer.buffer, 0, sizeof(uint32_t), 0);
+    vkCmdPipelineBarrier2(command_buffer, &(VkDependencyInfo) {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = NULL,
+        .dependencyFlags = 0x0,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &(VkMemoryBarrier2) {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+            .pNext = NULL,
+            .srcStageMask = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT,
+            .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+        },
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers = NULL,
+        .imageMemoryBarrierCount = 0,
+        .pImageMemoryBarriers = NULL
+    });
+
+    struct gpu_cull_push_constants push_constants;
+    memcpy(push_constants.plane_array, plane_array, sizeof(push_constants.plane_array));
+    push_constants.instance_len = gpu_culling -> instance_len;
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpu_culling -> pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, gpu_culling -> pipeline_layout, 0, 1, &gpu_culling -> descriptor_set, 0, NULL);
+    vkCmdPushConstants(command_buffer, gpu_culling -> pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, offsetof(struct gpu_cull_push_constants, instance_len) + sizeof(uint32_t), &push_constants);
+    vkCmdDispatch(command_buffer, (gpu_culling -> instance_len + GPU_CULL_WORKGROUP_SIZE - 1) / GPU_CULL_WORKGROUP_SIZE, 1, 1);
+
+    vkCmdPipelineBarrier2(command_buffer, &(VkDependencyInfo) {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = NULL,
+        .dependencyFlags = 0x0,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &(VkMemoryBarrier2) {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+            .pNext = NULL,
+            .srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT,
+            .dstAccessMask = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT
+        },
+        .bufferMemoryBarrierCount = 0,
+        .pBufferMemoryBarriers = NULL,
+        .imageMemoryBarrierCount = 0,
+        .pImageMemoryBarriers = NULL
+    });
+}
+
+// Draws whatever the last record_gpu_culling left visible, while rendering.
+void draw_gpu_culled_instances(VkCommandBuffer command_buffer, struct gpu_culling *gpu_culling) {
+    if (gpu_culling -> mesh == NULL) {
+        return;
+    }
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &gpu_culling -> mesh -> vertex_buffer.buffer, &offset);
+    vkCmdBindVertexBuffers(command_buffer, 1, 1, &gpu_culling -> visible_instance_buffer.buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, gpu_culling -> mesh -> index_buffer.buffer, 0, gpu_culling -> mesh -> index_type);
+    vkCmdDrawIndexedIndirectCount(command_buffer, gpu_culling -> draw_buffer.buffer, 0, gpu_culling -> draw_count_buffer.buffer, 0, gpu_culling -> batch_len, sizeof(VkDrawIndexedIndirectCommand));
+}
+
+// What one frame hands the recording threads. The batches must stay untouched until
+// wait_parallel_recording returns.
+struct record_job {
+    struct frame_state *frame;
+    uint32_t frame_index;
+    VkViewport viewport;
+    VkRect2D scissor;
+    uint32_t camera_uniform_offset;
+    const struct instance_batch *batch_array;
+    uint32_t batch_len;
+    VkQueryPipelineStatisticFlags pipeline_statistics; // of the query active in the primary, or 0
+};
+
+struct record_worker {
+    struct parallel_recorder *recorder;
+    thrd_t thread;
+    uint32_t index;
+    uint64_t generation; // of the last job taken
+    VkResult result;
+};
+
+#define MAX_RECORD_THREADS 16
+#define RECORD_PHASE_DEPTH_PREPASS 0
+#define RECORD_PHASE_COLOR 1
+#define RECORD_PHASE_LEN 2
+
+// Records the instance draws of a frame into secondary command buffers on worker threads. Each
+// thread owns one command pool per frame slot, so no pool is ever touched by two threads, and
+// takes a disjoint slice of the instances. Slices are even splits of the instance count, not one
+// per draw group: the scene has no terrain, building, belt or item groups yet, only the batches
+// of one mesh each, and usually a single batch that would leave every other thread idle. The primary executes every depth pre-pass slice before
+// any color slice, keeping the pre-pass complete before the EQUAL depth test reads it. With
+// dynamic rendering the secondaries only inherit attachment formats, not a render pass and
+// framebuffer, so they do not depend on the swapchain image they end up drawing into.
+struct parallel_recorder {
+    struct graphics_state *graphics_state;
+    uint32_t thread_len;
+    VkCommandPool command_pool_array[MAX_FRAMES_IN_FLIGHT][MAX_RECORD_THREADS];
+    VkCommandBuffer command_buffer_array[MAX_FRAMES_IN_FLIGHT][RECORD_PHASE_LEN][MAX_RECORD_THREADS];
+    struct record_worker worker_array[MAX_RECORD_THREADS];
+    uint32_t worker_len; // threads started
+    uint32_t sync_len; // of mutex, work_condition and done_condition in that order, how many were initialized
+    mtx_t mutex;
+    cnd_t work_condition;
+    cnd_t done_condition;
+    uint64_t generation;
+    uint32_t pending_len;
+    int quit;
+    struct record_job job;
+};
+
+// Draws the instances in [first, last) of the concatenated batches, so slices can split batches.
+void draw_instance_batch_slice(VkCommandBuffer command_buffer, struct frame_state *frame, const struct instance_batch *batch_array, uint32_t batch_len, uint32_t first, uint32_t last) {
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 1, 1, &frame -> instance_buffer.buffer, &offset);
+    struct graphics_mesh *bound_mesh = NULL;
+    uint32_t batch_start = 0;
+    for (uint32_t i = 0; i < batch_len && batch_start < last; i++) {
+        const struct instance_batch *batch = &batch_array[i];
+        uint32_t start = first > batch_start ? first - batch_start : 0;
+        uint32_t end = last - batch_start < batch -> instance_len ? last - batch_start : batch -> instance_len;
+        batch_start += batch -> instance_len;
+        if (start >= end) {
+            continue;
+        }
+        if (batch -> mesh != bound_mesh) {
+            vkCmdBindVertexBuffers(command_buffer, 0, 1, &batch -> mesh -> vertex_buffer.buffer, &offset);
+            vkCmdBindIndexBuffer(command_buffer, batch -> mesh -> index_buffer.buffer, 0, batch -> mesh -> index_type);
+            bound_mesh = batch -> mesh;
+        }
+        vkCmdDrawIndexed(command_buffer, batch -> mesh -> index_len, end - start, 0, 0, batch -> first_instance + start);
+    }
+}
+
+VkResult record_instance_slice(struct parallel_recorder *recorder, uint32_t index) {
+    struct graphics_state *graphics_state = recorder -> graphics_state;
+    struct record_job *job = &recorder -> job;
+    VkResult vk_result = vkResetCommandPool(graphics_state -> device, recorder -> command_pool_array[job -> frame_index][index], 0x0);
+    if (vk_result != VK_SUCCESS) {
+        return vk_result;
+    }
+
+    uint32_t instance_len = 0;
+    for (uint32_t i = 0; i < job -> batch_len; i++) {
+        instance_len += job -> batch_array[i].instance_len;
+    }
+    uint32_t first = (uint32_t)((uint64_t)instance_len * index / recorder -> thread_len);
+    uint32_t last = (uint32_t)((uint64_t)instance_len * (index + 1) / recorder -> thread_len);
+
+    for (uint32_t phase = 0; phase < RECORD_PHASE_LEN; phase++) {
+        VkPipeline pipeline = phase == RECORD_PHASE_COLOR ? graphics_state -> pipeline : graphics_state -> depth_prepass_pipeline;
+        if (pipeline == VK_NULL_HANDLE) {
+            continue;
+        }
+        VkCommandBuffer command_buffer = recorder -> command_buffer_array[job -> frame_index][phase][index];
+        vk_result = vkBeginCommandBuffer(
+            command_buffer,
+            &(VkCommandBufferBeginInfo) {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                .pNext = NULL,
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+                .pInheritanceInfo = &(VkCommandBufferInheritanceInfo) {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+                    .pNext = &(VkCommandBufferInheritanceRenderingInfo) {
+                        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+                        .pNext = NULL,
+                        .flags = 0x0,
+                        .viewMask = 0,
+                        .colorAttachmentCount = 1,
+                        .pColorAttachmentFormats = &graphics_state -> surface_format.format,
+                        .depthAttachmentFormat = graphics_state -> depth_format,
+                        .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+                        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT
+                    },
+                    .renderPass = VK_NULL_HANDLE,
+                    .subpass = 0,
+                    .framebuffer = VK_NULL_HANDLE,
+                    .occlusionQueryEnable = VK_FALSE,
+                    .queryFlags = 0x0,
+                    .pipelineStatistics = job -> pipeline_statistics
+                }
+            }
+        );
+        if (vk_result != VK_SUCCESS) {
+            return vk_result;
+        }
+        // nothing is inherited from the primary but the attachment formats
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_state -> pipeline_layout, 0, 1, &graphics_state -> descriptor_set, 1, &job -> camera_uniform_offset);
+        vkCmdSetViewport(command_buffer, 0, 1, &job -> viewport);
+        vkCmdSetScissor(command_buffer, 0, 1, &job -> scissor);
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        draw_instance_batch_slice(command_buffer, job -> frame, job -> batch_array, job -> batch_len, first, last);
+        vk_result = vkEndCommandBuffer(command_buffer);
+        if (vk_result != VK_SUCCESS) {
+            return vk_result;
+        }
+    }
+    return VK_SUCCESS;
+}
+
+int record_worker_main(void *argument) {
+    struct record_worker *worker = argument;
+    struct parallel_recorder *recorder = worker -> recorder;
+#ifdef FACTORY_PROFILE
+    char thread_name[PROFILE_THREAD_NAME_LEN];
+    snprintf(thread_name, sizeof(thread_name), "record worker %u", worker -> index);
+    PROFILE_THREAD(thread_name);
+#endif
+    mtx_lock(&recorder -> mutex);
+    while (1) {
+        while (recorder -> generation == worker -> generation && !recorder -> quit) {
+            cnd_wait(&recorder -> work_condition, &recorder -> mutex);
+        }
+        if (recorder -> quit) {
+            break;
+        }
+        worker -> generation = recorder -> generation;
+        mtx_unlock(&recorder -> mutex);
+
+        PROFILE_BEGIN(slice_zone, "record slice");
+        VkResult result = record_instance_slice(recorder, worker -> index);
+        PROFILE_END(slice_zone);
+
+        mtx_lock(&recorder -> mutex);
+        worker -> result = result;
+        recorder -> pending_len--;
+        if (recorder -> pending_len == 0) {
+            cnd_signal(&recorder -> done_condition);
+        }
+    }
+    mtx_unlock(&recorder -> mutex);
+    return 0;
+}
+
+void destroy_parallel_recorder(struct parallel_recorder *recorder) {
+    if (recorder -> worker_len > 0) {
+        mtx_lock(&recorder -> mutex);
+        recorder -> quit = 1;
+        cnd_broadcast(&recorder -> work_condition);
+        mtx_unlock(&recorder -> mutex);
+        for (uint32_t i = 0; i < recorder -> worker_len; i++) {
+            thrd_join(recorder -> worker_array[i].thread, NULL);
+        }
+        recorder -> worker_len = 0;
+    }
+    if (recorder -> sync_len > 2) {
+        cnd_destroy(&recorder -> done_condition);
+    }
+    if (recorder -> sync_len > 1) {
+        cnd_destroy(&recorder -> work_condition);
+    }
+    if (recorder -> sync_len > 0) {
+        mtx_destroy(&recorder -> mutex);
+    }
+    recorder -> sync_len = 0;
+    // freeing the pools frees their command buffers
+    for (uint32_t f = 0; f < MAX_FRAMES_IN_FLIGHT; f++) {
+        for (uint32_t i = 0; i < recorder -> thread_len; i++) {
+            vkDestroyCommandPool(recorder -> graphics_state -> device, recorder -> command_pool_array[f][i], NULL);
+        }
+    }
+}
+
+int create_parallel_recorder(struct graphics_state *graphics_state, struct parallel_recorder *recorder, uint32_t thread_len) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    *recorder = (struct parallel_recorder) {0};
+    recorder -> graphics_state = graphics_state;
+    recorder -> thread_len = thread_len < 1 ? 1 : thread_len > MAX_RECORD_THREADS ? MAX_RECORD_THREADS : thread_len;
+    if (mtx_init(&recorder -> mutex, mtx_plain) != thrd_success) {
+        fprintf(stderr, "%s", "ERR: failed to create recording thread mutex\n");
+        error_code = EXIT_FAILURE;
+        goto destroy_recorder;
+    }
+    recorder -> sync_len = 1;
+    if (cnd_init(&recorder -> work_condition) != thrd_success) {
+        fprintf(stderr, "%s", "ERR: failed to create recording thread condition\n");
+        error_code = EXIT_FAILURE;
+        goto destroy_recorder;
+    }
+    recorder -> sync_len = 2;
+    if (cnd_init(&recorder -> done_condition) != thrd_success) {
+        fprintf(stderr, "%s", "ERR: failed to create recording thread condition\n");
+        error_code = EXIT_FAILURE;
+        goto destroy_recorder;
+    }
+    recorder -> sync_len = 3;
+
+    for (uint32_t f = 0; f < graphics_state -> frame_len; f++) {
+        for (uint32_t i = 0; i < recorder -> thread_len; i++) {
+            handle_error(vkCreateCommandPool(
+                graphics_state -> device,
+                &(VkCommandPoolCreateInfo) {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                    .pNext = NULL,
+                    .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                    .queueFamilyIndex = graphics_state -> queue_family_index
+                },
+                NULL,
+                &recorder -> command_pool_array[f][i]
+            ), destroy_recorder);
+            VkCommandBuffer command_buffer_array[RECORD_PHASE_LEN];
+            handle_error(vkAllocateCommandBuffers(
+                graphics_state -> device,
+                &(VkCommandBufferAllocateInfo) {
+                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                    .pNext = NULL,
+                    .commandPool = recorder -> command_pool_array[f][i],
+                    .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                    .commandBufferCount = RECORD_PHASE_LEN
+                },
+                command_buffer_array
+            ), destroy_recorder);
+            for (uint32_t phase = 0; phase < RECORD_PHASE_LEN; phase++) {
+                recorder -> command_buffer_array[f][phase][i] = command_buffer_array[phase];
+            }
+        }
     }
-    printf("%s", "Image views created\n");
 
-    graphics_state -> framebuffer_array = malloc(sizeof(VkFramebuffer) * graphics_state -> swapchain_image_len);
-    for (graphics_state -> framebuffer_len = 0; graphics_state -> framebuffer_len < graphics_state -> swapchain_image_len; graphics_state -> framebuffer_len++) {
-        VkFramebuffer framebuffer;
-        handle_error(vkCreateFramebuffer(
-            graphics_state -> device,
-            &(VkFramebufferCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .renderPass = graphics_state -> render_pass,
-                .attachmentCount = 1,
-                .pAttachments = &graphics_state -> swapchain_image_view_array[graphics_state -> framebuffer_len],
-                .width = graphics_state -> image_extent.width,
-                .height = graphics_state -> image_extent.height, 
-                .layers = 1
-            },
-            NULL,
-            &framebuffer
-        ), destroy_image_views);
-        graphics_state -> framebuffer_array[graphics_state -> framebuffer_len] = framebuffer;
+    for (recorder -> worker_len = 0; recorder -> worker_len < recorder -> thread_len; recorder -> worker_len++) {
+        struct record_worker *worker = &recorder -> worker_array[recorder -> worker_len];
+        *worker = (struct record_worker) {
+            .recorder = recorder,
+            .index = recorder -> worker_len,
+            .generation = 0,
+            .result = VK_SUCCESS
+        };
+        if (thrd_create(&worker -> thread, record_worker_main, worker) != thrd_success) {
+            perror("failed to start recording thread");
+            error_code = EXIT_FAILURE;
+            goto destroy_recorder;
+        }
     }
-    printf("%s", "Frame buffers created\n");
+    printf("Parallel recording with %u threads\n", recorder -> thread_len);
+    return error_code;
 
+destroy_recorder:
+    // pools that were never created are VK_NULL_HANDLE, which vkDestroyCommandPool ignores
+    destroy_parallel_recorder(recorder);
     return error_code;
-destroy_image_views:
-    for(int i = 0; i < graphics_state -> swapchain_image_view_len; i++) {
-        VkImageView image_view = graphics_state -> swapchain_image_view_array[i];
-        vkDestroyImageView(graphics_state -> device, image_view, NULL);
+}
+
+// Hands the frame's draws to the recording threads, which start right away.
+void begin_parallel_recording(struct parallel_recorder *recorder, const struct record_job *job) {
+    mtx_lock(&recorder -> mutex);
+    recorder -> job = *job;
+    recorder -> pending_len = recorder -> thread_len;
+    recorder -> generation++;
+    cnd_broadcast(&recorder -> work_condition);
+    mtx_unlock(&recorder -> mutex);
+}
+
+// Waits for every slice, then executes them from the primary, which must be rendering with
+// VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT.
+int end_parallel_recording(struct parallel_recorder *recorder, VkCommandBuffer primary_command_buffer) {
+    int error_code = EXIT_SUCCESS;
+    mtx_lock(&recorder -> mutex);
+    while (recorder -> pending_len > 0) {
+        cnd_wait(&recorder -> done_condition, &recorder -> mutex);
     }
-destroy_swapchain:
-    vkDestroySwapchainKHR(graphics_state -> device, graphics_state -> swapchain, NULL);
-exit_function:
+    mtx_unlock(&recorder -> mutex);
+    for (uint32_t i = 0; i < recorder -> thread_len; i++) {
+        if (recorder -> worker_array[i].result != VK_SUCCESS) {
+            fprintf(stderr, "ERR: recording thread %u failed with %d\n", i, recorder -> worker_array[i].result);
+            error_code = EXIT_FAILURE;
+        }
+    }
+    if (error_code != EXIT_SUCCESS) {
+        return error_code;
+    }
+    uint32_t frame_index = recorder -> job.frame_index;
+    if (recorder -> graphics_state -> depth_prepass_pipeline != VK_NULL_HANDLE) {
+        vkCmdExecuteCommands(primary_command_buffer, recorder -> thread_len, recorder -> command_buffer_array[frame_index][RECORD_PHASE_DEPTH_PREPASS]);
+    }
+    vkCmdExecuteCommands(primary_command_buffer, recorder -> thread_len, recorder -> command_buffer_array[frame_index][RECORD_PHASE_COLOR]);
     return error_code;
 }
 
-int create_graphics_state(struct graphics_state *graphics_state) {
+const char* present_mode_name(VkPresentModeKHR present_mode) {
+    switch (present_mode) {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+        return "immediate";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+        return "mailbox";
+    case VK_PRESENT_MODE_FIFO_KHR:
+        return "fifo";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+        return "fifo relaxed";
+    default:
+        return "unknown";
+    }
+}
+
+int device_extension_supported(struct graphics_state *graphics_state, const char *extension_name) {
+    for (uint32_t i = 0; i < graphics_state -> extension_num; i++) {
+        if (strcmp(graphics_state -> extension_array[i].extensionName, extension_name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// preferred_present_mode falls back to FIFO, the only mode every surface supports. FIFO paces to
+// the display and saves power, mailbox keeps the newest frame for low latency without tearing,
+// immediate has the lowest latency but tears.
+int create_graphics_state(struct graphics_state *graphics_state, uint32_t frames_in_flight, int depth_prepass, VkPresentModeKHR preferred_present_mode) {
     int error_code = EXIT_SUCCESS;
     VkResult vk_result;
 
+    if (frames_in_flight < MIN_FRAMES_IN_FLIGHT) {
+        frames_in_flight = MIN_FRAMES_IN_FLIGHT;
+    }
+    if (frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+        frames_in_flight = MAX_FRAMES_IN_FLIGHT;
+    }
+    graphics_state -> frame_len = 0;
+
     glfwInit();
     glfwSetErrorCallback(&error_handle_glfw);
     if(!glfwVulkanSupported()) {
@@ -345,7 +2095,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
 
     uint32_t glfw_extension_len;
     glfwGetRequiredInstanceExtensions(&glfw_extension_len);
-    const char** glfw_extension_array = malloc(sizeof(char*) * glfw_extension_len);
+    const char** glfw_extension_array = counted_malloc(sizeof(char*) * glfw_extension_len);
     glfw_extension_array = glfwGetRequiredInstanceExtensions(&glfw_extension_len);
     //extensions[instance_extension_count] = "VK_KHR_swapchain";
     //for(int i = 0; i < graphics_state -> extension_num; i++) {
@@ -383,7 +2133,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
         // order of priority is descrete, integrated, virtual, cpu, other
         int type_to_prio[5] = { 4, 1, 0, 2, 3 };
         handle_error(vkEnumeratePhysicalDevices(graphics_state -> instance, &graphics_state -> physical_device_len, NULL), destroy_instance);
-        graphics_state -> physical_device_array = malloc(sizeof(VkPhysicalDevice)*graphics_state -> physical_device_len);
+        graphics_state -> physical_device_array = counted_malloc(sizeof(VkPhysicalDevice)*graphics_state -> physical_device_len);
         handle_error(vkEnumeratePhysicalDevices(graphics_state -> instance, &graphics_state -> physical_device_len, graphics_state -> physical_device_array), destroy_instance);
         int best_i = 0;
         int best_prio = 5;
@@ -404,50 +2154,140 @@ int create_graphics_state(struct graphics_state *graphics_state) {
 
     uint32_t queue_family_num;
     vkGetPhysicalDeviceQueueFamilyProperties(graphics_state -> physical_device, &queue_family_num, NULL);
-    VkQueueFamilyProperties* queue_family_properties = malloc(sizeof(VkQueueFamilyProperties)*queue_family_num);
+    VkQueueFamilyProperties* queue_family_properties = counted_malloc(sizeof(VkQueueFamilyProperties)*queue_family_num);
     vkGetPhysicalDeviceQueueFamilyProperties(graphics_state -> physical_device, &queue_family_num, queue_family_properties);
-    for(graphics_state -> queue_family_index = 0;
-        !(queue_family_properties[graphics_state -> queue_family_index].queueFlags | VK_QUEUE_GRAPHICS_BIT); graphics_state -> queue_family_index++) {
+    graphics_state -> queue_family_index = 0;
+    while(!(queue_family_properties[graphics_state -> queue_family_index].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+        graphics_state -> queue_family_index++;
         if(graphics_state -> queue_family_index == queue_family_num) {
             perror("ERR: Can't find graphics queue!!");
+            free(queue_family_properties);
             error_code = EXIT_FAILURE;
             goto destroy_instance;
         }
     }
 
-    const char* const device_extension[1] = {"VK_KHR_swapchain"};
+    // prefer a transfer-only family (the copy engine), then any non-graphics family with transfer
+    graphics_state -> transfer_queue_family_index = graphics_state -> queue_family_index;
+    for(int i = 0; i < queue_family_num; i++) {
+        VkQueueFlags flags = queue_family_properties[i].queueFlags;
+        if((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            graphics_state -> transfer_queue_family_index = i;
+            if(!(flags & VK_QUEUE_COMPUTE_BIT)) {
+                break;
+            }
+        }
+    }
+    free(queue_family_properties);
+
+    VkDeviceQueueCreateInfo queue_create_info_array[2] = {
+        (VkDeviceQueueCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .queueFamilyIndex = graphics_state -> queue_family_index,
+            .queueCount = 1,
+            .pQueuePriorities = ((const float[1]){1.0})
+        },
+        (VkDeviceQueueCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .queueFamilyIndex = graphics_state -> transfer_queue_family_index,
+            .queueCount = 1,
+            .pQueuePriorities = ((const float[1]){1.0})
+        }
+    };
+
+    printf("%s", "Loading extensions\n");
+    vkEnumerateDeviceExtensionProperties(graphics_state -> physical_device, NULL, &graphics_state -> extension_num, NULL);
+    graphics_state -> extension_array = counted_malloc(sizeof(VkExtensionProperties) * graphics_state -> extension_num);
+    vkEnumerateDeviceExtensionProperties(graphics_state -> physical_device, NULL, &graphics_state -> extension_num, graphics_state -> extension_array);
+    for(int i = 0; i < graphics_state -> extension_num; i++) {
+        printf("%s\n", graphics_state -> extension_array[i].extensionName);
+    }
+
+    VkPhysicalDevicePresentWaitFeaturesKHR supported_present_wait_features = (VkPhysicalDevicePresentWaitFeaturesKHR) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        .pNext = NULL
+    };
+    VkPhysicalDevicePresentIdFeaturesKHR supported_present_id_features = (VkPhysicalDevicePresentIdFeaturesKHR) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+        .pNext = &supported_present_wait_features
+    };
+    int present_wait_extensions_supported = device_extension_supported(graphics_state, "VK_KHR_present_id") && device_extension_supported(graphics_state, "VK_KHR_present_wait");
+    VkPhysicalDeviceVulkan12Features supported_vulkan_12_features = (VkPhysicalDeviceVulkan12Features) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .pNext = present_wait_extensions_supported ? &supported_present_id_features : NULL
+    };
+    VkPhysicalDeviceFeatures2 supported_features = (VkPhysicalDeviceFeatures2) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &supported_vulkan_12_features
+    };
+    vkGetPhysicalDeviceFeatures2(graphics_state -> physical_device, &supported_features);
+
+    // GPU culling and overdraw statistics are optional, so they are enabled when available rather than required
+    graphics_state -> gpu_culling_supported = supported_vulkan_12_features.drawIndirectCount && supported_features.features.drawIndirectFirstInstance;
+    graphics_state -> present_wait_supported = present_wait_extensions_supported && supported_present_id_features.presentId && supported_present_wait_features.presentWait;
+    graphics_state -> wait_for_present = NULL;
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = (VkPhysicalDevicePresentWaitFeaturesKHR) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        .pNext = NULL,
+        .presentWait = VK_TRUE
+    };
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features = (VkPhysicalDevicePresentIdFeaturesKHR) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+        .pNext = &present_wait_features,
+        .presentId = VK_TRUE
+    };
+    // both are required of every Vulkan 1.3 device
+    VkPhysicalDeviceVulkan13Features vulkan_13_features = (VkPhysicalDeviceVulkan13Features) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES,
+        .pNext = graphics_state -> present_wait_supported ? &present_id_features : NULL,
+        .synchronization2 = VK_TRUE,
+        .dynamicRendering = VK_TRUE
+    };
+    VkPhysicalDeviceVulkan12Features vulkan_12_features = (VkPhysicalDeviceVulkan12Features) {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .pNext = &vulkan_13_features,
+        .drawIndirectCount = graphics_state -> gpu_culling_supported ? VK_TRUE : VK_FALSE,
+        .timelineSemaphore = VK_TRUE
+    };
+    VkPhysicalDeviceFeatures enabled_features = (VkPhysicalDeviceFeatures) {0};
+    enabled_features.pipelineStatisticsQuery = supported_features.features.pipelineStatisticsQuery;
+    enabled_features.inheritedQueries = supported_features.features.inheritedQueries;
+    graphics_state -> inherited_queries_supported = supported_features.features.inheritedQueries && supported_features.features.pipelineStatisticsQuery;
+    enabled_features.drawIndirectFirstInstance = graphics_state -> gpu_culling_supported ? VK_TRUE : VK_FALSE;
+
+    const char* const device_extension[3] = {"VK_KHR_swapchain", "VK_KHR_present_id", "VK_KHR_present_wait"};
     handle_error(vkCreateDevice(
         graphics_state -> physical_device,
         &(VkDeviceCreateInfo) {
             .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-            .pNext = NULL,
+            .pNext = &vulkan_12_features,
             .flags = 0x0,
-            .queueCreateInfoCount = 1,
-            .pQueueCreateInfos = &(VkDeviceQueueCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .queueFamilyIndex = graphics_state -> queue_family_index,
-                .queueCount = 1,
-                .pQueuePriorities = ((const float[1]){1.0})
-            },
+            .queueCreateInfoCount = graphics_state -> transfer_queue_family_index == graphics_state -> queue_family_index ? 1 : 2,
+            .pQueueCreateInfos = queue_create_info_array,
             .enabledLayerCount = 0,
             .ppEnabledLayerNames = NULL,
-            .enabledExtensionCount = 1,
+            .enabledExtensionCount = graphics_state -> present_wait_supported ? 3 : 1,
             .ppEnabledExtensionNames = device_extension,
-            .pEnabledFeatures = NULL
+            .pEnabledFeatures = &enabled_features
         },
         NULL,
         &graphics_state -> device
     ), destroy_instance);
     printf("%s", "Device created\n");
 
-    printf("%s", "Loading extensions\n");
-    vkEnumerateDeviceExtensionProperties(graphics_state -> physical_device, NULL, &graphics_state -> extension_num, NULL);
-    graphics_state -> extension_array = malloc(sizeof(VkExtensionProperties) * graphics_state -> extension_num);
-    vkEnumerateDeviceExtensionProperties(graphics_state -> physical_device, NULL, &graphics_state -> extension_num, graphics_state -> extension_array);
-    for(int i = 0; i < graphics_state -> extension_num; i++) {
-        printf("%s\n", graphics_state -> extension_array[i].extensionName);
+    if (graphics_state -> present_wait_supported) {
+        graphics_state -> wait_for_present = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(graphics_state -> device, "vkWaitForPresentKHR");
+        graphics_state -> present_wait_supported = graphics_state -> wait_for_present != NULL;
+    }
+
+    if (create_memory_allocator(&graphics_state -> allocator, graphics_state -> physical_device, graphics_state -> device) != EXIT_SUCCESS) {
+        perror("ERR: failed to create memory allocator");
+        error_code = EXIT_FAILURE;
+        goto destory_device;
     }
 
     graphics_state -> monitor = glfwGetPrimaryMonitor();
@@ -455,7 +2295,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
     if(!graphics_state -> monitor) {
         perror("ERR: The program cannot find your primary monitor");
         error_code = -1;
-        goto destory_device;
+        goto destroy_allocator;
     }
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
@@ -475,18 +2315,15 @@ int create_graphics_state(struct graphics_state *graphics_state) {
     ), destroy_window);
     printf("%s", "Surface created\n");
 
-    int width, height;
-    glfwGetFramebufferSize(graphics_state -> window, &width, &height);
-    graphics_state -> image_extent = (VkExtent2D) {
-        .width = width,
-        .height = height
-    };
-
-    vkGetPhysicalDeviceSurfaceCapabilitiesKHR(graphics_state -> physical_device, graphics_state -> surface, &graphics_state -> surface_capabilities);
+    if (!update_image_extent(graphics_state)) {
+        fprintf(stderr, "%s", "ERR: window closed before it had a framebuffer\n");
+        error_code = EXIT_FAILURE;
+        goto destroy_surface;
+    }
 
     uint32_t surface_format_count;
     vkGetPhysicalDeviceSurfaceFormatsKHR(graphics_state -> physical_device, graphics_state -> surface, &surface_format_count, NULL);
-    VkSurfaceFormatKHR *surface_format_array = malloc(sizeof(VkSurfaceFormatKHR) * surface_format_count);
+    VkSurfaceFormatKHR *surface_format_array = counted_malloc(sizeof(VkSurfaceFormatKHR) * surface_format_count);
     vkGetPhysicalDeviceSurfaceFormatsKHR(graphics_state -> physical_device, graphics_state -> surface, &surface_format_count, surface_format_array);
     graphics_state -> surface_format = surface_format_array[0];
 
@@ -500,17 +2337,28 @@ int create_graphics_state(struct graphics_state *graphics_state) {
 
     uint32_t present_mode_count;
     vkGetPhysicalDeviceSurfacePresentModesKHR(graphics_state -> physical_device, graphics_state -> surface, &present_mode_count, NULL);
-    VkPresentModeKHR *present_mode_array = malloc(sizeof(VkPresentModeKHR) * present_mode_count);
+    VkPresentModeKHR *present_mode_array = counted_malloc(sizeof(VkPresentModeKHR) * present_mode_count);
     vkGetPhysicalDeviceSurfacePresentModesKHR(graphics_state -> physical_device, graphics_state -> surface, &present_mode_count, present_mode_array);
-    graphics_state -> present_mode = present_mode_array[0];
+    graphics_state -> present_mode = VK_PRESENT_MODE_FIFO_KHR;
 
     for(int i = 0; i < present_mode_count; i++) {
         VkPresentModeKHR available_present_mode = present_mode_array[i];
-        if(available_present_mode == VK_PRESENT_MODE_MAILBOX_KHR) {
+        if(available_present_mode == preferred_present_mode) {
             graphics_state -> present_mode = available_present_mode;
             break;
         }
     }
+    printf("Present mode: %s (%s requested), present wait %s\n", present_mode_name(graphics_state -> present_mode), present_mode_name(preferred_present_mode), graphics_state -> present_wait_supported ? "supported" : "unsupported");
+
+    graphics_state -> retired_array = NULL;
+    graphics_state -> retired_len = 0;
+    graphics_state -> retired_capacity = 0;
+    graphics_state -> submitted_frame_serial = 0;
+    graphics_state -> completed_frame_serial = 0;
+    if (create_arena(&graphics_state -> swapchain_arena, SWAPCHAIN_ARENA_SIZE) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_surface;
+    }
 
     graphics_state -> swapchain_image_len = graphics_state -> surface_capabilities.minImageCount;
     handle_error(vkCreateSwapchainKHR(
@@ -537,13 +2385,14 @@ int create_graphics_state(struct graphics_state *graphics_state) {
         },
         NULL,
         &graphics_state -> swapchain
-    ), destroy_surface);
+    ), destroy_swapchain_arena);
     printf("%s", "Swapchain created\n");
 
-    graphics_state -> swapchain_image_array = malloc(sizeof(VkImage) * graphics_state -> swapchain_image_len);
+    vkGetSwapchainImagesKHR(graphics_state -> device, graphics_state -> swapchain, &graphics_state -> swapchain_image_len, NULL);
+    graphics_state -> swapchain_image_array = arena_alloc_array(&graphics_state -> swapchain_arena, VkImage, graphics_state -> swapchain_image_len);
     vkGetSwapchainImagesKHR(graphics_state -> device, graphics_state -> swapchain, &graphics_state -> swapchain_image_len, graphics_state -> swapchain_image_array);
 
-    graphics_state -> swapchain_image_view_array = malloc(sizeof(VkImageView) * graphics_state -> swapchain_image_len);
+    graphics_state -> swapchain_image_view_array = arena_alloc_array(&graphics_state -> swapchain_arena, VkImageView, graphics_state -> swapchain_image_len);
     for(graphics_state -> swapchain_image_view_len = 0; graphics_state -> swapchain_image_view_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_image_view_len++) {
         VkImageView image_view;
         handle_error(vkCreateImageView(
@@ -577,6 +2426,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
     printf("%s", "Image views created\n");
 
     vkGetDeviceQueue(graphics_state -> device, graphics_state -> queue_family_index, 0, &graphics_state -> queue);
+    vkGetDeviceQueue(graphics_state -> device, graphics_state -> transfer_queue_family_index, 0, &graphics_state -> transfer_queue);
     printf("%s", "Queue created\n");
 
     handle_error(vkCreateCommandPool(
@@ -592,154 +2442,76 @@ int create_graphics_state(struct graphics_state *graphics_state) {
     ), destory_swapchain);
     printf("%s", "Command pool created\n");
 
-    handle_error(vkAllocateCommandBuffers(
-        graphics_state -> device,
-        &(VkCommandBufferAllocateInfo) {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-            .pNext = NULL,
-            .commandPool = graphics_state -> command_pool,
-            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-            .commandBufferCount = 1
-        },
-        &graphics_state -> command_buffer
-    ), destroy_command_pool);
-    printf("%s", "Command buffer allocated\n");
-
-    VkAttachmentDescription attachment_description = (VkAttachmentDescription) {
-        .flags = 0x0,
-        .format = graphics_state -> surface_format.format,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
-    };
-    VkAttachmentDescription *attachment_description_array = malloc(sizeof(VkAttachmentDescription) * graphics_state -> swapchain_image_len);
-    for(int i = 0; i < graphics_state -> swapchain_image_len; i++) {
-        attachment_description_array[i] = attachment_description;
+    if (find_depth_format(graphics_state) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_command_pool;
     }
 
-    VkAttachmentReference attachment_reference = (VkAttachmentReference) {
-        .attachment = 0,
-        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
-    };
-    VkAttachmentReference attachment_reference_array[1] = {attachment_reference};
-
-    VkSubpassDescription subpass_description = (VkSubpassDescription) {
-        .flags = 0x0,
-        .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-        .inputAttachmentCount = 0,
-        .pInputAttachments = NULL,
-        .colorAttachmentCount = 1,
-        .pColorAttachments = attachment_reference_array,
-        .pResolveAttachments = NULL,
-        .pDepthStencilAttachment = NULL,
-        .preserveAttachmentCount = 0,
-        .pPreserveAttachments = NULL
-
-    };
-    VkSubpassDescription subpass_description_array[1] = {subpass_description};
-
-    VkSubpassDependency subpass_dependency = (VkSubpassDependency) {
-        .srcSubpass = VK_SUBPASS_EXTERNAL,
-        .dstSubpass = 0,
-        .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .srcAccessMask = 0x0,
-        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .dependencyFlags = 0x0
-    };
-    VkSubpassDependency subpass_dependency_array[1] = {subpass_dependency};
+    if (create_depth_image(graphics_state) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_command_pool;
+    }
 
-    handle_error(vkCreateRenderPass(
-        graphics_state -> device,
-        &(VkRenderPassCreateInfo) {
-            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-            .pNext = NULL,
-            .flags = 0x0,
-            .attachmentCount = 1,
-            .pAttachments = attachment_description_array,
-            .subpassCount = 1,
-            .pSubpasses = subpass_description_array,
-            .dependencyCount = 1,
-            .pDependencies = subpass_dependency_array
+    VkVertexInputBindingDescription vertex_binding_description_array[2] = {
+        (VkVertexInputBindingDescription) {
+            .binding = 0,
+            .stride = sizeof(struct mesh_vertex),
+            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
         },
-        NULL,
-        &graphics_state -> render_pass
-    ), free_command_buffers);
-    printf("%s", "Render pass created\n");
-
-    graphics_state -> framebuffer_array = malloc(sizeof(VkFramebuffer) * graphics_state -> swapchain_image_len);
-    for (graphics_state -> framebuffer_len = 0; graphics_state -> framebuffer_len < graphics_state -> swapchain_image_len; graphics_state -> framebuffer_len++) {
-        VkFramebuffer framebuffer;
-        handle_error(vkCreateFramebuffer(
-            graphics_state -> device,
-            &(VkFramebufferCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .renderPass = graphics_state -> render_pass,
-                .attachmentCount = 1,
-                .pAttachments = &graphics_state -> swapchain_image_view_array[graphics_state -> framebuffer_len],
-                .width = graphics_state -> image_extent.width,
-                .height = graphics_state -> image_extent.height, 
-                .layers = 1
-            },
-            NULL,
-            &framebuffer
-        ), destroy_framebuffers);
-        graphics_state -> framebuffer_array[graphics_state -> framebuffer_len] = framebuffer;
-    }
-    printf("%s", "Frame buffers created\n");
-
-    FILE *f_model = fopen("cube.obj", "r");
-
-    int vertex_count = 36;
-    int vertex_dim = 3;
-    int vertex_color = 3;
-    int vertex_size = vertex_dim + vertex_color;
-    //float vertex_1[4] = {0.0f, -0.5f, 0.0f, 1.0f};
-    //float vertex_2[4] = {0.5f, 0.5f, 0.0f, 1.0f};
-    //float vertex_3[4] = {-0.5f, 0.5f, 0.0f, 1.0f};
-    //float *model_data[3] = {vertex_1, vertex_2, vertex_3};
-    //float vertices[12] = {
-    //    0.0f, -0.5f, 0.0f, 1.0f,
-    //    0.5f, 0.5f, 0.0f, 1.0f,
-    //    -0.5f, 0.5f, 0.0f, 1.0f };
-
-    VkVertexInputBindingDescription vertex_binding_description = (VkVertexInputBindingDescription) {
-        .binding = 0,
-        .stride = sizeof(float) * vertex_size,
-        .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+        (VkVertexInputBindingDescription) {
+            .binding = 1,
+            .stride = sizeof(struct instance_data),
+            .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE
+        }
     };
 
     VkVertexInputAttributeDescription vertex_attribute_description_position = (VkVertexInputAttributeDescription) {
         .location = 0,
         .format = VK_FORMAT_R32G32B32_SFLOAT,
         .binding = 0,
-        .offset = 0
+        .offset = offsetof(struct mesh_vertex, position)
     };
 
-    VkVertexInputAttributeDescription vertex_attribute_description_color = (VkVertexInputAttributeDescription) {
+    VkVertexInputAttributeDescription vertex_attribute_description_normal = (VkVertexInputAttributeDescription) {
         .location = 1,
         .format = VK_FORMAT_R32G32B32_SFLOAT,
         .binding = 0,
-        .offset = sizeof(float) * vertex_dim
+        .offset = offsetof(struct mesh_vertex, normal)
+    };
+
+    VkVertexInputAttributeDescription vertex_attribute_description_uv = (VkVertexInputAttributeDescription) {
+        .location = 2,
+        .format = VK_FORMAT_R32G32_SFLOAT,
+        .binding = 0,
+        .offset = offsetof(struct mesh_vertex, uv)
     };
 
-    VkVertexInputAttributeDescription vertex_attribute_description_array[2] = {vertex_attribute_description_position, vertex_attribute_description_color};
+    // a mat4 attribute takes one location per column
+    VkVertexInputAttributeDescription vertex_attribute_description_array[8] = {vertex_attribute_description_position, vertex_attribute_description_normal, vertex_attribute_description_uv};
+    for (uint32_t i = 0; i < 4; i++) {
+        vertex_attribute_description_array[3 + i] = (VkVertexInputAttributeDescription) {
+            .location = 3 + i,
+            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+            .binding = 1,
+            .offset = offsetof(struct instance_data, model) + sizeof(vec4) * i
+        };
+    }
+    vertex_attribute_description_array[7] = (VkVertexInputAttributeDescription) {
+        .location = 7,
+        .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+        .binding = 1,
+        .offset = offsetof(struct instance_data, color)
+    };
 
     FILE *f_vertex = fopen("shaders/vert.spv", "rb");
     if(f_vertex == NULL) {
         perror("failed to open file");
-        goto destroy_framebuffers;
+        goto destroy_depth_image;
     }
     fseek(f_vertex, 0, SEEK_END);
     long fsize_vertex = ftell(f_vertex);
     fseek(f_vertex, 0, SEEK_SET);
-    uint32_t *vertex_shader_code = malloc(sizeof(uint32_t) * fsize_vertex);
+    uint32_t *vertex_shader_code = counted_malloc(sizeof(uint32_t) * fsize_vertex);
     fread(vertex_shader_code, sizeof(uint32_t), fsize_vertex, f_vertex);
     fclose(f_vertex);
 
@@ -754,7 +2526,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
         },
         NULL,
         &graphics_state -> vertex_shader_module
-    ), destroy_framebuffers);
+    ), destroy_depth_image);
     FILE *f_fragment = fopen("shaders/frag.spv", "rb");
     if(f_fragment == NULL) {
         perror("failed to open file");
@@ -763,7 +2535,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
     fseek(f_fragment, 0, SEEK_END);
     long fsize_fragment = ftell(f_fragment);
     fseek(f_fragment, 0, SEEK_SET);
-    uint32_t *fragment_shader_code = malloc(sizeof(uint32_t) * fsize_fragment);
+    uint32_t *fragment_shader_code = counted_malloc(sizeof(uint32_t) * fsize_fragment);
     fread(fragment_shader_code, sizeof(uint32_t), fsize_fragment, f_fragment);
     fclose(f_fragment);
 
@@ -817,7 +2589,7 @@ int create_graphics_state(struct graphics_state *graphics_state) {
 
     VkDescriptorSetLayoutBinding uniform_buffer_object_binding = (VkDescriptorSetLayoutBinding) {
         .binding = 0,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .descriptorCount = 1,
         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
         .pImmutableSamplers = NULL
@@ -835,10 +2607,6 @@ int create_graphics_state(struct graphics_state *graphics_state) {
         NULL,
         &graphics_state -> descriptor_set_layout
     ), destroy_fragment_shader_module);
-    VkDescriptorSetLayout* descriptor_set_layout_array = malloc(sizeof(VkDescriptorSetLayout) * graphics_state -> swapchain_image_len);
-    for (int i = 0; i < graphics_state -> swapchain_image_len; i++) {
-        descriptor_set_layout_array[i] = graphics_state -> descriptor_set_layout;
-    }
 
     handle_error(vkCreateDescriptorPool(
         graphics_state -> device,
@@ -846,29 +2614,27 @@ int create_graphics_state(struct graphics_state *graphics_state) {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
             .pNext = NULL,
             .flags = 0x0,
-            .maxSets = graphics_state -> swapchain_image_len,
+            .maxSets = 1,
             .poolSizeCount = 1,
             .pPoolSizes = &(VkDescriptorPoolSize) {
-                .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                .descriptorCount = graphics_state -> swapchain_image_len
+                .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+                .descriptorCount = 1
             }
         },
         NULL,
         &graphics_state -> descriptor_pool
     ), destroy_descriptor_set_layout);
 
-    graphics_state -> descriptor_set_len = graphics_state -> swapchain_image_len;
-    graphics_state -> descriptor_set_array = malloc(sizeof(VkDescriptorSet) * graphics_state -> descriptor_set_len);
     handle_error(vkAllocateDescriptorSets(
         graphics_state -> device,
         &(VkDescriptorSetAllocateInfo) {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
             .pNext = NULL,
             .descriptorPool = graphics_state -> descriptor_pool,
-            .descriptorSetCount = graphics_state -> swapchain_image_len,
-            .pSetLayouts = descriptor_set_layout_array
+            .descriptorSetCount = 1,
+            .pSetLayouts = &graphics_state -> descriptor_set_layout
         },
-        graphics_state -> descriptor_set_array
+        &graphics_state -> descriptor_set
     ), destroy_descriptor_pool);
 
     handle_error(vkCreatePipelineLayout(
@@ -886,120 +2652,237 @@ int create_graphics_state(struct graphics_state *graphics_state) {
         &graphics_state -> pipeline_layout
     ), destroy_descriptor_pool);
 
+    int warm_pipeline_cache;
+    if (create_pipeline_cache(graphics_state, &warm_pipeline_cache) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_pipeline_layout;
+    }
+
     VkDynamicState dynamic_state_array[2] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
     uint32_t dynamic_state_len = 2;
 
+    // with the pre-pass the depth buffer already holds the nearest surface, so shading only runs where depth is equal
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_state = (VkPipelineDepthStencilStateCreateInfo) {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+        .pNext = NULL,
+        .flags = 0x0,
+        .depthTestEnable = VK_TRUE,
+        .depthWriteEnable = depth_prepass ? VK_FALSE : VK_TRUE,
+        .depthCompareOp = depth_prepass ? VK_COMPARE_OP_EQUAL : VK_COMPARE_OP_LESS,
+        .depthBoundsTestEnable = VK_FALSE,
+        .stencilTestEnable = VK_FALSE,
+        .front = (VkStencilOpState) {0},
+        .back = (VkStencilOpState) {0},
+        .minDepthBounds = 0.0f,
+        .maxDepthBounds = 1.0f
+    };
+
+    VkGraphicsPipelineCreateInfo pipeline_create_info = (VkGraphicsPipelineCreateInfo) {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = &(VkPipelineRenderingCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+            .pNext = NULL,
+            .viewMask = 0,
+            .colorAttachmentCount = 1,
+            .pColorAttachmentFormats = &graphics_state -> surface_format.format,
+            .depthAttachmentFormat = graphics_state -> depth_format,
+            .stencilAttachmentFormat = VK_FORMAT_UNDEFINED
+        },
+        .flags = 0x0,
+        .stageCount = 2,
+        .pStages = shader_stage_array,
+        .pVertexInputState = &(VkPipelineVertexInputStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .vertexBindingDescriptionCount = 2,
+            .pVertexBindingDescriptions = vertex_binding_description_array,
+            .vertexAttributeDescriptionCount = 8,
+            .pVertexAttributeDescriptions = vertex_attribute_description_array
+        },
+        .pInputAssemblyState = &(VkPipelineInputAssemblyStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+            .primitiveRestartEnable = VK_FALSE
+        },
+        .pTessellationState = VK_NULL_HANDLE,
+        .pViewportState = &(VkPipelineViewportStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .viewportCount = 1,
+            .pViewports = NULL,
+            .scissorCount = 1,
+            .pScissors = NULL
+        },
+        .pRasterizationState = &(VkPipelineRasterizationStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .depthClampEnable = VK_FALSE,
+            .rasterizerDiscardEnable = VK_FALSE,
+            .polygonMode = VK_POLYGON_MODE_FILL,
+            .cullMode = VK_CULL_MODE_BACK_BIT,
+            // OBJ faces wind counter clockwise in a y up space, which the flipped Vulkan viewport mirrors
+            .frontFace = VK_FRONT_FACE_CLOCKWISE,
+            .depthBiasEnable = VK_FALSE,
+            .depthBiasConstantFactor = 0.0f,
+            .depthBiasClamp = 0.0f,
+            .depthBiasSlopeFactor = 0.0f,
+            .lineWidth = 1.0f
+        },
+        .pMultisampleState = &(VkPipelineMultisampleStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+            .sampleShadingEnable = VK_FALSE,
+            .minSampleShading = 1.0f,
+            .pSampleMask = NULL,
+            .alphaToCoverageEnable = VK_FALSE,
+            .alphaToOneEnable = VK_FALSE
+        },
+        .pDepthStencilState = &depth_stencil_state,
+        .pColorBlendState = &(VkPipelineColorBlendStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .logicOpEnable = VK_FALSE,
+            .logicOp = VK_LOGIC_OP_COPY,
+            .attachmentCount = 1,
+            .pAttachments = color_blend_attachment_array,
+            .blendConstants = {0.0f, 0.0f, 0.0f, 0.0f}
+        },
+        .pDynamicState = &(VkPipelineDynamicStateCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+            .pNext = NULL,
+            .flags = 0x0,
+            .dynamicStateCount = dynamic_state_len,
+            .pDynamicStates = dynamic_state_array
+        },
+        .layout = graphics_state -> pipeline_layout,
+        .renderPass = VK_NULL_HANDLE, // dynamic rendering, the attachment formats are in pNext
+        .subpass = 0,
+        .basePipelineHandle = VK_NULL_HANDLE,
+        .basePipelineIndex = -1
+    };
+
+    struct timespec pipeline_start_time, pipeline_end_time;
+    clock_gettime(CLOCK_MONOTONIC, &pipeline_start_time);
     handle_error(vkCreateGraphicsPipelines( // The big one
         graphics_state -> device,
-        VK_NULL_HANDLE,
+        graphics_state -> pipeline_cache,
+        1,
+        &pipeline_create_info,
+        NULL,
+        &graphics_state -> pipeline
+    ), destroy_pipeline_cache);
+
+    // Vertex only, writes depth and no color, so the main pass shades every pixel at most once
+    graphics_state -> depth_prepass_pipeline = VK_NULL_HANDLE;
+    if (depth_prepass) {
+        VkPipelineColorBlendAttachmentState depth_prepass_color_blend_attachment = color_blend_attachment;
+        depth_prepass_color_blend_attachment.colorWriteMask = 0x0;
+        VkPipelineColorBlendStateCreateInfo depth_prepass_color_blend_state = *pipeline_create_info.pColorBlendState;
+        depth_prepass_color_blend_state.pAttachments = &depth_prepass_color_blend_attachment;
+        VkPipelineDepthStencilStateCreateInfo depth_prepass_depth_stencil_state = depth_stencil_state;
+        depth_prepass_depth_stencil_state.depthWriteEnable = VK_TRUE;
+        depth_prepass_depth_stencil_state.depthCompareOp = VK_COMPARE_OP_LESS;
+
+        VkGraphicsPipelineCreateInfo depth_prepass_create_info = pipeline_create_info;
+        depth_prepass_create_info.stageCount = 1;
+        depth_prepass_create_info.pColorBlendState = &depth_prepass_color_blend_state;
+        depth_prepass_create_info.pDepthStencilState = &depth_prepass_depth_stencil_state;
+        handle_error(vkCreateGraphicsPipelines(
+            graphics_state -> device,
+            graphics_state -> pipeline_cache,
+            1,
+            &depth_prepass_create_info,
+            NULL,
+            &graphics_state -> depth_prepass_pipeline
+        ), destroy_pipeline);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pipeline_end_time);
+
+    printf("Pipeline created in %.3f ms (%s pipeline cache)\n",
+        (double)(pipeline_end_time.tv_sec - pipeline_start_time.tv_sec) * 1000.0 + (double)(pipeline_end_time.tv_nsec - pipeline_start_time.tv_nsec) / 1000000.0,
+        warm_pipeline_cache ? "warm" : "cold");
+
+    if (create_swapchain_sync_objects(graphics_state) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_depth_prepass_pipeline;
+    }
+
+    VkPhysicalDeviceProperties physical_device_properties;
+    vkGetPhysicalDeviceProperties(graphics_state -> physical_device, &physical_device_properties);
+    graphics_state -> uniform_alignment = physical_device_properties.limits.minUniformBufferOffsetAlignment > 0 ? physical_device_properties.limits.minUniformBufferOffsetAlignment : 1;
+    if (create_graphics_buffer(graphics_state, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, UNIFORM_SLICE_SIZE * frames_in_flight, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_STRATEGY_BUDDY, &graphics_state -> uniform_buffer) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto free_swapchain_sync_objects;
+    }
+    // the buffer never changes, so neither does the descriptor set
+    vkUpdateDescriptorSets(
+        graphics_state -> device,
         1,
-        &(VkGraphicsPipelineCreateInfo) {
-            .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        &(VkWriteDescriptorSet) {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
             .pNext = NULL,
-            .flags = 0x0,
-            .stageCount = 2,
-            .pStages = shader_stage_array,
-            .pVertexInputState = &(VkPipelineVertexInputStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .vertexBindingDescriptionCount = 1,
-                .pVertexBindingDescriptions = &vertex_binding_description,
-                .vertexAttributeDescriptionCount = 2,
-                .pVertexAttributeDescriptions = vertex_attribute_description_array
-            },
-            .pInputAssemblyState = &(VkPipelineInputAssemblyStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
-                .primitiveRestartEnable = VK_FALSE
-            },
-            .pTessellationState = VK_NULL_HANDLE,
-            .pViewportState = &(VkPipelineViewportStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .viewportCount = 1,
-                .pViewports = NULL,
-                .scissorCount = 1,
-                .pScissors = NULL
+            .dstSet = graphics_state -> descriptor_set,
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .pImageInfo = NULL,
+            .pBufferInfo = &(VkDescriptorBufferInfo) {
+                .buffer = graphics_state -> uniform_buffer.buffer,
+                .offset = 0,
+                .range = UNIFORM_BLOCK_SIZE
             },
-            .pRasterizationState = &(VkPipelineRasterizationStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .depthClampEnable = VK_FALSE,
-                .rasterizerDiscardEnable = VK_FALSE,
-                .polygonMode = VK_POLYGON_MODE_FILL,
-                .cullMode = VK_CULL_MODE_BACK_BIT,
-                .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
-                .depthBiasEnable = VK_FALSE,
-                .depthBiasConstantFactor = 0.0f,
-                .depthBiasClamp = 0.0f,
-                .depthBiasSlopeFactor = 0.0f,
-                .lineWidth = 1.0f
-            },
-            .pMultisampleState = &(VkPipelineMultisampleStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
-                .sampleShadingEnable = VK_FALSE,
-                .minSampleShading = 1.0f,
-                .pSampleMask = NULL,
-                .alphaToCoverageEnable = VK_FALSE,
-                .alphaToOneEnable = VK_FALSE
-            },
-            .pDepthStencilState = NULL,
-            .pColorBlendState = &(VkPipelineColorBlendStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .logicOpEnable = VK_FALSE,
-                .logicOp = VK_LOGIC_OP_COPY,
-                .attachmentCount = 1,
-                .pAttachments = color_blend_attachment_array,
-                .blendConstants = {0.0f, 0.0f, 0.0f, 0.0f}
-            },
-            .pDynamicState = &(VkPipelineDynamicStateCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
-                .pNext = NULL,
-                .flags = 0x0,
-                .dynamicStateCount = dynamic_state_len,
-                .pDynamicStates = dynamic_state_array
-            },
-            .layout = graphics_state -> pipeline_layout,
-            .renderPass = graphics_state -> render_pass,
-            .subpass = 0,
-            .basePipelineHandle = VK_NULL_HANDLE,
-            .basePipelineIndex = -1
+            .pTexelBufferView = NULL
         },
-        NULL,
-        &graphics_state -> pipeline
-    ), destroy_pipeline_layout);
+        0,
+        NULL
+    );
+    graphics_state -> statistics_query_pool = VK_NULL_HANDLE;
 
-    printf("%s", "Pipeline created\n");
+    graphics_state -> frame_len = 0;
+    graphics_state -> frame_array = counted_malloc(sizeof(struct frame_state) * frames_in_flight);
+    if (graphics_state -> frame_array == NULL) {
+        perror("failed to allocate frames");
+        error_code = EXIT_FAILURE;
+        goto destroy_frames;
+    }
+    for (graphics_state -> frame_len = 0; graphics_state -> frame_len < frames_in_flight; graphics_state -> frame_len++) {
+        struct frame_state *frame = &graphics_state -> frame_array[graphics_state -> frame_len];
+        *frame = (struct frame_state) {0};
+        frame -> uniform_offset = UNIFORM_SLICE_SIZE * graphics_state -> frame_len;
 
-    graphics_state -> swapchain_image_available_semaphore_array = malloc(sizeof(VkSemaphore) * graphics_state -> swapchain_image_len);
-    for (graphics_state -> swapchain_image_available_semaphore_len = 0; graphics_state -> swapchain_image_available_semaphore_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_image_available_semaphore_len++) {
-        VkSemaphore image_available_semaphore;
-        handle_error(vkCreateSemaphore(
+        handle_error(vkCreateCommandPool(
             graphics_state -> device,
-            &(VkSemaphoreCreateInfo) {
-                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+            &(VkCommandPoolCreateInfo) {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
                 .pNext = NULL,
-                .flags = 0x0
+                .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+                .queueFamilyIndex = graphics_state -> queue_family_index
             },
             NULL,
-            &image_available_semaphore
-        ), destroy_pipeline);
-        graphics_state -> swapchain_image_available_semaphore_array[graphics_state -> swapchain_image_available_semaphore_len] = image_available_semaphore;
-    }
+            &frame -> command_pool
+        ), destroy_frames);
+
+        handle_error(vkAllocateCommandBuffers(
+            graphics_state -> device,
+            &(VkCommandBufferAllocateInfo) {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .pNext = NULL,
+                .commandPool = frame -> command_pool,
+                .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                .commandBufferCount = 1
+            },
+            &frame -> command_buffer
+        ), destroy_frame_command_pool);
 
-    graphics_state -> swapchain_render_finished_semaphore_array = malloc(sizeof(VkSemaphore) * graphics_state -> swapchain_image_len);
-    for (graphics_state -> swapchain_render_finished_semaphore_len = 0; graphics_state -> swapchain_render_finished_semaphore_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_render_finished_semaphore_len++) {
-        VkSemaphore render_finished_semaphore;
         handle_error(vkCreateSemaphore(
             graphics_state -> device,
             &(VkSemaphoreCreateInfo) {
@@ -1008,14 +2891,9 @@ int create_graphics_state(struct graphics_state *graphics_state) {
                 .flags = 0x0
             },
             NULL,
-            &render_finished_semaphore
-        ), destroy_image_semaphores);
-        graphics_state -> swapchain_render_finished_semaphore_array[graphics_state -> swapchain_render_finished_semaphore_len] = render_finished_semaphore;
-    }
+            &frame -> image_available_semaphore
+        ), destroy_frame_command_pool);
 
-    graphics_state -> swapchain_in_flight_fence_array = malloc(sizeof(VkFence) * graphics_state -> swapchain_image_len);
-    for (graphics_state -> swapchain_in_flight_fence_len = 0; graphics_state -> swapchain_in_flight_fence_len < graphics_state -> swapchain_image_len; graphics_state -> swapchain_in_flight_fence_len++) {
-        VkFence in_flight_fence;
         handle_error(vkCreateFence(
             graphics_state -> device,
             &(VkFenceCreateInfo) {
@@ -1024,34 +2902,73 @@ int create_graphics_state(struct graphics_state *graphics_state) {
                 .flags = VK_FENCE_CREATE_SIGNALED_BIT
             },
             NULL,
-            &in_flight_fence
-        ), destroy_render_semaphores);
-        graphics_state -> swapchain_in_flight_fence_array[graphics_state -> swapchain_in_flight_fence_len] = in_flight_fence;
-    }
-    printf("%s", "Sync objects created\n");
+            &frame -> in_flight_fence
+        ), destroy_frame_semaphore);
 
-    graphics_state -> buffer_array = malloc(sizeof(struct graphics_buffer) * 64);
-    graphics_state -> buffer_len = 0;
+        if (create_arena(&frame -> arena, FRAME_ARENA_SIZE) != EXIT_SUCCESS) {
+            error_code = EXIT_FAILURE;
+            goto destroy_frame_fence;
+        }
 
-    return error_code;
+        frame -> instance_buffer.buffer = VK_NULL_HANDLE;
+        frame -> instance_data = NULL;
+        frame -> instance_capacity = 0;
+    }
+    printf("Sync objects created for %u frames in flight\n", graphics_state -> frame_len);
 
-destroy_flight_fences:
-    for(int i = 0; i < graphics_state -> swapchain_in_flight_fence_len; i++) {
-        vkDestroyFence(graphics_state -> device, graphics_state -> swapchain_in_flight_fence_array[i], NULL);
+    if (enabled_features.pipelineStatisticsQuery) {
+        handle_error(vkCreateQueryPool(
+            graphics_state -> device,
+            &(VkQueryPoolCreateInfo) {
+                .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                .pNext = NULL,
+                .flags = 0x0,
+                .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+                .queryCount = graphics_state -> frame_len,
+                .pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT
+            },
+            NULL,
+            &graphics_state -> statistics_query_pool
+        ), destroy_frames);
     }
-    graphics_state -> swapchain_in_flight_fence_len = 0;
-destroy_render_semaphores:
-    for(int i = 0; i < graphics_state -> swapchain_render_finished_semaphore_len; i++) {
-        vkDestroySemaphore(graphics_state -> device, graphics_state -> swapchain_render_finished_semaphore_array[i], NULL);
+
+    if (create_upload_ring(graphics_state) != EXIT_SUCCESS) {
+        error_code = EXIT_FAILURE;
+        goto destroy_query_pool;
     }
-    graphics_state -> swapchain_render_finished_semaphore_len = 0;
-destroy_image_semaphores:
-    for(int i = 0; i < graphics_state -> swapchain_image_available_semaphore_len; i++) {
-        vkDestroySemaphore(graphics_state -> device, graphics_state -> swapchain_image_available_semaphore_array[i], NULL);
+
+    return error_code;
+
+destroy_frame_fence:
+    vkDestroyFence(graphics_state -> device, graphics_state -> frame_array[graphics_state -> frame_len].in_flight_fence, NULL);
+destroy_frame_semaphore:
+    vkDestroySemaphore(graphics_state -> device, graphics_state -> frame_array[graphics_state -> frame_len].image_available_semaphore, NULL);
+destroy_frame_command_pool:
+    vkDestroyCommandPool(graphics_state -> device, graphics_state -> frame_array[graphics_state -> frame_len].command_pool, NULL);
+destroy_query_pool:
+    vkDestroyQueryPool(graphics_state -> device, graphics_state -> statistics_query_pool, NULL);
+destroy_frames:
+    for (int i = 0; i < graphics_state -> frame_len; i++) {
+        if (graphics_state -> frame_array[i].instance_buffer.buffer != VK_NULL_HANDLE) {
+            destroy_graphics_buffer(graphics_state, &graphics_state -> frame_array[i].instance_buffer);
+        }
+        destroy_arena(&graphics_state -> frame_array[i].arena);
+        vkDestroyFence(graphics_state -> device, graphics_state -> frame_array[i].in_flight_fence, NULL);
+        vkDestroySemaphore(graphics_state -> device, graphics_state -> frame_array[i].image_available_semaphore, NULL);
+        vkDestroyCommandPool(graphics_state -> device, graphics_state -> frame_array[i].command_pool, NULL);
     }
-    graphics_state -> swapchain_image_available_semaphore_len = 0;
+    graphics_state -> frame_len = 0;
+    free(graphics_state -> frame_array);
+    graphics_state -> frame_array = NULL;
+    destroy_graphics_buffer(graphics_state, &graphics_state -> uniform_buffer);
+free_swapchain_sync_objects:
+    destroy_swapchain_sync_objects(graphics_state);
+destroy_depth_prepass_pipeline:
+    vkDestroyPipeline(graphics_state -> device, graphics_state -> depth_prepass_pipeline, NULL);
 destroy_pipeline:
     vkDestroyPipeline(graphics_state -> device, graphics_state -> pipeline, NULL);
+destroy_pipeline_cache:
+    vkDestroyPipelineCache(graphics_state -> device, graphics_state -> pipeline_cache, NULL);
 destroy_pipeline_layout:
     vkDestroyPipelineLayout(graphics_state -> device, graphics_state -> pipeline_layout, NULL);
 destroy_descriptor_pool:
@@ -1062,15 +2979,8 @@ destroy_fragment_shader_module:
     vkDestroyShaderModule(graphics_state -> device, graphics_state -> fragment_shader_module, NULL);
 destroy_vertex_shader_module:
     vkDestroyShaderModule(graphics_state -> device, graphics_state -> vertex_shader_module, NULL);
-destroy_framebuffers:
-    for (int i = 0; i < graphics_state -> framebuffer_len; i++) {
-        vkDestroyFramebuffer(graphics_state -> device, graphics_state -> framebuffer_array[i], NULL);
-    }
-    graphics_state -> framebuffer_len = 0;
-destroy_render_pass:
-    vkDestroyRenderPass(graphics_state -> device, graphics_state -> render_pass, NULL);
-free_command_buffers:
-    vkFreeCommandBuffers(graphics_state -> device, graphics_state -> command_pool, 1, &graphics_state -> command_buffer);
+destroy_depth_image:
+    destroy_depth_image(graphics_state);
 destroy_command_pool:
     vkDestroyCommandPool(graphics_state -> device, graphics_state -> command_pool, NULL);
 destroy_image_views:
@@ -1080,10 +2990,14 @@ destroy_image_views:
     graphics_state -> swapchain_image_view_len = 0;
 destory_swapchain:
     vkDestroySwapchainKHR(graphics_state -> device, graphics_state -> swapchain, NULL);
+destroy_swapchain_arena:
+    destroy_arena(&graphics_state -> swapchain_arena);
 destroy_surface:
     vkDestroySurfaceKHR(graphics_state -> instance, graphics_state -> surface, NULL);
 destroy_window:
     glfwDestroyWindow(graphics_state -> window);
+destroy_allocator:
+    destroy_memory_allocator(&graphics_state -> allocator);
 destory_device:
     vkDestroyDevice(graphics_state -> device, NULL);
 destroy_instance:
@@ -1095,43 +3009,45 @@ exit_GLFW:
 
 void cleanup(struct graphics_state *graphics_state) {
     vkDeviceWaitIdle(graphics_state -> device);
-    for(int i = 0; i < graphics_state -> swapchain_in_flight_fence_len; i++) {
-        vkDestroyFence(graphics_state -> device, graphics_state -> swapchain_in_flight_fence_array[i], NULL);
-    }
-    graphics_state -> swapchain_in_flight_fence_len = 0;
-    for(int i = 0; i < graphics_state -> swapchain_render_finished_semaphore_len; i++) {
-        vkDestroySemaphore(graphics_state -> device, graphics_state -> swapchain_render_finished_semaphore_array[i], NULL);
-    }
-    graphics_state -> swapchain_render_finished_semaphore_len = 0;
-    for(int i = 0; i < graphics_state -> swapchain_image_available_semaphore_len; i++) {
-        vkDestroySemaphore(graphics_state -> device, graphics_state -> swapchain_image_available_semaphore_array[i], NULL);
+    graphics_state -> completed_frame_serial = UINT64_MAX;
+    collect_retired_objects(graphics_state);
+    free(graphics_state -> retired_array);
+    destroy_upload_ring(graphics_state);
+    for (int i = 0; i < graphics_state -> frame_len; i++) {
+        if (graphics_state -> frame_array[i].instance_buffer.buffer != VK_NULL_HANDLE) {
+            destroy_graphics_buffer(graphics_state, &graphics_state -> frame_array[i].instance_buffer);
+        }
+        destroy_arena(&graphics_state -> frame_array[i].arena);
+        vkDestroyFence(graphics_state -> device, graphics_state -> frame_array[i].in_flight_fence, NULL);
+        vkDestroySemaphore(graphics_state -> device, graphics_state -> frame_array[i].image_available_semaphore, NULL);
+        vkDestroyCommandPool(graphics_state -> device, graphics_state -> frame_array[i].command_pool, NULL);
     }
-    graphics_state -> swapchain_image_available_semaphore_len = 0;
+    graphics_state -> frame_len = 0;
+    free(graphics_state -> frame_array);
+    destroy_graphics_buffer(graphics_state, &graphics_state -> uniform_buffer);
+    vkDestroyQueryPool(graphics_state -> device, graphics_state -> statistics_query_pool, NULL);
+    destroy_swapchain_sync_objects(graphics_state);
+    vkDestroyPipeline(graphics_state -> device, graphics_state -> depth_prepass_pipeline, NULL);
     vkDestroyPipeline(graphics_state -> device, graphics_state -> pipeline, NULL);
+    save_pipeline_cache(graphics_state);
+    vkDestroyPipelineCache(graphics_state -> device, graphics_state -> pipeline_cache, NULL);
     vkDestroyPipelineLayout(graphics_state -> device, graphics_state -> pipeline_layout, NULL);
     vkDestroyDescriptorPool(graphics_state -> device, graphics_state -> descriptor_pool, NULL);
     vkDestroyDescriptorSetLayout(graphics_state -> device, graphics_state -> descriptor_set_layout, NULL);
     vkDestroyShaderModule(graphics_state -> device, graphics_state -> fragment_shader_module, NULL);
     vkDestroyShaderModule(graphics_state -> device, graphics_state -> vertex_shader_module, NULL);
-    for (int i = 0; i < graphics_state -> buffer_len; i++) {
-        vkFreeMemory(graphics_state -> device, graphics_state -> buffer_array[i].memory, NULL);
-        vkDestroyBuffer(graphics_state -> device, graphics_state -> buffer_array[i].buffer, NULL);
-    }
-    graphics_state -> buffer_len = 0;
-    for (int i = 0; i < graphics_state -> framebuffer_len; i++) {
-        vkDestroyFramebuffer(graphics_state -> device, graphics_state -> framebuffer_array[i], NULL);
-    }
-    graphics_state -> framebuffer_len = 0;
-    vkDestroyRenderPass(graphics_state -> device, graphics_state -> render_pass, NULL);
-    vkFreeCommandBuffers(graphics_state -> device, graphics_state -> command_pool, 1, &graphics_state -> command_buffer);
+    destroy_depth_image(graphics_state);
     vkDestroyCommandPool(graphics_state -> device, graphics_state -> command_pool, NULL);
     for(int i = 0; i < graphics_state -> swapchain_image_view_len; i++) {
         vkDestroyImageView(graphics_state -> device, graphics_state -> swapchain_image_view_array[i], NULL);
     }
     graphics_state -> swapchain_image_view_len = 0;
     vkDestroySwapchainKHR(graphics_state -> device, graphics_state -> swapchain, NULL);
+    destroy_arena(&graphics_state -> swapchain_arena);
     vkDestroySurfaceKHR(graphics_state -> instance, graphics_state -> surface, NULL);
     glfwDestroyWindow(graphics_state -> window);
+    print_memory_stats(&graphics_state -> allocator);
+    destroy_memory_allocator(&graphics_state -> allocator);
     vkDestroyDevice(graphics_state -> device, NULL);
     vkDestroyInstance(graphics_state -> instance, NULL);
     glfwTerminate();
@@ -0,0 +1,229 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+// Work stealing job system. A batch is a range of leaf jobs. A thread holding a range keeps the
+// lower half and pushes the upper half onto its own deque until one leaf is left, so the oldest
+// entries, which idle threads steal from the top of other deques, are the biggest pieces of work.
+// Each thread owns a Chase-Lev deque: the owner pushes and pops at the bottom without locking, and
+// only a steal racing the owner for the last entry needs a compare and swap.
+//
+// Leaves are numbered by the batch, not by whichever thread runs them, so a batch whose leaves only
+// write to their own slots gives the same result on any number of threads.
+
+#define JOB_MAX_THREADS 64
+#define JOB_DEQUE_LEN 64 // a power of two, more than the halves of a 32 bit range pending at once
+#define JOB_SPIN_LEN 256 // idle rounds before a worker blocks until the next batch
+
+typedef void (*job_function)(void *data, uint32_t leaf, uint32_t thread);
+
+// Entries are ranges of leaves, begin in the upper 32 bits and end in the lower.
+struct job_deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic uint64_t range_array[JOB_DEQUE_LEN];
+    char padding[64]; // keeps neighbouring deques off each other's cache lines
+};
+
+struct job_system;
+
+struct job_worker {
+    struct job_system *system;
+    thrd_t thread;
+    uint32_t index;
+    uint64_t generation; // of the last batch it joined
+};
+
+struct job_system {
+    uint32_t thread_len; // workers plus the thread running batches, which is thread 0
+    struct job_deque deque_array[JOB_MAX_THREADS];
+    struct job_worker worker_array[JOB_MAX_THREADS];
+    mtx_t mutex;
+    cnd_t start_condition;
+    uint64_t generation; // guarded by mutex, bumped for every batch
+    int quit;
+    // of the current batch, written before its first range is pushed
+    job_function function;
+    void *data;
+    _Atomic uint32_t remaining_len; // leaves not finished yet
+};
+
+static inline uint64_t job_range(uint32_t begin, uint32_t end) {
+    return ((uint64_t)begin << 32) | end;
+}
+
+// Owner only. Returns 0 when the deque is full.
+static inline int push_job_range(struct job_deque *deque, uint64_t range) {
+    int64_t bottom = atomic_load_explicit(&deque -> bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque -> top, memory_order_acquire);
+    if (bottom - top >= JOB_DEQUE_LEN) {
+        return 0;
+    }
+    atomic_store_explicit(&deque -> range_array[bottom & (JOB_DEQUE_LEN - 1)], range, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque -> bottom, bottom + 1, memory_order_relaxed);
+    return 1;
+}
+
+// Owner only, takes the newest entry.
+static inline int pop_job_range(struct job_deque *deque, uint64_t *range) {
+    int64_t bottom = atomic_load_explicit(&deque -> bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque -> bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque -> top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque -> bottom, bottom + 1, memory_order_relaxed);
+        return 0;
+    }
+    *range = atomic_load_explicit(&deque -> range_array[bottom & (JOB_DEQUE_LEN - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // the last entry, a thief may be taking it at the same time
+        int won = atomic_compare_exchange_strong_explicit(&deque -> top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque -> bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+// Any thread, takes the oldest entry.
+static inline int steal_job_range(struct job_deque *deque, uint64_t *range) {
+    int64_t top = atomic_load_explicit(&deque -> top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque -> bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return 0;
+    }
+    *range = atomic_load_explicit(&deque -> range_array[top & (JOB_DEQUE_LEN - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&deque -> top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+void run_job_range(struct job_system *system, uint32_t thread, uint64_t range) {
+    uint32_t begin = (uint32_t)(range >> 32);
+    uint32_t end = (uint32_t)range;
+    while (end - begin > 1) {
+        uint32_t middle = begin + (end - begin) / 2;
+        if (!push_job_range(&system -> deque_array[thread], job_range(middle, end))) {
+            break;
+        }
+        end = middle;
+    }
+    for (uint32_t leaf = begin; leaf < end; leaf++) {
+        system -> function(system -> data, leaf, thread);
+    }
+    atomic_fetch_sub_explicit(&system -> remaining_len, end - begin, memory_order_acq_rel);
+}
+
+// Runs ranges from the thread's own deque, then steals, until the batch is finished.
+void run_job_batch_share(struct job_system *system, uint32_t thread) {
+    uint32_t victim = thread;
+    while (atomic_load_explicit(&system -> remaining_len, memory_order_acquire) > 0) {
+        uint64_t range;
+        if (pop_job_range(&system -> deque_array[thread], &range)) {
+            run_job_range(system, thread, range);
+            continue;
+        }
+        int stolen = 0;
+        for (uint32_t i = 1; i < system -> thread_len && !stolen; i++) {
+            victim = (victim + 1) % system -> thread_len;
+            stolen = victim != thread && steal_job_range(&system -> deque_array[victim], &range);
+        }
+        if (stolen) {
+            run_job_range(system, thread, range);
+        } else {
+            thrd_yield();
+        }
+    }
+}
+
+int job_worker_main(void *argument) {
+    struct job_worker *worker = argument;
+    struct job_system *system = worker -> system;
+    while (1) {
+        mtx_lock(&system -> mutex);
+        while (system -> generation == worker -> generation && !system -> quit) {
+            cnd_wait(&system -> start_condition, &system -> mutex);
+        }
+        if (system -> quit) {
+            mtx_unlock(&system -> mutex);
+            return 0;
+        }
+        worker -> generation = system -> generation;
+        mtx_unlock(&system -> mutex);
+
+        run_job_batch_share(system, worker -> index);
+        // batches tend to come in bursts, a few idle rounds saves going through the mutex
+        for (int i = 0; i < JOB_SPIN_LEN && atomic_load_explicit(&system -> remaining_len, memory_order_acquire) == 0; i++) {
+            thrd_yield();
+        }
+        run_job_batch_share(system, worker -> index);
+    }
+}
+
+void destroy_job_system(struct job_system *system) {
+    if (system -> thread_len > 1) {
+        mtx_lock(&system -> mutex);
+        system -> quit = 1;
+        cnd_broadcast(&system -> start_condition);
+        mtx_unlock(&system -> mutex);
+        for (uint32_t i = 1; i < system -> thread_len; i++) {
+            thrd_join(system -> worker_array[i].thread, NULL);
+        }
+        cnd_destroy(&system -> start_condition);
+        mtx_destroy(&system -> mutex);
+    }
+    system -> thread_len = 0;
+}
+
+// thread_len counts the calling thread, which runs batches together with thread_len - 1 workers.
+int create_job_system(struct job_system *system, uint32_t thread_len) {
+    system -> thread_len = 1;
+    system -> generation = 0;
+    system -> quit = 0;
+    atomic_store(&system -> remaining_len, 0);
+    for (uint32_t i = 0; i < JOB_MAX_THREADS; i++) {
+        atomic_store(&system -> deque_array[i].top, 0);
+        atomic_store(&system -> deque_array[i].bottom, 0);
+    }
+    thread_len = thread_len < 1 ? 1 : thread_len > JOB_MAX_THREADS ? JOB_MAX_THREADS : thread_len;
+    if (thread_len == 1) {
+        return EXIT_SUCCESS;
+    }
+    if (mtx_init(&system -> mutex, mtx_plain) != thrd_success || cnd_init(&system -> start_condition) != thrd_success) {
+        fprintf(stderr, "%s", "ERR: failed to create job system mutex\n");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 1; i < thread_len; i++) {
+        system -> worker_array[i] = (struct job_worker) {.system = system, .index = i, .generation = 0};
+        if (thrd_create(&system -> worker_array[i].thread, job_worker_main, &system -> worker_array[i]) != thrd_success) {
+            fprintf(stderr, "ERR: failed to start job worker %u\n", i);
+            destroy_job_system(system);
+            return EXIT_FAILURE;
+        }
+        system -> thread_len = i + 1;
+    }
+    printf("Job system started with %u threads\n", system -> thread_len);
+    return EXIT_SUCCESS;
+}
+
+// Calls function for every leaf below leaf_len and returns once all of them finished. Without a
+// job system, or with a single thread, the leaves run in order on the calling thread.
+void run_jobs(struct job_system *system, job_function function, void *data, uint32_t leaf_len) {
+    if (system == NULL || system -> thread_len <= 1 || leaf_len <= 1) {
+        for (uint32_t leaf = 0; leaf < leaf_len; leaf++) {
+            function(data, leaf, 0);
+        }
+        return;
+    }
+    system -> function = function;
+    system -> data = data;
+    atomic_store_explicit(&system -> remaining_len, leaf_len, memory_order_release);
+    push_job_range(&system -> deque_array[0], job_range(0, leaf_len));
+    mtx_lock(&system -> mutex);
+    system -> generation++;
+    cnd_broadcast(&system -> start_condition);
+    mtx_unlock(&system -> mutex);
+    run_job_batch_share(system, 0);
+}
@@ -4,124 +4,460 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <threads.h>
+#include "profiler_handling.h"
+#ifndef FACTORY_HEADLESS
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan_core.h>
 #include "error_handling.h"
 #include "graphics_handling.h"
+#include "culling_handling.h"
+#include "pacing_handling.h"
+#include "gpu_profiler_handling.h"
 #include "cglm/cglm.h"
+#else
+#include "arena_handling.h"
+#include "mesh_handling.h"
+#endif
+#include "simulation_handling.h"
+#ifndef FACTORY_HEADLESS
+#include "snapshot_handling.h"
+#endif
+
+// The fixed timestep loop without a window or Vulkan device, for servers and CI. Unpaced runs
+// feed the accumulator one tick per iteration to measure throughput, paced runs sleep between
+// ticks so the simulation runs in real time for soak testing.
+int run_headless(uint32_t machine_len, long long tick_len, int paced, uint32_t thread_len) {
+    struct simulation simulation;
+    struct job_system jobs;
+    if (create_simulation(&simulation, machine_len) != EXIT_SUCCESS || populate_simulation(&simulation, machine_len) != EXIT_SUCCESS) {
+        destroy_simulation(&simulation);
+        return EXIT_FAILURE;
+    }
+    if (thread_len > 1) {
+        if (create_job_system(&jobs, thread_len) != EXIT_SUCCESS) {
+            destroy_simulation(&simulation);
+            return EXIT_FAILURE;
+        }
+        simulation.jobs = &jobs;
+    }
+    printf("Running %u machines headless for %lld ticks%s\n", machine_len, tick_len, paced ? " in real time" : "");
+
+    const int dt = SIMULATION_TICK_NS;
+    long int accumulator = 0;
+    long long total_tick_time = 0;
+    long long worst_tick_time = 0;
+    struct timespec start_time, curr_time;
+    if(clock_gettime(CLOCK_MONOTONIC, &start_time) != 0) {
+        perror("failed to get time");
+        if (simulation.jobs != NULL) {
+            destroy_job_system(&jobs);
+        }
+        destroy_simulation(&simulation);
+        return EXIT_FAILURE;
+    }
+    curr_time = start_time;
+    while((long long)simulation.tick < tick_len) {
+        struct timespec new_time;
+        clock_gettime(CLOCK_MONOTONIC, &new_time);
+        long long frame_time = (long long)(new_time.tv_sec - curr_time.tv_sec) * 1000000000 + new_time.tv_nsec - curr_time.tv_nsec;
+        curr_time = new_time;
+        if (paced) {
+            accumulator += frame_time > 250000000 ? 250000000 : frame_time;
+        } else {
+            accumulator += dt;
+        }
+        while(accumulator >= dt && (long long)simulation.tick < tick_len) {
+            struct timespec tick_start_time, tick_end_time;
+            clock_gettime(CLOCK_MONOTONIC, &tick_start_time);
+            PROFILE_BEGIN(tick_zone, "simulation tick");
+            simulation_tick(&simulation);
+            PROFILE_END(tick_zone);
+            clock_gettime(CLOCK_MONOTONIC, &tick_end_time);
+            long long tick_time = (long long)(tick_end_time.tv_sec - tick_start_time.tv_sec) * 1000000000 + tick_end_time.tv_nsec - tick_start_time.tv_nsec;
+            total_tick_time += tick_time;
+            if (tick_time > worst_tick_time) {
+                worst_tick_time = tick_time;
+            }
+            accumulator -= dt;
+        }
+        if (paced) {
+            thrd_sleep(&(struct timespec) {.tv_sec = 0, .tv_nsec = dt - accumulator}, NULL);
+        }
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+    printf("%llu ticks in %.3f s: %.0f ticks/s, %.3f ms average tick, %.3f ms worst tick, checksum %016llx\n",
+        (unsigned long long)simulation.tick, seconds, (double)simulation.tick / seconds, (double)total_tick_time / 1000000.0 / (double)simulation.tick,
+        (double)worst_tick_time / 1000000.0, (unsigned long long)simulation_checksum(&simulation));
+    if (simulation.jobs != NULL) {
+        destroy_job_system(&jobs);
+    }
+    destroy_simulation(&simulation);
+    return EXIT_SUCCESS;
+}
 
-int main() {
-    int error_code = EXIT_SUCCESS;
+enum benchmark {
+    BENCHMARK_NONE,
+    BENCHMARK_TICKS,
+    BENCHMARK_OBJ,
+    BENCHMARK_WORLD,
+    BENCHMARK_BELTS,
+    BENCHMARK_PROFILER
+};
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "%s",
+        "  --headless                 run the simulation without a window\n"
+        "  --ticks <n>                headless ticks to run\n"
+        "  --machines <n>             headless machines to simulate\n"
+        "  --realtime                 pace headless ticks in real time\n"
+        "  --sim-threads <n>          simulation threads, also for the benchmarks\n"
+        "  --bench-ticks <n>          benchmark simulation ticks, only one benchmark runs at a time\n"
+        "  --bench-obj <path>         benchmark OBJ parsing\n"
+        "  --bench-world              benchmark world tile lookups\n"
+        "  --bench-belts              benchmark belt ticks\n"
+        "  --bench-profiler           benchmark profiler zones\n"
+        "  --cpu-trace <path>         write a CPU trace on exit\n");
+#ifndef FACTORY_HEADLESS
+    fprintf(stderr, "%s",
+        "  --frames-in-flight <n>     frames the CPU may run ahead of the GPU\n"
+        "  --instances <n>            cubes to draw\n"
+        "  --bench-instances          benchmark frame times at growing instance counts\n"
+        "  --depth-prepass            draw depth before color\n"
+        "  --gpu-culling              cull instances in a compute shader\n"
+        "  --present-mode <mode>      fifo, mailbox or immediate\n"
+        "  --fps-cap <n>              limit the frame rate\n"
+        "  --present-wait             wait for each present to reach the display\n"
+        "  --record-threads <n>       threads recording secondary command buffers\n"
+        "  --gpu-profile              time render passes on the GPU\n");
+#endif
+}
+
+#ifndef FACTORY_HEADLESS
+
+// Lays instances out on a square grid in the xy plane centered on the origin.
+void layout_instance_grid(struct instance_data *instance_array, uint32_t instance_len, float spacing) {
+    static const float palette[4][4] = {
+        {1.0f, 1.0f, 1.0f, 1.0f},
+        {1.0f, 0.6f, 0.2f, 1.0f},
+        {0.3f, 0.8f, 0.3f, 1.0f},
+        {0.3f, 0.5f, 1.0f, 1.0f}
+    };
+    uint32_t side = (uint32_t)ceil(sqrt((double)instance_len));
+    float half_extent = (float)(side - 1) * spacing * 0.5f;
+    for (uint32_t i = 0; i < instance_len; i++) {
+        glm_mat4_identity(instance_array[i].model);
+        glm_translate(instance_array[i].model, (vec3) {(float)(i % side) * spacing - half_extent, (float)(i / side) * spacing - half_extent, 0.0f});
+        glm_scale_uni(instance_array[i].model, 0.5f);
+        memcpy(instance_array[i].color, palette[i % 4], sizeof(vec4));
+    }
+}
+
+// Bounds each instance by a cube around its translation that holds the mesh under any rotation,
+// so spinning instances never have to be moved in the tree.
+int build_instance_tree(struct aabb_tree *tree, const struct instance_data *instance_array, uint32_t instance_len, float mesh_radius) {
+    clear_aabb_tree(tree);
+    for (uint32_t i = 0; i < instance_len; i++) {
+        const float* translation = instance_array[i].model[3];
+        float half_extent = mesh_radius * 0.5f; // layout_instance_grid scales by a half
+        vec3 box[2] = {
+            {translation[0] - half_extent, translation[1] - half_extent, translation[2] - half_extent},
+            {translation[0] + half_extent, translation[1] + half_extent, translation[2] + half_extent}
+        };
+        if (aabb_tree_insert(tree, box, i) == AABB_TREE_NULL) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+#endif
+
+int main(int argc, char** argv) {
+    PROFILE_INIT();
+    PROFILE_THREAD("main");
+#ifndef FACTORY_HEADLESS
+    int error_code = EXIT_FAILURE; // every jump to the cleanup labels is a failure, only the normal exit clears it
     VkResult vk_result;
 
+    uint32_t frames_in_flight = MIN_FRAMES_IN_FLIGHT;
+    uint32_t instance_len = 1;
+    int bench_instances = 0;
+    int depth_prepass = 0;
+    int use_gpu_culling = 0;
+    VkPresentModeKHR present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+    uint32_t fps_cap = 0;
+    int use_present_wait = 0;
+    uint32_t record_thread_len = 0;
+    int use_gpu_profiler = 0;
+    struct job_system simulation_jobs;
+    struct simulation_thread simulation_thread;
+    int simulation_thread_started = 0;
+    int headless = 0;
+#else
+    int headless = 1;
+#endif
+    long long headless_tick_len = 10000;
+    uint32_t headless_machine_len = 100000;
+    int headless_paced = 0;
+    uint32_t sim_thread_len = 1;
+    const char *cpu_trace_path = NULL;
+    // benchmarks run once every argument is parsed, so the flags around them apply in any order
+    enum benchmark benchmark = BENCHMARK_NONE;
+    uint32_t bench_tick_len = 0;
+    const char *bench_obj_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = 1;
+        } else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            headless_tick_len = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--machines") == 0 && i + 1 < argc) {
+            headless_machine_len = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            headless_paced = 1;
+        } else if (strcmp(argv[i], "--sim-threads") == 0 && i + 1 < argc) {
+            sim_thread_len = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-ticks") == 0 && i + 1 < argc && benchmark == BENCHMARK_NONE) {
+            benchmark = BENCHMARK_TICKS;
+            bench_tick_len = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-obj") == 0 && i + 1 < argc && benchmark == BENCHMARK_NONE) {
+            benchmark = BENCHMARK_OBJ;
+            bench_obj_path = argv[++i];
+        } else if (strcmp(argv[i], "--bench-world") == 0 && benchmark == BENCHMARK_NONE) {
+            benchmark = BENCHMARK_WORLD;
+        } else if (strcmp(argv[i], "--bench-belts") == 0 && benchmark == BENCHMARK_NONE) {
+            benchmark = BENCHMARK_BELTS;
+        } else if (strcmp(argv[i], "--bench-profiler") == 0 && benchmark == BENCHMARK_NONE) {
+            benchmark = BENCHMARK_PROFILER;
+        } else if (strcmp(argv[i], "--cpu-trace") == 0 && i + 1 < argc) {
+            cpu_trace_path = argv[++i];
+#ifndef FACTORY_HEADLESS
+        } else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+            frames_in_flight = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instance_len = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-instances") == 0) {
+            bench_instances = 1;
+        } else if (strcmp(argv[i], "--depth-prepass") == 0) {
+            depth_prepass = 1;
+        } else if (strcmp(argv[i], "--gpu-culling") == 0) {
+            use_gpu_culling = 1;
+        } else if (strcmp(argv[i], "--present-mode") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "fifo") == 0) {
+                present_mode = VK_PRESENT_MODE_FIFO_KHR;
+            } else if (strcmp(argv[i], "mailbox") == 0) {
+                present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+            } else if (strcmp(argv[i], "immediate") == 0) {
+                present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            } else {
+                fprintf(stderr, "Unknown present mode: %s (fifo, mailbox or immediate)\n", argv[i]);
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--fps-cap") == 0 && i + 1 < argc) {
+            fps_cap = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--present-wait") == 0) {
+            use_present_wait = 1;
+        } else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc) {
+            record_thread_len = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gpu-profile") == 0) {
+            use_gpu_profiler = 1;
+#endif
+        } else if (strncmp(argv[i], "--bench-", 8) == 0 && benchmark != BENCHMARK_NONE) {
+            fprintf(stderr, "Only one benchmark runs at a time: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (benchmark != BENCHMARK_NONE) {
+        int benchmark_result = EXIT_SUCCESS;
+        switch (benchmark) {
+        case BENCHMARK_TICKS:
+            benchmark_result = benchmark_simulation(100000, bench_tick_len, sim_thread_len);
+            break;
+        case BENCHMARK_OBJ:
+            benchmark_result = benchmark_obj_parse(bench_obj_path, 100);
+            break;
+        case BENCHMARK_WORLD:
+            benchmark_result = benchmark_world(10000000);
+            break;
+        case BENCHMARK_BELTS:
+            benchmark_result = benchmark_belts(100000, 500, 1000, sim_thread_len);
+            if (benchmark_result == EXIT_SUCCESS) {
+                benchmark_result = benchmark_belts(1250000, 500, 1000, sim_thread_len);
+            }
+            break;
+        case BENCHMARK_PROFILER:
+            benchmark_result = benchmark_profiler(10000000);
+            break;
+        case BENCHMARK_NONE:
+            break;
+        }
+        if (cpu_trace_path != NULL) {
+            PROFILE_WRITE_TRACE(cpu_trace_path);
+        }
+        return benchmark_result;
+    }
+
+    if (headless) {
+        int headless_result = run_headless(headless_machine_len, headless_tick_len, headless_paced, sim_thread_len);
+        if (cpu_trace_path != NULL) {
+            PROFILE_WRITE_TRACE(cpu_trace_path);
+        }
+        return headless_result;
+    }
+
+#ifndef FACTORY_HEADLESS
+
+    struct mesh cube_mesh;
+    if (load_mesh("cube.obj", &cube_mesh) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
     struct graphics_state graphics;
-    create_graphics_state(&graphics);
-
-    int vertex_count = 36;
-    int vertex_size = 6;
-
-    struct graphics_buffer vertex_staging_buffer;
-    create_graphics_buffer(&graphics, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, sizeof(float) * vertex_size * vertex_count, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &vertex_staging_buffer);
-
-    struct graphics_buffer vertex_buffer;
-    create_graphics_buffer(&graphics, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, sizeof(float) * vertex_size * vertex_count, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer);
-
-    void* vertex_staging_buffer_data;
-    vkMapMemory(graphics.device, vertex_staging_buffer.memory, 0, vertex_staging_buffer.size, 0x0, &vertex_staging_buffer_data);
-
-    struct graphics_buffer* uniform_buffer_array = malloc(sizeof(struct graphics_buffer) * graphics.swapchain_image_len);
-    void** uniform_buffer_data_array = malloc(sizeof(void) * graphics.swapchain_image_len);
-    VkWriteDescriptorSet* uniform_buffer_write_array = malloc(sizeof(VkWriteDescriptorSet) * graphics.swapchain_image_len);
-
-    for (int i = 0; i < graphics.swapchain_image_len; i++) {
-        create_graphics_buffer(&graphics, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, sizeof(mat4), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniform_buffer_array[i]);
-        vkMapMemory(graphics.device, uniform_buffer_array[i].memory, 0, uniform_buffer_array[i].size, 0x0, &uniform_buffer_data_array[i]);
-
-        uniform_buffer_write_array[i] = (VkWriteDescriptorSet) {
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .pNext = NULL,
-            .dstSet = graphics.descriptor_set_array[i],
-            .dstBinding = 0,
-            .dstArrayElement = 0,
-            .descriptorCount = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-            .pImageInfo = NULL,
-            .pBufferInfo = &(VkDescriptorBufferInfo) {
-                .buffer = uniform_buffer_array[i].buffer,
-                .offset = 0,
-                .range = VK_WHOLE_SIZE
-            },
-            .pTexelBufferView = NULL
-        };
+    if (create_graphics_state(&graphics, frames_in_flight, depth_prepass, present_mode) != EXIT_SUCCESS) {
+        free_mesh(&cube_mesh);
+        return EXIT_FAILURE;
     }
 
-    float vertices[216] = {
-        //x, y, z, r, g, b
-
-        // Front face
-        0.5f,  0.5f,  -0.5f, 1.0f,  1.0f,  0.0f,
-        -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,
-        0.5f,  -0.5f, -0.5f, 1.0f,  0.0f,  0.0f,
-        -0.5f, -0.5f, -0.5f, 0.0f,  0.0f,  0.0f,
-        0.5f,  -0.5f, -0.5f, 1.0f,  0.0f,  0.0f,
-        -0.5f,  0.5f, -0.5f, 0.0f,  1.0f,  0.0f,
-
-        // Back face
-        0.5f,  0.5f,  0.5f,  1.0f,  1.0f,  1.0f,
-        0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  1.0f,
-        -0.5f, 0.5f,  0.5f,  0.0f,  1.0f,  1.0f,
-        -0.5f, -0.5f, 0.5f,  0.0f,  0.0f,  1.0f,
-        -0.5f, 0.5f,  0.5f,  0.0f,  1.0f,  1.0f,
-        0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  1.0f,
-
-        // Right face
-        0.5f,  0.5f,  0.5f,  1.0f,  1.0f,  1.0f,
-        0.5f,  0.5f,  -0.5f, 1.0f,  1.0f,  0.0f,
-        0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  1.0f,
-        0.5f,  -0.5f, -0.5f, 1.0f,  0.0f,  0.0f,
-        0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  1.0f,
-        0.5f,  0.5f,  -0.5f, 1.0f,  1.0f,  0.0f,
-
-        // Left face
-        -0.5f, 0.5f,  0.5f,  0.0f,  1.0f,  1.0f,
-        -0.5f, -0.5f, 0.5f,  0.0f,  0.0f,  1.0f,
-        -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,
-        -0.5f, -0.5f, -0.5f, 0.0f,  0.0f,  0.0f,
-        -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,
-        -0.5f, -0.5f, 0.5f,  0.0f,  0.0f,  1.0f,
-
-        // Top face
-        0.5f,  -0.5f, -0.5f, 1.0f,  0.0f,  0.0f,
-        -0.5f, -0.5f, -0.5f, 0.0f,  0.0f,  0.0f,
-        0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  1.0f,
-        -0.5f, -0.5f, 0.5f,  0.0f,  0.0f,  1.0f,
-        0.5f,  -0.5f, 0.5f,  1.0f,  0.0f,  1.0f,
-        -0.5f, -0.5f, -0.5f, 0.0f,  0.0f,  0.0f,
-
-        // Bottom face
-        0.5f,  0.5f,  -0.5f, 1.0f,  1.0f,  0.0f,
-        0.5f,  0.5f,   0.5f, 1.0f,  1.0f,  1.0f,
-        -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,
-        -0.5f, 0.5f,  0.5f,  0.0f,  1.0f,  1.0f,
-        -0.5f, 0.5f,  -0.5f, 0.0f,  1.0f,  0.0f,
-        0.5f,  0.5f,  0.5f,  1.0f,  1.0f,  1.0f,
-    };
+    // the first frames wait on this on the GPU instead of the CPU stalling here
+    uint64_t render_upload_ticket = 0;
+    struct graphics_mesh cube;
+    if (create_graphics_mesh(&graphics, &cube_mesh, &cube, &render_upload_ticket) != EXIT_SUCCESS) {
+        free_mesh(&cube_mesh);
+        cleanup(&graphics);
+        return EXIT_FAILURE;
+    }
+    float cube_radius = mesh_radius(&cube_mesh);
+    free_mesh(&cube_mesh);
+
+    // the benchmark holds each instance count for a fixed number of frames, with static instances
+    const uint32_t bench_instance_len_array[3] = {10000, 100000, 1000000};
+    const long long bench_warmup_frames = 60;
+    const long long bench_frames = 300;
+    uint32_t bench_stage = 0;
+    long long bench_frame_count = 0;
+    long long bench_frame_time = 0;
+    if (bench_instances) {
+        instance_len = bench_instance_len_array[0];
+    }
+    if (instance_len == 0) {
+        instance_len = 1;
+    }
+    const float instance_spacing = 1.5f;
+    uint32_t instance_capacity = bench_instances ? bench_instance_len_array[2] : instance_len;
+    struct instance_data *instance_array = counted_malloc(sizeof(struct instance_data) * instance_capacity);
+    uint32_t *visible_instance_array = counted_malloc(sizeof(uint32_t) * instance_capacity);
+    struct aabb_tree instance_tree = {0};
+    struct gpu_culling gpu_culling;
+    int gpu_culling_enabled = 0;
+    struct parallel_recorder recorder;
+    int parallel_recording_enabled = 0;
+    struct gpu_profiler gpu_profiler;
+    int gpu_profiler_enabled = 0;
+    if (instance_array == NULL || visible_instance_array == NULL) {
+        perror("failed to allocate instances");
+        goto free_instances;
+    }
+    layout_instance_grid(instance_array, instance_len, instance_spacing);
+    if (create_aabb_tree(&instance_tree, instance_capacity * 2) != EXIT_SUCCESS || build_instance_tree(&instance_tree, instance_array, instance_len, cube_radius) != EXIT_SUCCESS) {
+        goto free_instances;
+    }
 
-    memcpy(vertex_staging_buffer_data, vertices, vertex_staging_buffer.size);
-    copy_graphics_buffer(graphics, vertex_staging_buffer, vertex_buffer, vertex_staging_buffer.size);
+    // with GPU culling the instances stay as laid out, only the compute shader touches them per frame
+    if (use_gpu_culling) {
+        if (create_gpu_culling(&graphics, &gpu_culling, instance_capacity) != EXIT_SUCCESS) {
+            goto free_instances;
+        }
+        gpu_culling_enabled = 1;
+        uint64_t gpu_culling_ticket = upload_gpu_culling_instances(&graphics, &gpu_culling, instance_array, instance_len, cube_radius * 0.5f, &(struct instance_batch) {.mesh = &cube, .first_instance = 0, .instance_len = instance_len}, 1);
+        if (gpu_culling_ticket == 0) {
+            goto free_instances;
+        }
+        render_upload_ticket = gpu_culling_ticket > render_upload_ticket ? gpu_culling_ticket : render_upload_ticket;
+    }
+
+    // GPU culling draws everything with one indirect command, there is nothing to spread over threads
+    if (record_thread_len > 0 && use_gpu_culling) {
+        printf("%s", "Parallel recording is not used with GPU culling\n");
+    } else if (record_thread_len > 0) {
+        if (create_parallel_recorder(&graphics, &recorder, record_thread_len) != EXIT_SUCCESS) {
+            goto free_instances;
+        }
+        parallel_recording_enabled = 1;
+    }
+
+    if (use_gpu_profiler) {
+        if (create_gpu_profiler(&graphics, &gpu_profiler) != EXIT_SUCCESS) {
+            goto free_instances;
+        }
+        gpu_profiler_enabled = 1;
+    }
+
+    // one machine per instance, on the same grid
+    struct simulation simulation;
+    if (create_simulation(&simulation, instance_len) != EXIT_SUCCESS || populate_simulation(&simulation, instance_len) != EXIT_SUCCESS) {
+        goto free_simulation;
+    }
+    if (sim_thread_len > 1) {
+        if (create_job_system(&simulation_jobs, sim_thread_len) != EXIT_SUCCESS) {
+            goto free_simulation;
+        }
+        simulation.jobs = &simulation_jobs;
+    }
+    // from here on the simulation ticks on its own thread and frames only read its snapshots
+    if (start_simulation_thread(&simulation_thread, &simulation) != EXIT_SUCCESS) {
+        goto free_simulation;
+    }
+    simulation_thread_started = 1;
 
     uint32_t current_frame = 0;
+    long long total_frame_time = 0;
+    long long frame_count = 0;
+    long long total_record_time = 0;
+    // overdraw: fragment shader invocations per covered pixel, read back from each frame's statistics query
+    unsigned long long fragment_invocation_count = 0;
+    unsigned long long fragment_pixel_count = 0;
+    uint32_t visible_instance_len = 0;
+
+    // latency runs from the input poll a frame was built from to its present: to the moment it
+    // reached the display with present wait, otherwise to the present call returning
+    struct frame_pacer pacer;
+    create_frame_pacer(&pacer, fps_cap);
+    int present_wait_enabled = use_present_wait && graphics.present_wait_supported;
+    if (use_present_wait && !present_wait_enabled) {
+        printf("%s", "Present wait is not supported, measuring latency to the present call instead\n");
+    }
+    struct frame_histogram frame_time_histogram;
+    struct frame_histogram latency_histogram;
+    clear_frame_histogram(&frame_time_histogram);
+    clear_frame_histogram(&latency_histogram);
+    long long input_time_array[PRESENT_HISTORY_LEN];
+    long long input_time = pacing_now_ns();
+    uint64_t previous_present_id = 0; // 0 after a swapchain recreation, the new swapchain has no earlier presents
+    long long overlay_time = input_time;
+    char overlay_title[256];
 
     struct timespec curr_time;
-    const int dt = 10000000; // 1/100 of a sec
-    long int accumulator = 0;
-    long int t = 0;
     if(clock_gettime(CLOCK_MONOTONIC, &curr_time) != 0) {
             perror("failed to get time");
             goto cleanup_graphics;
     }
     while(!glfwWindowShouldClose(graphics.window) && glfwGetMouseButton(graphics.window, 1) != GLFW_PRESS) {
+        pace_frame(&pacer);
+        // once every frame slot has been used, a frame must not touch the heap
+        unsigned long long frame_allocation_count = get_allocation_count();
+        int steady_frame = frame_count > graphics.frame_len;
         struct timespec new_time;
         if(clock_gettime(CLOCK_MONOTONIC, &new_time) != 0) {
             perror("failed to get time during loop");
@@ -134,29 +470,106 @@ int main() {
             frame_time = 250000000;
         }
         curr_time = new_time;
-        accumulator += frame_time;
-        while(accumulator > dt) {
-            // logic tick
-            t += dt;
-            accumulator -= dt;
+        total_frame_time += frame_time;
+        record_frame_histogram(&frame_time_histogram, frame_time);
+        frame_count += 1;
+        // the newest tick the simulation thread finished, and how far this frame is past it
+        const struct render_snapshot *snapshot = acquire_render_snapshot(&simulation_thread.exchange);
+        const float alpha = snapshot_alpha(snapshot, (long long)curr_time.tv_sec * 1000000000 + curr_time.tv_nsec);
+
+        if (bench_instances) {
+            bench_frame_count += 1;
+            if (bench_frame_count > bench_warmup_frames) {
+                bench_frame_time += frame_time;
+            }
+            if (bench_frame_count == bench_warmup_frames + bench_frames) {
+                if (gpu_culling_enabled) {
+                    printf("%u instances (culled on the GPU): %.3f ms average frame time over %lld frames after %lld warmup frames\n", instance_len, (double)bench_frame_time / (double)bench_frames / 1000000.0, bench_frames, bench_warmup_frames);
+                } else {
+                    printf("%u instances (%u visible): %.3f ms average frame time over %lld frames after %lld warmup frames\n", instance_len, visible_instance_len, (double)bench_frame_time / (double)bench_frames / 1000000.0, bench_frames, bench_warmup_frames);
+                }
+                bench_stage += 1;
+                if (bench_stage == 3) {
+                    glfwSetWindowShouldClose(graphics.window, GLFW_TRUE);
+                } else {
+                    // the tree and the instance uploads may grow for the new stage
+                    steady_frame = 0;
+                    instance_len = bench_instance_len_array[bench_stage];
+                    layout_instance_grid(instance_array, instance_len, instance_spacing);
+                    if (build_instance_tree(&instance_tree, instance_array, instance_len, cube_radius) != EXIT_SUCCESS) {
+                        goto cleanup_graphics;
+                    }
+                    if (gpu_culling_enabled) {
+                        // earlier frames still read the old instances. Their fences cover exactly those frames
+                        // rather than idling the whole queue, and the wait lands in the new stage's warmup frames
+                        for (uint32_t f = 0; f < graphics.frame_len; f++) {
+                            vkWaitForFences(graphics.device, 1, &graphics.frame_array[f].in_flight_fence, VK_TRUE, UINT64_MAX);
+                        }
+                        render_upload_ticket = upload_gpu_culling_instances(&graphics, &gpu_culling, instance_array, instance_len, cube_radius * 0.5f, &(struct instance_batch) {.mesh = &cube, .first_instance = 0, .instance_len = instance_len}, 1);
+                        if (render_upload_ticket == 0) {
+                            goto cleanup_graphics;
+                        }
+                    }
+                    bench_frame_count = 0;
+                    bench_frame_time = 0;
+                }
+            }
         }
-        const double alpha = (double)accumulator / dt;
         //lerp state and render state;
         //printf("%s", "Beginning new frame\n");
 
-        vkWaitForFences(graphics.device, 1, &graphics.swapchain_in_flight_fence_array[current_frame], VK_TRUE, UINT64_MAX);
-        vkResetCommandBuffer(graphics.command_buffer, 0x0);
+        // Only blocks if the GPU is still working on the frame that used this slot frame_len frames ago
+        struct frame_state *frame = &graphics.frame_array[current_frame];
+        PROFILE_BEGIN(fence_zone, "frame fence wait");
+        vkWaitForFences(graphics.device, 1, &frame -> in_flight_fence, VK_TRUE, UINT64_MAX);
+        PROFILE_END(fence_zone);
+        complete_frame(&graphics, frame);
+
+        if (gpu_profiler_enabled) {
+            read_gpu_profiler_frame(&graphics, &gpu_profiler, current_frame);
+        }
+        if (frame -> statistics_query_issued) {
+            uint64_t fragment_invocations;
+            if (vkGetQueryPoolResults(graphics.device, graphics.statistics_query_pool, current_frame, 1, sizeof(uint64_t), &fragment_invocations, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+                fragment_invocation_count += fragment_invocations;
+                fragment_pixel_count += (unsigned long long)frame -> statistics_query_pixel_len;
+            }
+            frame -> statistics_query_issued = 0;
+        }
 
         uint32_t image_index;
-        VkResult swapchain_error = vkAcquireNextImageKHR(graphics.device, graphics.swapchain, UINT64_MAX - 1, graphics.swapchain_image_available_semaphore_array[current_frame], VK_NULL_HANDLE, &image_index);
+        PROFILE_BEGIN(acquire_zone, "acquire");
+        VkResult swapchain_error = vkAcquireNextImageKHR(graphics.device, graphics.swapchain, UINT64_MAX - 1, frame -> image_available_semaphore, VK_NULL_HANDLE, &image_index);
+        PROFILE_END(acquire_zone);
         if (swapchain_error == VK_ERROR_OUT_OF_DATE_KHR) {
-            recreate_swapchain(&graphics);
+            if (recreate_swapchain(&graphics) != EXIT_SUCCESS) {
+                goto cleanup_graphics;
+            }
+            previous_present_id = 0;
             continue;
         }
         //printf("%s", "Image acquired\n");
-        vkResetFences(graphics.device, 1, &graphics.swapchain_in_flight_fence_array[current_frame]);
 
-        float camera_position[3] = {0.0f, 0.0f, -2.0f};
+        // The swapchain can hand back an image that an older frame slot is still rendering to
+        if (graphics.swapchain_image_fence_array[image_index] != VK_NULL_HANDLE) {
+            vkWaitForFences(graphics.device, 1, &graphics.swapchain_image_fence_array[image_index], VK_TRUE, UINT64_MAX);
+        }
+        graphics.swapchain_image_fence_array[image_index] = frame -> in_flight_fence;
+        vkResetFences(graphics.device, 1, &frame -> in_flight_fence);
+        vkResetCommandPool(graphics.device, frame -> command_pool, 0x0);
+        reset_arena(&frame -> arena);
+        frame -> uniform_used = 0;
+
+        uint32_t previous_instance_capacity = frame -> instance_capacity;
+        if (!gpu_culling_enabled && reserve_instance_buffer(&graphics, frame, instance_len) != EXIT_SUCCESS) {
+            goto cleanup_graphics;
+        }
+        if (frame -> instance_capacity != previous_instance_capacity) {
+            steady_frame = 0;
+        }
+
+        float grid_extent = (float)(ceil(sqrt((double)instance_len)) - 1.0) * instance_spacing;
+        float camera_position[3] = {0.0f, 0.0f, -2.0f - grid_extent};
 
         float theta = (float)fmod((double)curr_time.tv_nsec / 1000000000.0 + (double)curr_time.tv_sec, 3.1415 * 2);
 
@@ -214,12 +627,6 @@ int main() {
             0.0f, 0.0f, 0.0f, 1.0f
         };
 
-        mat4 model_matrix;
-        glm_mat4_make(empty_matrix_values, model_matrix);
-        glm_rotate_x(model_matrix, theta, model_matrix);
-        glm_rotate_y(model_matrix, theta, model_matrix);
-        glm_rotate_z(model_matrix, theta, model_matrix);
-
         mat4 view_matrix;
         glm_mat4_make(empty_matrix_values, view_matrix);
         float center[3] = {0.0f, 0.0f, 0.0f};
@@ -228,14 +635,55 @@ int main() {
 
         mat4 projection_matrix;
         glm_mat4_make(empty_matrix_values, projection_matrix);
-        glm_perspective(45.0f, (float)graphics.image_extent.width / (float)graphics.image_extent.height, 0.1f, 10.0f, projection_matrix);
+        glm_perspective(45.0f, (float)graphics.image_extent.width / (float)graphics.image_extent.height, 0.1f, 10.0f + grid_extent, projection_matrix);
 
         mat4 final_matrix;
         glm_mat4_mul(projection_matrix, view_matrix, final_matrix);
-        glm_mat4_mul(final_matrix, model_matrix, final_matrix);
 
-        memcpy(uniform_buffer_data_array[current_frame], final_matrix, uniform_buffer_array[current_frame].size);
-        vkUpdateDescriptorSets(graphics.device, 1, &uniform_buffer_write_array[current_frame], 0, NULL);
+        // only what is on screen is animated, written and drawn
+        vec4 frustum_planes[6];
+        glm_frustum_planes(final_matrix, frustum_planes);
+        // the GPU culls and writes its own instances
+        PROFILE_BEGIN(culling_zone, "culling");
+        visible_instance_len = gpu_culling_enabled ? 0 : aabb_tree_cull(&instance_tree, frustum_planes, visible_instance_array);
+        PROFILE_END(culling_zone);
+
+        // the rotation only touches the upper 3x3, the translation column stays
+        mat4 rotation_matrix;
+        glm_mat4_make(empty_matrix_values, rotation_matrix);
+        glm_scale_uni(rotation_matrix, 0.5f);
+        glm_rotate_x(rotation_matrix, theta, rotation_matrix);
+        glm_rotate_y(rotation_matrix, theta, rotation_matrix);
+        glm_rotate_z(rotation_matrix, theta, rotation_matrix);
+        for (uint32_t i = 0; i < visible_instance_len; i++) {
+            uint32_t instance = visible_instance_array[i];
+            struct instance_data *instance_data = &frame -> instance_data[i];
+            *instance_data = instance_array[instance];
+            if (bench_instances || instance >= snapshot -> machine_len) {
+                continue;
+            }
+            memcpy(instance_data -> model, rotation_matrix, sizeof(vec4) * 3);
+            // tint by machine state, brightening through each craft
+            float progress = snapshot_machine_progress(snapshot, instance, alpha);
+            switch (snapshot -> state_array[instance]) {
+            case MACHINE_WORKING:
+                glm_vec4_copy((vec4) {0.4f + 0.6f * progress, 0.4f + 0.6f * progress, 0.4f + 0.6f * progress, 1.0f}, instance_data -> color);
+                break;
+            case MACHINE_NO_INPUT:
+                glm_vec4_copy((vec4) {0.3f, 0.3f, 0.3f, 1.0f}, instance_data -> color);
+                break;
+            default:
+                glm_vec4_copy((vec4) {1.0f, 0.3f, 0.2f, 1.0f}, instance_data -> color);
+                break;
+            }
+        }
+
+        uint32_t camera_uniform_offset;
+        void* camera_uniform = uniform_alloc(&graphics, frame, sizeof(mat4), &camera_uniform_offset);
+        if (camera_uniform == NULL) {
+            goto cleanup_graphics;
+        }
+        memcpy(camera_uniform, final_matrix, sizeof(mat4));
 
         VkViewport viewport = (VkViewport) {
             .x = 0.0f,
@@ -250,104 +698,257 @@ int main() {
             .extent = graphics.image_extent
         };
 
+        struct instance_batch cube_batch = (struct instance_batch) {
+            .mesh = &cube,
+            .first_instance = 0,
+            .instance_len = visible_instance_len
+        };
+        // secondary command buffers can only run inside the query when they inherit it
+        int statistics_query_enabled = graphics.statistics_query_pool != VK_NULL_HANDLE && (!parallel_recording_enabled || graphics.inherited_queries_supported);
+
+        long long record_start_time = pacing_now_ns();
+        PROFILE_BEGIN(recording_zone, "recording");
+        if (parallel_recording_enabled) {
+            begin_parallel_recording(&recorder, &(struct record_job) {
+                .frame = frame,
+                .frame_index = current_frame,
+                .viewport = viewport,
+                .scissor = scissor,
+                .camera_uniform_offset = camera_uniform_offset,
+                .batch_array = &cube_batch,
+                .batch_len = 1,
+                .pipeline_statistics = statistics_query_enabled ? VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT : 0x0
+            });
+        }
+
         handle_error(vkBeginCommandBuffer(
-            graphics.command_buffer,
+            frame -> command_buffer,
             &(VkCommandBufferBeginInfo) {
                 .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
                 .pNext = NULL,
-                .flags = 0x0,
-                .pInheritanceInfo = &(VkCommandBufferInheritanceInfo) {
-                    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
-                    .pNext = NULL,
-                    .renderPass = graphics.render_pass,
-                    .subpass = 0,
-                    .framebuffer = graphics.framebuffer_array[current_frame],
-                    .occlusionQueryEnable = VK_TRUE,
-                    .queryFlags = 0x0,
-                    .pipelineStatistics = 0x0,
-                }
+                .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                .pInheritanceInfo = NULL
             }
         ), cleanup_graphics);
 
-        VkClearValue clear_color = {{0.0f, 0.0f, 0.0f, 1.0f}};
-        VkClearValue *clear_color_array = malloc(sizeof(VkClearValue) * graphics.swapchain_image_len);
-        for(int i = 0; i < graphics.swapchain_image_len; i++) {
-            clear_color_array[i] = clear_color;
+        uint32_t frame_scope = GPU_PROFILER_NO_SCOPE;
+        if (gpu_profiler_enabled) {
+            begin_gpu_profiler_frame(&gpu_profiler, frame -> command_buffer, current_frame, graphics.submitted_frame_serial + 1);
+            frame_scope = begin_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, "frame");
+        }
+        if (gpu_culling_enabled) {
+            uint32_t culling_scope = gpu_profiler_enabled ? begin_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, "gpu culling") : GPU_PROFILER_NO_SCOPE;
+            record_gpu_culling(frame -> command_buffer, &gpu_culling, frustum_planes);
+            end_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, culling_scope);
+        }
+        // the query spans the rendering, so it already covers the secondary command buffers
+        if (statistics_query_enabled) {
+            vkCmdResetQueryPool(frame -> command_buffer, graphics.statistics_query_pool, current_frame, 1);
+            vkCmdBeginQuery(frame -> command_buffer, graphics.statistics_query_pool, current_frame, 0x0);
         }
 
-        vkCmdBeginRenderPass(
-            graphics.command_buffer,
-            &(VkRenderPassBeginInfo) {
-                .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-                .pNext = NULL,
-                .renderPass = graphics.render_pass,
-                .framebuffer = graphics.framebuffer_array[current_frame],
-                .renderArea = (VkRect2D) {
-                    .offset = {0, 0},
-                    .extent = graphics.image_extent
-                },
-                .clearValueCount = graphics.swapchain_image_len,
-                .pClearValues = clear_color_array
-            },
-            VK_SUBPASS_CONTENTS_INLINE
-        );
-        //printf("%s", "Command buffer and render pass have begun\n");
-
-        vkCmdBindPipeline(graphics.command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipeline);
-        VkDeviceSize offsets[1] = {0};
-        vkCmdBindVertexBuffers(graphics.command_buffer, 0, 1, &vertex_buffer.buffer, offsets);
-        vkCmdBindDescriptorSets(graphics.command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipeline_layout, 0, 1, &graphics.descriptor_set_array[current_frame], 0, NULL);
-        vkCmdSetViewport(graphics.command_buffer, 0, 1, &viewport);
-        vkCmdSetScissor(graphics.command_buffer, 0, 1, &scissor);
-        vkCmdDraw(graphics.command_buffer, vertex_count, 1, 0, 0);
-        vkCmdEndRenderPass(graphics.command_buffer);
-        vkEndCommandBuffer(graphics.command_buffer);
-
-        VkPipelineStageFlags wait_stage_mask_array[1] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+        // with secondary command buffers the primary can only time the rendering as a whole
+        uint32_t rendering_scope = gpu_profiler_enabled ? begin_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, "rendering") : GPU_PROFILER_NO_SCOPE;
+        begin_frame_rendering(frame -> command_buffer, &graphics, image_index, parallel_recording_enabled ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0x0);
+        //printf("%s", "Command buffer and rendering have begun\n");
+
+        if (parallel_recording_enabled) {
+            if (end_parallel_recording(&recorder, frame -> command_buffer) != EXIT_SUCCESS) {
+                goto cleanup_graphics;
+            }
+        } else {
+            vkCmdBindDescriptorSets(frame -> command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipeline_layout, 0, 1, &graphics.descriptor_set, 1, &camera_uniform_offset);
+            vkCmdSetViewport(frame -> command_buffer, 0, 1, &viewport);
+            vkCmdSetScissor(frame -> command_buffer, 0, 1, &scissor);
+            if (graphics.depth_prepass_pipeline != VK_NULL_HANDLE) {
+                uint32_t prepass_scope = gpu_profiler_enabled ? begin_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, "depth prepass") : GPU_PROFILER_NO_SCOPE;
+                vkCmdBindPipeline(frame -> command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.depth_prepass_pipeline);
+                if (gpu_culling_enabled) {
+                    draw_gpu_culled_instances(frame -> command_buffer, &gpu_culling);
+                } else {
+                    draw_instance_batches(frame -> command_buffer, frame, &cube_batch, 1);
+                }
+                end_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, prepass_scope);
+            }
+            uint32_t color_scope = gpu_profiler_enabled ? begin_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, "color") : GPU_PROFILER_NO_SCOPE;
+            vkCmdBindPipeline(frame -> command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipeline);
+            if (gpu_culling_enabled) {
+                draw_gpu_culled_instances(frame -> command_buffer, &gpu_culling);
+            } else {
+                draw_instance_batches(frame -> command_buffer, frame, &cube_batch, 1);
+            }
+            end_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, color_scope);
+        }
+        end_frame_rendering(frame -> command_buffer, &graphics, image_index);
+        end_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, rendering_scope);
+        if (statistics_query_enabled) {
+            vkCmdEndQuery(frame -> command_buffer, graphics.statistics_query_pool, current_frame);
+            frame -> statistics_query_issued = 1;
+            frame -> statistics_query_pixel_len = graphics.image_extent.width * graphics.image_extent.height;
+        }
+        end_gpu_scope(&gpu_profiler, frame -> command_buffer, current_frame, frame_scope);
+        vkEndCommandBuffer(frame -> command_buffer);
+        PROFILE_END(recording_zone);
+        total_record_time += pacing_now_ns() - record_start_time;
+
+        // all uploads requested this frame go out as one transfer submit
+        if (graphics.upload_ring.recording && flush_uploads(&graphics) == 0) {
+            goto cleanup_graphics;
+        }
+
+        VkPipelineStageFlags wait_stage_mask_array[2] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT};
+        VkSemaphore wait_semaphore_array[2] = {frame -> image_available_semaphore, graphics.upload_ring.timeline_semaphore};
+        uint64_t wait_value_array[2] = {0, render_upload_ticket};
+        uint32_t wait_semaphore_len = upload_ticket_complete(&graphics, render_upload_ticket) ? 1 : 2;
+        frame -> frame_serial = ++graphics.submitted_frame_serial;
+        PROFILE_BEGIN(submit_zone, "submit");
         vkQueueSubmit(
            graphics.queue,
             1,
                 &(VkSubmitInfo) {
                 .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-                .pNext = NULL,
-                .waitSemaphoreCount = 1,
-                .pWaitSemaphores = &graphics.swapchain_image_available_semaphore_array[current_frame],
+                .pNext = &(VkTimelineSemaphoreSubmitInfo) {
+                    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+                    .pNext = NULL,
+                    .waitSemaphoreValueCount = wait_semaphore_len,
+                    .pWaitSemaphoreValues = wait_value_array,
+                    .signalSemaphoreValueCount = 0,
+                    .pSignalSemaphoreValues = NULL
+                },
+                .waitSemaphoreCount = wait_semaphore_len,
+                .pWaitSemaphores = wait_semaphore_array,
                 .pWaitDstStageMask = wait_stage_mask_array,
                 .commandBufferCount = 1,
-                .pCommandBuffers = &graphics.command_buffer,
+                .pCommandBuffers = &frame -> command_buffer,
                 .signalSemaphoreCount = 1,
-                .pSignalSemaphores = &graphics.swapchain_render_finished_semaphore_array[current_frame]
+                .pSignalSemaphores = &graphics.swapchain_render_finished_semaphore_array[image_index]
             },
-            graphics.swapchain_in_flight_fence_array[current_frame]
+            frame -> in_flight_fence
         );
+        PROFILE_END(submit_zone);
         //printf("%s", "Commands submitted\n");
-        vkWaitForFences(graphics.device, 1, &graphics.swapchain_in_flight_fence_array[current_frame], VK_TRUE, UINT64_MAX);
 
+        // the frame serial doubles as the present id, it only ever grows
+        uint64_t present_id = frame -> frame_serial;
+        input_time_array[present_id % PRESENT_HISTORY_LEN] = input_time;
+        PROFILE_BEGIN(present_zone, "present");
         swapchain_error = vkQueuePresentKHR(
             graphics.queue,
             &(VkPresentInfoKHR) {
                 .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-                .pNext = NULL,
+                .pNext = present_wait_enabled ? &(VkPresentIdKHR) {
+                    .sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+                    .pNext = NULL,
+                    .swapchainCount = 1,
+                    .pPresentIds = &present_id
+                } : NULL,
                 .waitSemaphoreCount = 1,
-                .pWaitSemaphores = &graphics.swapchain_render_finished_semaphore_array[current_frame],
+                .pWaitSemaphores = &graphics.swapchain_render_finished_semaphore_array[image_index],
                 .swapchainCount = 1,
                 .pSwapchains = &graphics.swapchain,
                 .pImageIndices = &image_index,
                 .pResults = NULL
             }
         );
+        PROFILE_END(present_zone);
         if (swapchain_error == VK_ERROR_OUT_OF_DATE_KHR) {
-            recreate_swapchain(&graphics);
+            if (recreate_swapchain(&graphics) != EXIT_SUCCESS) {
+                goto cleanup_graphics;
+            }
+            previous_present_id = 0;
+            // the frame was submitted, so its slot is in use like after any other present
+            current_frame = (current_frame + 1) % graphics.frame_len;
             continue;
         }
         //printf("%s", "Image presented\n");
 
-        current_frame = (current_frame + 1) % graphics.swapchain_image_len;
+        // Waiting for the previous frame to reach the display keeps at most this one queued behind
+        // it, so the next input poll is as late as it can be without missing the next refresh
+        if (present_wait_enabled) {
+            PROFILE_BEGIN(present_wait_zone, "present wait");
+            if (previous_present_id != 0 && graphics.wait_for_present(graphics.device, graphics.swapchain, previous_present_id, 100000000) == VK_SUCCESS) {
+                record_frame_histogram(&latency_histogram, pacing_now_ns() - input_time_array[previous_present_id % PRESENT_HISTORY_LEN]);
+            }
+            previous_present_id = present_id;
+            PROFILE_END(present_wait_zone);
+        } else {
+            record_frame_histogram(&latency_histogram, pacing_now_ns() - input_time);
+        }
+
+        current_frame = (current_frame + 1) % graphics.frame_len;
+
+        if (steady_frame) {
+            assert_no_allocations_since(frame_allocation_count);
+        }
 
         glfwPollEvents();
+        input_time = pacing_now_ns();
+
+        // the window title is the overlay, refreshed twice a second from the histograms
+        if (input_time - overlay_time > 500000000) {
+            overlay_time = input_time;
+            snprintf(overlay_title, sizeof(overlay_title), "Hello Window | %s%s | frame %.2f ms p99 %.2f ms | latency p50 %.2f ms p99 %.2f ms",
+                present_mode_name(graphics.present_mode), present_wait_enabled ? " + present wait" : "",
+                (double)frame_time_histogram.total_ns / (double)(frame_time_histogram.sample_len ? frame_time_histogram.sample_len : 1) / 1000000.0,
+                (double)frame_histogram_percentile(&frame_time_histogram, 0.99) / 1000000.0,
+                (double)frame_histogram_percentile(&latency_histogram, 0.5) / 1000000.0,
+                (double)frame_histogram_percentile(&latency_histogram, 0.99) / 1000000.0);
+            glfwSetWindowTitle(graphics.window, overlay_title);
+        }
     }
 
+    if (frame_count > 0) {
+        printf("Average frame time: %.3f ms over %lld frames with %u frames in flight\n", (double)total_frame_time / (double)frame_count / 1000000.0, frame_count, graphics.frame_len);
+    }
+    if (frame_count > 0) {
+        if (parallel_recording_enabled) {
+            printf("Average command recording time: %.3f ms on %u recording threads\n", (double)total_record_time / (double)frame_count / 1000000.0, recorder.thread_len);
+        } else {
+            printf("Average command recording time: %.3f ms inline on the main thread\n", (double)total_record_time / (double)frame_count / 1000000.0);
+        }
+    }
+    if (gpu_profiler_enabled) {
+        print_gpu_profiler(&gpu_profiler);
+        write_gpu_profiler_csv(&gpu_profiler, "gpu_profile.csv");
+        write_gpu_profiler_trace(&gpu_profiler, "gpu_profile.json");
+    }
+    if (fragment_pixel_count > 0) {
+        printf("Overdraw: %.3f fragment shader invocations per pixel (depth pre-pass %s)\n", (double)fragment_invocation_count / (double)fragment_pixel_count, depth_prepass ? "on" : "off");
+    }
+    printf("Present mode %s, frame rate cap %u fps (0 is uncapped), present wait %s\n", present_mode_name(graphics.present_mode), fps_cap, present_wait_enabled ? "on" : "off");
+    print_frame_histogram("Frame time", &frame_time_histogram);
+    print_frame_histogram(present_wait_enabled ? "Input to display latency" : "Input to present call latency", &latency_histogram);
+    if (cpu_trace_path != NULL) {
+        PROFILE_WRITE_TRACE(cpu_trace_path);
+    }
     printf("Exiting normally!!\n\n");
+    error_code = EXIT_SUCCESS;
 cleanup_graphics:
+    vkDeviceWaitIdle(graphics.device);
+free_simulation:
+    if (simulation_thread_started) {
+        stop_simulation_thread(&simulation_thread);
+        destroy_simulation_thread(&simulation_thread);
+    }
+    if (simulation.jobs != NULL) {
+        destroy_job_system(&simulation_jobs);
+    }
+    destroy_simulation(&simulation);
+free_instances:
+    if (gpu_profiler_enabled) {
+        destroy_gpu_profiler(&graphics, &gpu_profiler);
+    }
+    if (parallel_recording_enabled) {
+        destroy_parallel_recorder(&recorder);
+    }
+    if (gpu_culling_enabled) {
+        destroy_gpu_culling(&graphics, &gpu_culling);
+    }
+    destroy_aabb_tree(&instance_tree);
+    free(visible_instance_array);
+    free(instance_array);
+    destroy_graphics_mesh(&graphics, &cube);
     cleanup(&graphics);
+    return error_code;
+#endif
 }
@@ -0,0 +1,465 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan.h>
+#include "arena_handling.h"
+#include "error_handling.h"
+
+// Buffers are carved out of a few large VkDeviceMemory blocks per memory type instead of one
+// vkAllocateMemory per buffer. Blocks either hand out space linearly (cheap, only reclaimed once
+// every allocation in the block is freed) or through a buddy free list (general purpose).
+
+#define MEMORY_BLOCK_SIZE (64ull * 1024ull * 1024ull)
+#define MEMORY_MIN_ALLOCATION_SIZE 256ull
+#define MEMORY_MAX_ORDER_LEN 40
+
+enum memory_strategy {
+    MEMORY_STRATEGY_BUDDY,
+    MEMORY_STRATEGY_LINEAR,
+    MEMORY_STRATEGY_DEDICATED
+};
+
+// Linear (buffers) and optimally tiled (images) resources never share a block, which keeps them
+// bufferImageGranularity apart without having to inspect neighbouring allocations.
+enum memory_resource_kind {
+    MEMORY_RESOURCE_LINEAR,
+    MEMORY_RESOURCE_OPTIMAL
+};
+
+enum memory_unit_state {
+    MEMORY_UNIT_NONE,
+    MEMORY_UNIT_FREE,
+    MEMORY_UNIT_ALLOCATED
+};
+
+struct memory_block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    uint32_t memory_type_index;
+    enum memory_strategy strategy;
+    enum memory_resource_kind resource_kind;
+    void* mapped;
+    uint32_t allocation_count;
+    VkDeviceSize used;
+    // linear
+    VkDeviceSize linear_offset;
+    // buddy, indexed by MEMORY_MIN_ALLOCATION_SIZE units
+    uint32_t max_order;
+    int32_t free_head[MEMORY_MAX_ORDER_LEN];
+    int32_t* free_next;
+    int32_t* free_prev;
+    uint8_t* unit_order;
+    uint8_t* unit_state;
+};
+
+struct memory_allocation {
+    uint32_t block_index;
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkDeviceSize allocated_size;
+    void* mapped;
+};
+
+struct memory_stats {
+    uint32_t block_count;
+    uint32_t device_allocation_count;
+    uint32_t max_device_allocation_count;
+    uint32_t live_allocation_count;
+    VkDeviceSize reserved_bytes;
+    VkDeviceSize allocated_bytes;
+    VkDeviceSize live_bytes;
+    VkDeviceSize free_bytes;
+    VkDeviceSize largest_free_bytes;
+    double fragmentation;
+};
+
+struct memory_allocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkDeviceSize buffer_image_granularity;
+    uint32_t max_device_allocation_count;
+    struct memory_block* block_array;
+    uint32_t block_len;
+    uint32_t block_capacity;
+    uint32_t device_allocation_count;
+    uint32_t live_allocation_count;
+    VkDeviceSize live_bytes;
+};
+
+int create_memory_allocator(struct memory_allocator *allocator, VkPhysicalDevice physical_device, VkDevice device) {
+    *allocator = (struct memory_allocator) {0};
+    allocator -> device = device;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &allocator -> memory_properties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    allocator -> buffer_image_granularity = properties.limits.bufferImageGranularity;
+    allocator -> max_device_allocation_count = properties.limits.maxMemoryAllocationCount;
+
+    allocator -> block_capacity = 16;
+    allocator -> block_array = counted_malloc(sizeof(struct memory_block) * allocator -> block_capacity);
+    if (allocator -> block_array == NULL) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int find_memory_type(struct memory_allocator *allocator, uint32_t memory_type_bits, VkMemoryPropertyFlags memory_property_flags, uint32_t *memory_type_index) {
+    for (uint32_t i = 0; i < allocator -> memory_properties.memoryTypeCount; i++) {
+        if ((memory_type_bits & (1u << i)) && (allocator -> memory_properties.memoryTypes[i].propertyFlags & memory_property_flags) == memory_property_flags) {
+            *memory_type_index = i;
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+uint32_t memory_order_for_size(VkDeviceSize size) {
+    uint32_t order = 0;
+    while ((MEMORY_MIN_ALLOCATION_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+void memory_buddy_push(struct memory_block *block, int32_t unit, uint32_t order) {
+    block -> unit_order[unit] = (uint8_t)order;
+    block -> unit_state[unit] = MEMORY_UNIT_FREE;
+    block -> free_prev[unit] = -1;
+    block -> free_next[unit] = block -> free_head[order];
+    if (block -> free_head[order] != -1) {
+        block -> free_prev[block -> free_head[order]] = unit;
+    }
+    block -> free_head[order] = unit;
+}
+
+void memory_buddy_remove(struct memory_block *block, int32_t unit) {
+    uint32_t order = block -> unit_order[unit];
+    if (block -> free_prev[unit] != -1) {
+        block -> free_next[block -> free_prev[unit]] = block -> free_next[unit];
+    } else {
+        block -> free_head[order] = block -> free_next[unit];
+    }
+    if (block -> free_next[unit] != -1) {
+        block -> free_prev[block -> free_next[unit]] = block -> free_prev[unit];
+    }
+    block -> unit_state[unit] = MEMORY_UNIT_NONE;
+}
+
+int memory_block_allocate(struct memory_block *block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset, VkDeviceSize *allocated_size) {
+    if (block -> strategy == MEMORY_STRATEGY_DEDICATED) {
+        if (block -> allocation_count > 0 || size > block -> size) {
+            return EXIT_FAILURE;
+        }
+        *offset = 0;
+        *allocated_size = block -> size;
+        return EXIT_SUCCESS;
+    }
+
+    if (block -> strategy == MEMORY_STRATEGY_LINEAR) {
+        VkDeviceSize aligned_offset = (block -> linear_offset + alignment - 1) & ~(alignment - 1);
+        if (aligned_offset + size > block -> size) {
+            return EXIT_FAILURE;
+        }
+        *offset = aligned_offset;
+        *allocated_size = aligned_offset + size - block -> linear_offset;
+        block -> linear_offset = aligned_offset + size;
+        return EXIT_SUCCESS;
+    }
+
+    // Buddy nodes are naturally aligned to their own size, so rounding the request up to the
+    // alignment is enough to satisfy it.
+    uint32_t order = memory_order_for_size(size > alignment ? size : alignment);
+    if (order > block -> max_order) {
+        return EXIT_FAILURE;
+    }
+    uint32_t found_order = order;
+    while (found_order <= block -> max_order && block -> free_head[found_order] == -1) {
+        found_order++;
+    }
+    if (found_order > block -> max_order) {
+        return EXIT_FAILURE;
+    }
+
+    int32_t unit = block -> free_head[found_order];
+    memory_buddy_remove(block, unit);
+    while (found_order > order) {
+        found_order--;
+        memory_buddy_push(block, unit + (1 << found_order), found_order);
+    }
+    block -> unit_order[unit] = (uint8_t)order;
+    block -> unit_state[unit] = MEMORY_UNIT_ALLOCATED;
+
+    *offset = (VkDeviceSize)unit * MEMORY_MIN_ALLOCATION_SIZE;
+    *allocated_size = MEMORY_MIN_ALLOCATION_SIZE << order;
+    return EXIT_SUCCESS;
+}
+
+void memory_block_free(struct memory_block *block, VkDeviceSize offset) {
+    if (block -> strategy == MEMORY_STRATEGY_LINEAR) {
+        if (block -> allocation_count == 0) {
+            block -> linear_offset = 0;
+        }
+        return;
+    }
+    if (block -> strategy == MEMORY_STRATEGY_DEDICATED) {
+        return;
+    }
+
+    int32_t unit = (int32_t)(offset / MEMORY_MIN_ALLOCATION_SIZE);
+    uint32_t order = block -> unit_order[unit];
+    while (order < block -> max_order) {
+        int32_t buddy = unit ^ (1 << order);
+        if (block -> unit_state[buddy] != MEMORY_UNIT_FREE || block -> unit_order[buddy] != order) {
+            break;
+        }
+        memory_buddy_remove(block, buddy);
+        if (buddy < unit) {
+            block -> unit_state[unit] = MEMORY_UNIT_NONE;
+            unit = buddy;
+        }
+        order++;
+    }
+    memory_buddy_push(block, unit, order);
+}
+
+void memory_block_release(struct memory_allocator *allocator, struct memory_block *block) {
+    if (block -> memory == VK_NULL_HANDLE) {
+        return;
+    }
+    if (block -> mapped != NULL) {
+        vkUnmapMemory(allocator -> device, block -> memory);
+    }
+    vkFreeMemory(allocator -> device, block -> memory, NULL);
+    free(block -> free_next);
+    free(block -> free_prev);
+    free(block -> unit_order);
+    free(block -> unit_state);
+    *block = (struct memory_block) {0};
+    allocator -> device_allocation_count -= 1;
+}
+
+int memory_block_create(struct memory_allocator *allocator, uint32_t memory_type_index, VkDeviceSize size, enum memory_strategy strategy, enum memory_resource_kind resource_kind, uint32_t *block_index) {
+    int error_code = EXIT_SUCCESS;
+    VkResult vk_result;
+
+    if (allocator -> device_allocation_count >= allocator -> max_device_allocation_count) {
+        fprintf(stderr, "ERR: maxMemoryAllocationCount (%u) reached\n", allocator -> max_device_allocation_count);
+        return EXIT_FAILURE;
+    }
+
+    // reuse the slot of a released block before growing the array
+    uint32_t index;
+    for (index = 0; index < allocator -> block_len; index++) {
+        if (allocator -> block_array[index].memory == VK_NULL_HANDLE) {
+            break;
+        }
+    }
+    if (index == allocator -> block_len) {
+        if (allocator -> block_len == allocator -> block_capacity) {
+            struct memory_block *block_array = counted_realloc(allocator -> block_array, sizeof(struct memory_block) * allocator -> block_capacity * 2);
+            if (block_array == NULL) {
+                return EXIT_FAILURE;
+            }
+            allocator -> block_array = block_array;
+            allocator -> block_capacity *= 2;
+        }
+        allocator -> block_len += 1;
+    }
+
+    struct memory_block *block = &allocator -> block_array[index];
+    *block = (struct memory_block) {0};
+    block -> size = size;
+    block -> memory_type_index = memory_type_index;
+    block -> strategy = strategy;
+    block -> resource_kind = resource_kind;
+
+    handle_error(vkAllocateMemory(
+        allocator -> device,
+        &(VkMemoryAllocateInfo) {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .pNext = NULL,
+            .allocationSize = size,
+            .memoryTypeIndex = memory_type_index
+        },
+        NULL,
+        &block -> memory
+    ), exit_function);
+    allocator -> device_allocation_count += 1;
+
+    if (allocator -> memory_properties.memoryTypes[memory_type_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        handle_error(vkMapMemory(allocator -> device, block -> memory, 0, VK_WHOLE_SIZE, 0x0, &block -> mapped), release_block);
+    }
+
+    if (strategy == MEMORY_STRATEGY_BUDDY) {
+        block -> max_order = memory_order_for_size(size);
+        size_t unit_len = (size_t)(size / MEMORY_MIN_ALLOCATION_SIZE);
+        block -> free_next = counted_malloc(sizeof(int32_t) * unit_len);
+        block -> free_prev = counted_malloc(sizeof(int32_t) * unit_len);
+        block -> unit_order = counted_malloc(sizeof(uint8_t) * unit_len);
+        block -> unit_state = counted_calloc(unit_len, sizeof(uint8_t));
+        if (block -> free_next == NULL || block -> free_prev == NULL || block -> unit_order == NULL || block -> unit_state == NULL) {
+            error_code = EXIT_FAILURE;
+            goto release_block;
+        }
+        for (int i = 0; i < MEMORY_MAX_ORDER_LEN; i++) {
+            block -> free_head[i] = -1;
+        }
+        memory_buddy_push(block, 0, block -> max_order);
+    }
+
+    *block_index = index;
+    return error_code;
+release_block:
+    memory_block_release(allocator, block);
+exit_function:
+    block -> memory = VK_NULL_HANDLE;
+    return error_code;
+}
+
+// Small heaps (e.g. the 256MB BAR window) get proportionally smaller blocks.
+VkDeviceSize memory_block_size(struct memory_allocator *allocator, uint32_t memory_type_index) {
+    VkDeviceSize heap_size = allocator -> memory_properties.memoryHeaps[allocator -> memory_properties.memoryTypes[memory_type_index].heapIndex].size;
+    VkDeviceSize block_size = MEMORY_BLOCK_SIZE;
+    while (block_size > MEMORY_MIN_ALLOCATION_SIZE * 64 && block_size > heap_size / 8) {
+        block_size /= 2;
+    }
+    return block_size;
+}
+
+int allocate_memory(struct memory_allocator *allocator, const VkMemoryRequirements *memory_requirements, VkMemoryPropertyFlags memory_property_flags, enum memory_strategy strategy, enum memory_resource_kind resource_kind, struct memory_allocation *allocation) {
+    uint32_t memory_type_index;
+    if (find_memory_type(allocator, memory_requirements -> memoryTypeBits, memory_property_flags, &memory_type_index) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERR: no memory type with properties 0x%x\n", memory_property_flags);
+        return EXIT_FAILURE;
+    }
+
+    VkDeviceSize alignment = memory_requirements -> alignment > 0 ? memory_requirements -> alignment : 1;
+    VkDeviceSize block_size = memory_block_size(allocator, memory_type_index);
+    if (memory_requirements -> size > block_size / 2) {
+        strategy = MEMORY_STRATEGY_DEDICATED;
+    }
+
+    VkDeviceSize offset;
+    VkDeviceSize allocated_size;
+    uint32_t block_index;
+    for (block_index = 0; block_index < allocator -> block_len; block_index++) {
+        struct memory_block *block = &allocator -> block_array[block_index];
+        if (block -> memory == VK_NULL_HANDLE || block -> memory_type_index != memory_type_index || block -> strategy != strategy || block -> resource_kind != resource_kind) {
+            continue;
+        }
+        if (memory_block_allocate(block, memory_requirements -> size, alignment, &offset, &allocated_size) == EXIT_SUCCESS) {
+            break;
+        }
+    }
+
+    if (block_index == allocator -> block_len) {
+        VkDeviceSize new_block_size = strategy == MEMORY_STRATEGY_DEDICATED ? memory_requirements -> size : block_size;
+        // back off to smaller blocks when the heap is nearly full
+        while (memory_block_create(allocator, memory_type_index, new_block_size, strategy, resource_kind, &block_index) != EXIT_SUCCESS) {
+            if (strategy == MEMORY_STRATEGY_DEDICATED || new_block_size / 2 < memory_requirements -> size || new_block_size / 2 < MEMORY_MIN_ALLOCATION_SIZE) {
+                return EXIT_FAILURE;
+            }
+            new_block_size /= 2;
+        }
+        if (memory_block_allocate(&allocator -> block_array[block_index], memory_requirements -> size, alignment, &offset, &allocated_size) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct memory_block *block = &allocator -> block_array[block_index];
+    block -> allocation_count += 1;
+    block -> used += allocated_size;
+    allocator -> live_allocation_count += 1;
+    allocator -> live_bytes += memory_requirements -> size;
+
+    *allocation = (struct memory_allocation) {
+        .block_index = block_index,
+        .memory = block -> memory,
+        .offset = offset,
+        .size = memory_requirements -> size,
+        .allocated_size = allocated_size,
+        .mapped = block -> mapped == NULL ? NULL : (char*)block -> mapped + offset
+    };
+    return EXIT_SUCCESS;
+}
+
+void free_memory(struct memory_allocator *allocator, struct memory_allocation *allocation) {
+    if (allocation -> memory == VK_NULL_HANDLE) {
+        return;
+    }
+    struct memory_block *block = &allocator -> block_array[allocation -> block_index];
+    block -> allocation_count -= 1;
+    block -> used -= allocation -> allocated_size;
+    memory_block_free(block, allocation -> offset);
+    allocator -> live_allocation_count -= 1;
+    allocator -> live_bytes -= allocation -> size;
+
+    if (block -> strategy == MEMORY_STRATEGY_DEDICATED) {
+        memory_block_release(allocator, block);
+    }
+    *allocation = (struct memory_allocation) {0};
+}
+
+void get_memory_stats(struct memory_allocator *allocator, struct memory_stats *stats) {
+    *stats = (struct memory_stats) {0};
+    stats -> device_allocation_count = allocator -> device_allocation_count;
+    stats -> max_device_allocation_count = allocator -> max_device_allocation_count;
+    stats -> live_allocation_count = allocator -> live_allocation_count;
+    stats -> live_bytes = allocator -> live_bytes;
+
+    VkDeviceSize contiguous_free_bytes = 0;
+    for (uint32_t i = 0; i < allocator -> block_len; i++) {
+        struct memory_block *block = &allocator -> block_array[i];
+        if (block -> memory == VK_NULL_HANDLE) {
+            continue;
+        }
+        stats -> block_count += 1;
+        stats -> reserved_bytes += block -> size;
+        stats -> allocated_bytes += block -> used;
+
+        VkDeviceSize largest_free = 0;
+        if (block -> strategy == MEMORY_STRATEGY_BUDDY) {
+            for (int order = (int)block -> max_order; order >= 0; order--) {
+                if (block -> free_head[order] != -1) {
+                    largest_free = MEMORY_MIN_ALLOCATION_SIZE << order;
+                    break;
+                }
+            }
+            stats -> free_bytes += block -> size - block -> used;
+        } else if (block -> strategy == MEMORY_STRATEGY_LINEAR) {
+            largest_free = block -> size - block -> linear_offset;
+            stats -> free_bytes += largest_free;
+        }
+        if (largest_free > stats -> largest_free_bytes) {
+            stats -> largest_free_bytes = largest_free;
+        }
+        contiguous_free_bytes += largest_free;
+    }
+    // 0 when each block's free space is one contiguous range, approaching 1 as it splinters
+    stats -> fragmentation = stats -> free_bytes == 0 ? 0.0 : 1.0 - (double)contiguous_free_bytes / (double)stats -> free_bytes;
+}
+
+void print_memory_stats(struct memory_allocator *allocator) {
+    struct memory_stats stats;
+    get_memory_stats(allocator, &stats);
+    printf("Device memory: %u blocks (%u/%u vkAllocateMemory), %u live allocations\n", stats.block_count, stats.device_allocation_count, stats.max_device_allocation_count, stats.live_allocation_count);
+    printf("  reserved %llu, allocated %llu, live %llu, free %llu bytes\n",
+        (unsigned long long)stats.reserved_bytes, (unsigned long long)stats.allocated_bytes, (unsigned long long)stats.live_bytes, (unsigned long long)stats.free_bytes);
+    printf("  largest free range %llu bytes, fragmentation %.1f%%\n", (unsigned long long)stats.largest_free_bytes, stats.fragmentation * 100.0);
+}
+
+void destroy_memory_allocator(struct memory_allocator *allocator) {
+    if (allocator -> live_allocation_count > 0) {
+        fprintf(stderr, "WARN: %u device allocations still live at shutdown\n", allocator -> live_allocation_count);
+    }
+    for (uint32_t i = 0; i < allocator -> block_len; i++) {
+        memory_block_release(allocator, &allocator -> block_array[i]);
+    }
+    free(allocator -> block_array);
+    allocator -> block_array = NULL;
+    allocator -> block_len = 0;
+}
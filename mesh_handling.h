@@ -0,0 +1,771 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "arena_handling.h"
+
+// Wavefront OBJ loading. Parsed meshes are written to a binary cache next to the source
+// (cube.obj -> cube.obj.meshcache) which is memory mapped on later runs instead of re-parsing.
+
+#define MESH_CACHE_MAGIC 0x4d474655 // "UFGM"
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_EXTENSION ".meshcache"
+// post transform cache size triangle order is optimized for, conservative for current hardware
+#define MESH_VERTEX_CACHE_SIZE 16
+
+struct mesh_vertex {
+    float position[3];
+    float normal[3];
+    float uv[2];
+};
+
+struct mesh {
+    struct mesh_vertex* vertex_array;
+    uint32_t vertex_len;
+    uint32_t* index_array;
+    uint32_t index_len;
+    // set when the arrays point into a mapped cache file instead of the heap
+    void* mapping;
+    size_t mapping_size;
+};
+
+struct mesh_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t vertex_size;
+    uint32_t vertex_len;
+    uint32_t index_len;
+    uint32_t reserved;
+};
+
+// NULL on failure with errno set, an empty file cannot be mapped and fails with ENODATA.
+void* map_file(const char* path, size_t* size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        errno = ENODATA;
+        return NULL;
+    }
+    HANDLE file_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (file_mapping == NULL) {
+        return NULL;
+    }
+    // the view keeps the mapping alive after the handles are closed
+    void* data = MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(file_mapping);
+    *size = (size_t)file_size.QuadPart;
+    return data;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0) {
+        close(file);
+        return NULL;
+    }
+    if (file_stat.st_size == 0) {
+        close(file);
+        errno = ENODATA;
+        return NULL;
+    }
+    void* data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *size = (size_t)file_stat.st_size;
+    return data;
+#endif
+}
+
+void unmap_file(void* data, size_t size) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+void free_mesh(struct mesh *mesh) {
+    if (mesh -> mapping != NULL) {
+        unmap_file(mesh -> mapping, mesh -> mapping_size);
+    } else {
+        free(mesh -> vertex_array);
+        free(mesh -> index_array);
+    }
+    *mesh = (struct mesh) {0};
+}
+
+// Distance from the model origin to the furthest vertex, bounds the mesh under any rotation.
+float mesh_radius(const struct mesh *mesh) {
+    float radius_squared = 0.0f;
+    for (uint32_t i = 0; i < mesh -> vertex_len; i++) {
+        const float* position = mesh -> vertex_array[i].position;
+        float length_squared = position[0] * position[0] + position[1] * position[1] + position[2] * position[2];
+        if (length_squared > radius_squared) {
+            radius_squared = length_squared;
+        }
+    }
+    return sqrtf(radius_squared);
+}
+
+int mesh_grow(void** array, uint32_t* capacity, uint32_t needed, size_t element_size) {
+    if (needed <= *capacity) {
+        return EXIT_SUCCESS;
+    }
+    uint32_t new_capacity = *capacity < 64 ? 64 : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void* new_array = counted_realloc(*array, element_size * new_capacity);
+    if (new_array == NULL) {
+        return EXIT_FAILURE;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return EXIT_SUCCESS;
+}
+
+float mesh_parse_float(const char** cursor, const char* end) {
+    static const double power_of_ten[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char* c = *cursor;
+    while (c < end && (*c == ' ' || *c == '\t')) {
+        c++;
+    }
+    int negative = 0;
+    if (c < end && (*c == '-' || *c == '+')) {
+        negative = *c == '-';
+        c++;
+    }
+    uint64_t mantissa = 0;
+    int digit_len = 0;
+    int exponent = 0;
+    while (c < end && *c >= '0' && *c <= '9') {
+        if (digit_len < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+            digit_len += mantissa != 0;
+        } else {
+            exponent++;
+        }
+        c++;
+    }
+    if (c < end && *c == '.') {
+        c++;
+        while (c < end && *c >= '0' && *c <= '9') {
+            if (digit_len < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*c - '0');
+                digit_len += mantissa != 0;
+                exponent--;
+            }
+            c++;
+        }
+    }
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        c++;
+        int negative_exponent = 0;
+        if (c < end && (*c == '-' || *c == '+')) {
+            negative_exponent = *c == '-';
+            c++;
+        }
+        int written_exponent = 0;
+        while (c < end && *c >= '0' && *c <= '9') {
+            if (written_exponent < 10000) {
+                written_exponent = written_exponent * 10 + (*c - '0');
+            }
+            c++;
+        }
+        exponent += negative_exponent ? -written_exponent : written_exponent;
+    }
+    *cursor = c;
+
+    double value = (double)mantissa;
+    if (exponent < 0) {
+        value = exponent >= -22 ? value / power_of_ten[-exponent] : value * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        value = exponent <= 22 ? value * power_of_ten[exponent] : value * pow(10.0, exponent);
+    }
+    return (float)(negative ? -value : value);
+}
+
+// Resolves a 1-based (or negative, relative) OBJ index into a 1-based index, 0 when absent or invalid.
+uint32_t mesh_parse_index(const char** cursor, const char* end, uint32_t element_len) {
+    const char* c = *cursor;
+    int negative = 0;
+    if (c < end && *c == '-') {
+        negative = 1;
+        c++;
+    }
+    int64_t value = 0;
+    while (c < end && *c >= '0' && *c <= '9') {
+        value = value * 10 + (*c - '0');
+        c++;
+    }
+    *cursor = c;
+    if (negative) {
+        value = (int64_t)element_len - value + 1;
+    }
+    if (value < 1 || value > element_len) {
+        return 0;
+    }
+    return (uint32_t)value;
+}
+
+uint32_t mesh_hash_key(const uint32_t key[3]) {
+    uint32_t hash = key[0] * 0x9e3779b1u;
+    hash ^= key[1] * 0x85ebca77u + (hash << 6) + (hash >> 2);
+    hash ^= key[2] * 0xc2b2ae3du + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Parses v/vn/vt/f from an in-memory OBJ. Faces are fan triangulated and every distinct
+// position/uv/normal triple becomes one vertex, found through an open addressing hash map.
+int parse_obj(const char* data, size_t size, struct mesh *mesh) {
+    int error_code = EXIT_SUCCESS;
+    *mesh = (struct mesh) {0};
+
+    float* position_array = NULL;
+    float* normal_array = NULL;
+    float* uv_array = NULL;
+    uint32_t position_len = 0, position_capacity = 0;
+    uint32_t normal_len = 0, normal_capacity = 0;
+    uint32_t uv_len = 0, uv_capacity = 0;
+    uint32_t vertex_capacity = 0;
+    uint32_t index_capacity = 0;
+
+    // key triple (1-based, 0 = absent) plus the vertex index, capacity is a power of two
+    uint32_t hash_capacity = 1024;
+    uint32_t* hash_key_array = counted_calloc(hash_capacity * 3, sizeof(uint32_t));
+    uint32_t* hash_value_array = counted_malloc(sizeof(uint32_t) * hash_capacity);
+    if (hash_key_array == NULL || hash_value_array == NULL) {
+        error_code = EXIT_FAILURE;
+        goto free_arrays;
+    }
+
+    const char* cursor = data;
+    const char* end = data + size;
+    uint32_t line = 1;
+    while (cursor < end) {
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+            cursor++;
+        }
+        if (cursor + 1 < end && cursor[0] == 'v' && (cursor[1] == ' ' || cursor[1] == '\t')) {
+            cursor += 1;
+            if (mesh_grow((void**)&position_array, &position_capacity, (position_len + 1) * 3, sizeof(float)) != EXIT_SUCCESS) {
+                error_code = EXIT_FAILURE;
+                goto free_arrays;
+            }
+            for (int i = 0; i < 3; i++) {
+                position_array[position_len * 3 + i] = mesh_parse_float(&cursor, end);
+            }
+            position_len++;
+        } else if (cursor + 2 < end && cursor[0] == 'v' && cursor[1] == 'n' && (cursor[2] == ' ' || cursor[2] == '\t')) {
+            cursor += 2;
+            if (mesh_grow((void**)&normal_array, &normal_capacity, (normal_len + 1) * 3, sizeof(float)) != EXIT_SUCCESS) {
+                error_code = EXIT_FAILURE;
+                goto free_arrays;
+            }
+            for (int i = 0; i < 3; i++) {
+                normal_array[normal_len * 3 + i] = mesh_parse_float(&cursor, end);
+            }
+            normal_len++;
+        } else if (cursor + 2 < end && cursor[0] == 'v' && cursor[1] == 't' && (cursor[2] == ' ' || cursor[2] == '\t')) {
+            cursor += 2;
+            if (mesh_grow((void**)&uv_array, &uv_capacity, (uv_len + 1) * 2, sizeof(float)) != EXIT_SUCCESS) {
+                error_code = EXIT_FAILURE;
+                goto free_arrays;
+            }
+            for (int i = 0; i < 2; i++) {
+                uv_array[uv_len * 2 + i] = mesh_parse_float(&cursor, end);
+            }
+            uv_len++;
+        } else if (cursor + 1 < end && cursor[0] == 'f' && (cursor[1] == ' ' || cursor[1] == '\t')) {
+            cursor += 1;
+            uint32_t first_index = 0;
+            uint32_t previous_index = 0;
+            uint32_t face_vertex_len = 0;
+            for (;;) {
+                while (cursor < end && (*cursor == ' ' || *cursor == '\t')) {
+                    cursor++;
+                }
+                if (cursor >= end || *cursor == '\n' || *cursor == '\r' || *cursor == '#') {
+                    break;
+                }
+                uint32_t key[3] = {0, 0, 0};
+                key[0] = mesh_parse_index(&cursor, end, position_len);
+                if (cursor < end && *cursor == '/') {
+                    cursor++;
+                    if (cursor < end && *cursor != '/') {
+                        key[1] = mesh_parse_index(&cursor, end, uv_len);
+                    }
+                    if (cursor < end && *cursor == '/') {
+                        cursor++;
+                        key[2] = mesh_parse_index(&cursor, end, normal_len);
+                    }
+                }
+                if (key[0] == 0) {
+                    fprintf(stderr, "ERR: bad face index on OBJ line %u\n", line);
+                    error_code = EXIT_FAILURE;
+                    goto free_arrays;
+                }
+
+                // keep the load factor under one half
+                if (mesh -> vertex_len * 2 >= hash_capacity) {
+                    uint32_t new_capacity = hash_capacity * 2;
+                    uint32_t* new_key_array = counted_calloc(new_capacity * 3, sizeof(uint32_t));
+                    uint32_t* new_value_array = counted_malloc(sizeof(uint32_t) * new_capacity);
+                    if (new_key_array == NULL || new_value_array == NULL) {
+                        free(new_key_array);
+                        free(new_value_array);
+                        error_code = EXIT_FAILURE;
+                        goto free_arrays;
+                    }
+                    for (uint32_t i = 0; i < hash_capacity; i++) {
+                        if (hash_key_array[i * 3] == 0) {
+                            continue;
+                        }
+                        uint32_t slot = mesh_hash_key(&hash_key_array[i * 3]) & (new_capacity - 1);
+                        while (new_key_array[slot * 3] != 0) {
+                            slot = (slot + 1) & (new_capacity - 1);
+                        }
+                        memcpy(&new_key_array[slot * 3], &hash_key_array[i * 3], sizeof(uint32_t) * 3);
+                        new_value_array[slot] = hash_value_array[i];
+                    }
+                    free(hash_key_array);
+                    free(hash_value_array);
+                    hash_key_array = new_key_array;
+                    hash_value_array = new_value_array;
+                    hash_capacity = new_capacity;
+                }
+
+                uint32_t slot = mesh_hash_key(key) & (hash_capacity - 1);
+                while (hash_key_array[slot * 3] != 0 && memcmp(&hash_key_array[slot * 3], key, sizeof(key)) != 0) {
+                    slot = (slot + 1) & (hash_capacity - 1);
+                }
+                uint32_t vertex_index;
+                if (hash_key_array[slot * 3] != 0) {
+                    vertex_index = hash_value_array[slot];
+                } else {
+                    if (mesh_grow((void**)&mesh -> vertex_array, &vertex_capacity, mesh -> vertex_len + 1, sizeof(struct mesh_vertex)) != EXIT_SUCCESS) {
+                        error_code = EXIT_FAILURE;
+                        goto free_arrays;
+                    }
+                    struct mesh_vertex *vertex = &mesh -> vertex_array[mesh -> vertex_len];
+                    memcpy(vertex -> position, &position_array[(key[0] - 1) * 3], sizeof(float) * 3);
+                    if (key[2] != 0) {
+                        memcpy(vertex -> normal, &normal_array[(key[2] - 1) * 3], sizeof(float) * 3);
+                    } else {
+                        memset(vertex -> normal, 0, sizeof(float) * 3);
+                    }
+                    if (key[1] != 0) {
+                        memcpy(vertex -> uv, &uv_array[(key[1] - 1) * 2], sizeof(float) * 2);
+                    } else {
+                        memset(vertex -> uv, 0, sizeof(float) * 2);
+                    }
+                    memcpy(&hash_key_array[slot * 3], key, sizeof(key));
+                    hash_value_array[slot] = mesh -> vertex_len;
+                    vertex_index = mesh -> vertex_len;
+                    mesh -> vertex_len++;
+                }
+
+                if (face_vertex_len == 0) {
+                    first_index = vertex_index;
+                } else if (face_vertex_len >= 2) {
+                    if (mesh_grow((void**)&mesh -> index_array, &index_capacity, mesh -> index_len + 3, sizeof(uint32_t)) != EXIT_SUCCESS) {
+                        error_code = EXIT_FAILURE;
+                        goto free_arrays;
+                    }
+                    mesh -> index_array[mesh -> index_len++] = first_index;
+                    mesh -> index_array[mesh -> index_len++] = previous_index;
+                    mesh -> index_array[mesh -> index_len++] = vertex_index;
+                }
+                previous_index = vertex_index;
+                face_vertex_len++;
+            }
+        }
+        // everything else (comments, o, g, s, usemtl, mtllib) is skipped along with the rest of the line
+        while (cursor < end && *cursor != '\n') {
+            cursor++;
+        }
+        cursor++;
+        line++;
+    }
+
+    // smooth normals for files that do not carry any
+    if (normal_len == 0) {
+        for (uint32_t i = 0; i + 2 < mesh -> index_len; i += 3) {
+            float* a = mesh -> vertex_array[mesh -> index_array[i]].position;
+            float* b = mesh -> vertex_array[mesh -> index_array[i + 1]].position;
+            float* c = mesh -> vertex_array[mesh -> index_array[i + 2]].position;
+            float ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+            float ac[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+            float face_normal[3] = {
+                ab[1] * ac[2] - ab[2] * ac[1],
+                ab[2] * ac[0] - ab[0] * ac[2],
+                ab[0] * ac[1] - ab[1] * ac[0]
+            };
+            for (int j = 0; j < 3; j++) {
+                float* normal = mesh -> vertex_array[mesh -> index_array[i + j]].normal;
+                normal[0] += face_normal[0];
+                normal[1] += face_normal[1];
+                normal[2] += face_normal[2];
+            }
+        }
+        for (uint32_t i = 0; i < mesh -> vertex_len; i++) {
+            float* normal = mesh -> vertex_array[i].normal;
+            float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            if (length > 0.0f) {
+                normal[0] /= length;
+                normal[1] /= length;
+                normal[2] /= length;
+            }
+        }
+    }
+
+free_arrays:
+    free(position_array);
+    free(normal_array);
+    free(uv_array);
+    free(hash_key_array);
+    free(hash_value_array);
+    if (error_code != EXIT_SUCCESS) {
+        free_mesh(mesh);
+    }
+    return error_code;
+}
+
+// Average cache miss ratio (vertex shader invocations per triangle) for a FIFO cache.
+float mesh_acmr(const uint32_t* index_array, uint32_t index_len, uint32_t vertex_len, uint32_t cache_size) {
+    if (index_len < 3) {
+        return 0.0f;
+    }
+    uint32_t* cache_time_array = counted_calloc(vertex_len, sizeof(uint32_t));
+    if (cache_time_array == NULL) {
+        return 0.0f;
+    }
+    uint32_t time = cache_size + 1;
+    uint32_t miss_len = 0;
+    for (uint32_t i = 0; i < index_len; i++) {
+        uint32_t vertex = index_array[i];
+        if (time - cache_time_array[vertex] > cache_size) {
+            cache_time_array[vertex] = time++;
+            miss_len++;
+        }
+    }
+    free(cache_time_array);
+    return (float)miss_len / (float)(index_len / 3);
+}
+
+// Reorders triangles for the post transform vertex cache with Tipsify (Sander, Nehab and Barczak,
+// "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"), then renumbers vertices
+// in first use order so vertex fetch walks memory linearly.
+int optimize_vertex_cache(struct mesh *mesh, uint32_t cache_size) {
+    int error_code = EXIT_SUCCESS;
+    uint32_t triangle_len = mesh -> index_len / 3;
+    uint32_t vertex_len = mesh -> vertex_len;
+    if (triangle_len == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    uint32_t* live_array = counted_calloc(vertex_len, sizeof(uint32_t));
+    uint32_t* adjacency_offset_array = counted_calloc(vertex_len + 1, sizeof(uint32_t));
+    uint32_t* adjacency_array = counted_malloc(sizeof(uint32_t) * triangle_len * 3);
+    uint32_t* cache_time_array = counted_calloc(vertex_len, sizeof(uint32_t));
+    uint32_t* dead_end_array = counted_malloc(sizeof(uint32_t) * triangle_len * 3);
+    uint32_t* candidate_array = counted_malloc(sizeof(uint32_t) * triangle_len * 3);
+    unsigned char* emitted_array = counted_calloc(triangle_len, sizeof(unsigned char));
+    uint32_t* output_array = counted_malloc(sizeof(uint32_t) * triangle_len * 3);
+    uint32_t* remap_array = counted_malloc(sizeof(uint32_t) * vertex_len);
+    struct mesh_vertex* vertex_array = counted_malloc(sizeof(struct mesh_vertex) * vertex_len);
+    if (live_array == NULL || adjacency_offset_array == NULL || adjacency_array == NULL || cache_time_array == NULL
+        || dead_end_array == NULL || candidate_array == NULL || emitted_array == NULL || output_array == NULL
+        || remap_array == NULL || vertex_array == NULL) {
+        error_code = EXIT_FAILURE;
+        goto free_arrays;
+    }
+
+    // vertex -> triangle adjacency as offsets into one flat array
+    for (uint32_t i = 0; i < triangle_len * 3; i++) {
+        live_array[mesh -> index_array[i]]++;
+    }
+    for (uint32_t i = 0; i < vertex_len; i++) {
+        adjacency_offset_array[i + 1] = adjacency_offset_array[i] + live_array[i];
+    }
+    memcpy(remap_array, adjacency_offset_array, sizeof(uint32_t) * vertex_len);
+    for (uint32_t i = 0; i < triangle_len * 3; i++) {
+        adjacency_array[remap_array[mesh -> index_array[i]]++] = i / 3;
+    }
+
+    uint32_t time = cache_size + 1;
+    uint32_t dead_end_len = 0;
+    uint32_t output_len = 0;
+    uint32_t cursor = 0;
+    int64_t fan_vertex = 0;
+    while (fan_vertex >= 0) {
+        uint32_t candidate_len = 0;
+        for (uint32_t i = adjacency_offset_array[fan_vertex]; i < adjacency_offset_array[fan_vertex + 1]; i++) {
+            uint32_t triangle = adjacency_array[i];
+            if (emitted_array[triangle]) {
+                continue;
+            }
+            for (uint32_t j = 0; j < 3; j++) {
+                uint32_t vertex = mesh -> index_array[triangle * 3 + j];
+                output_array[output_len++] = vertex;
+                dead_end_array[dead_end_len++] = vertex;
+                candidate_array[candidate_len++] = vertex;
+                live_array[vertex]--;
+                if (time - cache_time_array[vertex] > cache_size) {
+                    cache_time_array[vertex] = time++;
+                }
+            }
+            emitted_array[triangle] = 1;
+        }
+
+        // prefer the candidate that will still be in the cache after its remaining triangles are emitted
+        fan_vertex = -1;
+        int64_t best_priority = -1;
+        for (uint32_t i = 0; i < candidate_len; i++) {
+            uint32_t vertex = candidate_array[i];
+            if (live_array[vertex] == 0) {
+                continue;
+            }
+            int64_t priority = 0;
+            if ((int64_t)time - cache_time_array[vertex] + 2 * (int64_t)live_array[vertex] <= cache_size) {
+                priority = (int64_t)time - cache_time_array[vertex];
+            }
+            if (priority > best_priority) {
+                best_priority = priority;
+                fan_vertex = vertex;
+            }
+        }
+        if (fan_vertex < 0) {
+            while (dead_end_len > 0) {
+                uint32_t vertex = dead_end_array[--dead_end_len];
+                if (live_array[vertex] > 0) {
+                    fan_vertex = vertex;
+                    break;
+                }
+            }
+        }
+        while (fan_vertex < 0 && cursor < vertex_len) {
+            if (live_array[cursor] > 0) {
+                fan_vertex = cursor;
+            }
+            cursor++;
+        }
+    }
+
+    // renumber vertices by first use, unreferenced vertices are dropped
+    memset(remap_array, 0xff, sizeof(uint32_t) * vertex_len);
+    uint32_t new_vertex_len = 0;
+    for (uint32_t i = 0; i < output_len; i++) {
+        uint32_t vertex = output_array[i];
+        if (remap_array[vertex] == UINT32_MAX) {
+            remap_array[vertex] = new_vertex_len;
+            vertex_array[new_vertex_len++] = mesh -> vertex_array[vertex];
+        }
+        mesh -> index_array[i] = remap_array[vertex];
+    }
+    memcpy(mesh -> vertex_array, vertex_array, sizeof(struct mesh_vertex) * new_vertex_len);
+    mesh -> vertex_len = new_vertex_len;
+    mesh -> index_len = output_len;
+
+free_arrays:
+    free(live_array);
+    free(adjacency_offset_array);
+    free(adjacency_array);
+    free(cache_time_array);
+    free(dead_end_array);
+    free(candidate_array);
+    free(emitted_array);
+    free(output_array);
+    free(remap_array);
+    free(vertex_array);
+    return error_code;
+}
+
+// Writes to a temporary file renamed over the cache once complete, so an interrupted write never
+// leaves a truncated cache behind.
+int write_mesh_cache(const char* cache_path, const struct stat *source_stat, const struct mesh *mesh) {
+    char temp_path[1040];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", cache_path) >= (int)sizeof(temp_path)) {
+        return EXIT_FAILURE;
+    }
+    FILE *f_cache = fopen(temp_path, "wb");
+    if (f_cache == NULL) {
+        return EXIT_FAILURE;
+    }
+    struct mesh_cache_header header = (struct mesh_cache_header) {
+        .magic = MESH_CACHE_MAGIC,
+        .version = MESH_CACHE_VERSION,
+        .source_size = (uint64_t)source_stat -> st_size,
+        .source_mtime = (int64_t)source_stat -> st_mtime,
+        .vertex_size = sizeof(struct mesh_vertex),
+        .vertex_len = mesh -> vertex_len,
+        .index_len = mesh -> index_len,
+        .reserved = 0
+    };
+    int written = fwrite(&header, sizeof(header), 1, f_cache) == 1
+        && fwrite(mesh -> vertex_array, sizeof(struct mesh_vertex), mesh -> vertex_len, f_cache) == mesh -> vertex_len
+        && fwrite(mesh -> index_array, sizeof(uint32_t), mesh -> index_len, f_cache) == mesh -> index_len;
+    written = fclose(f_cache) == 0 && written;
+    if (!written) {
+        remove(temp_path);
+        return EXIT_FAILURE;
+    }
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows
+    remove(cache_path);
+#endif
+    if (rename(temp_path, cache_path) != 0) {
+        remove(temp_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Maps the cache and points the mesh straight at it. Fails (and the caller re-parses) when the
+// cache is missing, from another version, older than its source, or has an index past its
+// vertices, which the parser never writes and the GPU must never be given.
+int map_mesh_cache(const char* cache_path, const struct stat *source_stat, struct mesh *mesh) {
+    size_t size;
+    void* data = map_file(cache_path, &size);
+    if (data == NULL) {
+        return EXIT_FAILURE;
+    }
+    const struct mesh_cache_header *header = data;
+    if (size < sizeof(struct mesh_cache_header)
+        || header -> magic != MESH_CACHE_MAGIC
+        || header -> version != MESH_CACHE_VERSION
+        || header -> vertex_size != sizeof(struct mesh_vertex)
+        || header -> source_size != (uint64_t)source_stat -> st_size
+        || header -> source_mtime != (int64_t)source_stat -> st_mtime
+        || size != sizeof(struct mesh_cache_header) + (size_t)header -> vertex_len * sizeof(struct mesh_vertex) + (size_t)header -> index_len * sizeof(uint32_t)) {
+        unmap_file(data, size);
+        return EXIT_FAILURE;
+    }
+    *mesh = (struct mesh) {
+        .vertex_array = (struct mesh_vertex*)((char*)data + sizeof(struct mesh_cache_header)),
+        .vertex_len = header -> vertex_len,
+        .index_array = (uint32_t*)((char*)data + sizeof(struct mesh_cache_header) + (size_t)header -> vertex_len * sizeof(struct mesh_vertex)),
+        .index_len = header -> index_len,
+        .mapping = data,
+        .mapping_size = size
+    };
+    for (uint32_t i = 0; i < mesh -> index_len; i++) {
+        if (mesh -> index_array[i] >= mesh -> vertex_len) {
+            fprintf(stderr, "WARN: mesh cache %s has index %u past its %u vertices, re-parsing\n", cache_path, mesh -> index_array[i], mesh -> vertex_len);
+            unmap_file(data, size);
+            *mesh = (struct mesh) {0};
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int load_mesh(const char* path, struct mesh *mesh) {
+    struct stat source_stat;
+    if (stat(path, &source_stat) != 0) {
+        perror("failed to stat model");
+        return EXIT_FAILURE;
+    }
+
+    char cache_path[1024];
+    if (snprintf(cache_path, sizeof(cache_path), "%s%s", path, MESH_CACHE_EXTENSION) >= (int)sizeof(cache_path)) {
+        fprintf(stderr, "ERR: model path too long: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    if (map_mesh_cache(cache_path, &source_stat, mesh) == EXIT_SUCCESS) {
+        printf("Loaded %s from cache (%u vertices, %u indices)\n", path, mesh -> vertex_len, mesh -> index_len);
+        return EXIT_SUCCESS;
+    }
+
+    size_t size;
+    char* data = map_file(path, &size);
+    if (data == NULL) {
+        perror("failed to open model");
+        return EXIT_FAILURE;
+    }
+    int error_code = parse_obj(data, size, mesh);
+    unmap_file(data, size);
+    if (error_code != EXIT_SUCCESS) {
+        fprintf(stderr, "ERR: failed to parse %s\n", path);
+        return error_code;
+    }
+    float acmr = mesh_acmr(mesh -> index_array, mesh -> index_len, mesh -> vertex_len, MESH_VERTEX_CACHE_SIZE);
+    if (optimize_vertex_cache(mesh, MESH_VERTEX_CACHE_SIZE) != EXIT_SUCCESS) {
+        fprintf(stderr, "WARN: vertex cache optimization failed for %s\n", path);
+    }
+    printf("Parsed %s (%u vertices, %u indices, ACMR %.3f -> %.3f)\n", path, mesh -> vertex_len, mesh -> index_len,
+        acmr, mesh_acmr(mesh -> index_array, mesh -> index_len, mesh -> vertex_len, MESH_VERTEX_CACHE_SIZE));
+
+    if (write_mesh_cache(cache_path, &source_stat, mesh) != EXIT_SUCCESS) {
+        fprintf(stderr, "WARN: could not write mesh cache %s\n", cache_path);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Parses the OBJ (already in memory, so disk speed does not count) repeatedly and reports
+// throughput, then times a cache load for comparison.
+int benchmark_obj_parse(const char* path, int iteration_len) {
+    size_t size;
+    char* data = map_file(path, &size);
+    if (data == NULL) {
+        perror("failed to open model");
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start_time, end_time;
+    struct mesh mesh;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < iteration_len; i++) {
+        if (parse_obj(data, size, &mesh) != EXIT_SUCCESS) {
+            unmap_file(data, size);
+            return EXIT_FAILURE;
+        }
+        if (i + 1 < iteration_len) {
+            free_mesh(&mesh);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+    printf("Parsed %s %d times: %.3f ms per parse, %.1f MB/s (%u vertices, %u indices)\n",
+        path, iteration_len, seconds * 1000.0 / iteration_len, (double)size * iteration_len / seconds / 1000000.0, mesh.vertex_len, mesh.index_len);
+    free_mesh(&mesh);
+    unmap_file(data, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (load_mesh(path, &mesh) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+    printf("load_mesh took %.3f ms\n", seconds * 1000.0);
+    free_mesh(&mesh);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+
+// Frame pacing and its measurement. An optional frame rate cap sleeps for most of the wait and
+// spins for the rest, because sleeps overshoot by up to a scheduler quantum. Frame times and
+// input to present latencies go into fixed bucket histograms, so recording a frame never touches
+// the heap and percentiles stay cheap enough to show every half second.
+
+#define PACING_SPIN_NS 1500000 // sleeps wake up this early and spin the remainder
+#define FRAME_HISTOGRAM_BUCKET_NS 250000 // 1/4 of a ms
+#define FRAME_HISTOGRAM_BUCKET_LEN 256 // up to 64 ms, the last bucket holds everything slower
+#define PRESENT_HISTORY_LEN 16 // input sample times kept per present id, more than can be queued
+
+struct frame_histogram {
+    uint32_t bucket_array[FRAME_HISTOGRAM_BUCKET_LEN];
+    uint64_t sample_len;
+    long long total_ns;
+    long long max_ns;
+};
+
+struct frame_pacer {
+    long long interval_ns; // 0 when uncapped
+    long long next_frame_ns;
+};
+
+long long pacing_now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (long long)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void clear_frame_histogram(struct frame_histogram *histogram) {
+    *histogram = (struct frame_histogram) {0};
+}
+
+void record_frame_histogram(struct frame_histogram *histogram, long long sample_ns) {
+    if (sample_ns < 0) {
+        sample_ns = 0;
+    }
+    long long bucket = sample_ns / FRAME_HISTOGRAM_BUCKET_NS;
+    histogram -> bucket_array[bucket < FRAME_HISTOGRAM_BUCKET_LEN ? bucket : FRAME_HISTOGRAM_BUCKET_LEN - 1]++;
+    histogram -> sample_len++;
+    histogram -> total_ns += sample_ns;
+    if (sample_ns > histogram -> max_ns) {
+        histogram -> max_ns = sample_ns;
+    }
+}
+
+// Upper edge of the bucket holding the given fraction of samples, so it never understates.
+long long frame_histogram_percentile(const struct frame_histogram *histogram, double fraction) {
+    if (histogram -> sample_len == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)((double)histogram -> sample_len * fraction);
+    if (target >= histogram -> sample_len) {
+        target = histogram -> sample_len - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < FRAME_HISTOGRAM_BUCKET_LEN - 1; i++) {
+        seen += histogram -> bucket_array[i];
+        if (seen > target) {
+            long long upper = (long long)(i + 1) * FRAME_HISTOGRAM_BUCKET_NS;
+            return upper < histogram -> max_ns ? upper : histogram -> max_ns;
+        }
+    }
+    return histogram -> max_ns;
+}
+
+// One summary line, then a bar per occupied millisecond.
+void print_frame_histogram(const char *name, const struct frame_histogram *histogram) {
+    if (histogram -> sample_len == 0) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    printf("%s over %llu samples: %.3f ms average, %.3f ms p50, %.3f ms p90, %.3f ms p99, %.3f ms max\n",
+        name, (unsigned long long)histogram -> sample_len,
+        (double)histogram -> total_ns / (double)histogram -> sample_len / 1000000.0,
+        (double)frame_histogram_percentile(histogram, 0.5) / 1000000.0,
+        (double)frame_histogram_percentile(histogram, 0.9) / 1000000.0,
+        (double)frame_histogram_percentile(histogram, 0.99) / 1000000.0,
+        (double)histogram -> max_ns / 1000000.0);
+    const int buckets_per_ms = 1000000 / FRAME_HISTOGRAM_BUCKET_NS;
+    for (int ms = 0; ms < FRAME_HISTOGRAM_BUCKET_LEN / buckets_per_ms; ms++) {
+        uint64_t count = 0;
+        for (int i = 0; i < buckets_per_ms; i++) {
+            count += histogram -> bucket_array[ms * buckets_per_ms + i];
+        }
+        if (count == 0) {
+            continue;
+        }
+        int bar_len = (int)((count * 50 + histogram -> sample_len - 1) / histogram -> sample_len);
+        printf("  %s%2d ms %8llu %.*s\n", ms == FRAME_HISTOGRAM_BUCKET_LEN / buckets_per_ms - 1 ? ">=" : "  ", ms, (unsigned long long)count, bar_len,
+            "##################################################");
+    }
+}
+
+// fps_cap of 0 leaves the frame rate to the present mode.
+void create_frame_pacer(struct frame_pacer *pacer, uint32_t fps_cap) {
+    pacer -> interval_ns = fps_cap == 0 ? 0 : 1000000000 / (long long)fps_cap;
+    pacer -> next_frame_ns = pacing_now_ns();
+}
+
+// Blocks until the next frame is due. A frame that ran late starts the schedule over instead of
+// letting the following frames rush to catch up.
+void pace_frame(struct frame_pacer *pacer) {
+    if (pacer -> interval_ns == 0) {
+        return;
+    }
+    long long now = pacing_now_ns();
+    long long remaining = pacer -> next_frame_ns - now;
+    if (remaining > PACING_SPIN_NS) {
+        long long sleep_ns = remaining - PACING_SPIN_NS;
+        thrd_sleep(&(struct timespec) {.tv_sec = sleep_ns / 1000000000, .tv_nsec = sleep_ns % 1000000000}, NULL);
+    }
+    while (now < pacer -> next_frame_ns) {
+        now = pacing_now_ns();
+    }
+    pacer -> next_frame_ns += pacer -> interval_ns;
+    if (pacer -> next_frame_ns < now) {
+        pacer -> next_frame_ns = now + pacer -> interval_ns;
+    }
+}
@@ -0,0 +1,202 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "arena_handling.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+// CPU zone profiler. A zone takes a timestamp when it begins and writes one event into its
+// thread's ring buffer when it ends. Each ring has a single writer, so recording never locks, and
+// only the exporter reads other threads' rings. Rings wrap, so the trace keeps the most recent
+// PROFILE_RING_LEN zones of every thread. Threads must call profile_register_thread once before
+// their zones are recorded, zones on other threads are dropped.
+//
+// Build with FACTORY_PROFILE defined to compile the zones in, without it every macro is empty.
+
+#define PROFILE_RING_LEN (1u << 16) // events per thread, a power of two
+#define PROFILE_MAX_THREADS 32
+#define PROFILE_THREAD_NAME_LEN 32
+
+struct profile_event {
+    const char *name; // a string literal, only the pointer is stored
+    uint64_t start;
+    uint64_t end;
+};
+
+struct profile_thread {
+    char name[PROFILE_THREAD_NAME_LEN];
+    struct profile_event* event_array;
+    _Atomic uint64_t event_len; // written since registration, the ring holds the last PROFILE_RING_LEN
+};
+
+struct profile_zone {
+    const char *name;
+    uint64_t start;
+};
+
+struct profile_thread profile_thread_array[PROFILE_MAX_THREADS];
+_Atomic uint32_t profile_thread_len = 0;
+_Thread_local struct profile_thread *profile_current_thread = NULL;
+// pairs of (ticks, ns) taken at init and export convert ticks to time
+uint64_t profile_start_tick = 0;
+long long profile_start_ns = 0;
+
+long long profile_clock_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (long long)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// The time stamp counter where there is one, it is invariant on every x86 CPU from the last decade.
+static inline uint64_t profile_now(void) {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return (uint64_t)profile_clock_ns();
+#endif
+}
+
+void profile_init(void) {
+    profile_start_ns = profile_clock_ns();
+    profile_start_tick = profile_now();
+}
+
+// Returns EXIT_FAILURE when every thread slot is taken or the ring cannot be allocated. The ring
+// is allocated before a slot is claimed, so a failed call leaves no slot behind and can be retried.
+int profile_register_thread(const char *name) {
+    if (profile_current_thread != NULL) {
+        return EXIT_SUCCESS;
+    }
+    struct profile_event *event_array = counted_malloc(sizeof(struct profile_event) * PROFILE_RING_LEN);
+    if (event_array == NULL) {
+        perror("failed to allocate profile ring");
+        return EXIT_FAILURE;
+    }
+    uint32_t index = atomic_fetch_add(&profile_thread_len, 1);
+    if (index >= PROFILE_MAX_THREADS) {
+        atomic_fetch_sub(&profile_thread_len, 1);
+        free(event_array);
+        fprintf(stderr, "ERR: more than %d profiled threads\n", PROFILE_MAX_THREADS);
+        return EXIT_FAILURE;
+    }
+    struct profile_thread *thread = &profile_thread_array[index];
+    snprintf(thread -> name, sizeof(thread -> name), "%s", name);
+    atomic_store(&thread -> event_len, 0);
+    thread -> event_array = event_array;
+    profile_current_thread = thread;
+    return EXIT_SUCCESS;
+}
+
+static inline struct profile_zone profile_zone_begin(const char *name) {
+    return (struct profile_zone) {.name = name, .start = profile_now()};
+}
+
+static inline void profile_zone_end(const struct profile_zone *zone) {
+    uint64_t end = profile_now();
+    struct profile_thread *thread = profile_current_thread;
+    if (thread == NULL || thread -> event_array == NULL) {
+        return;
+    }
+    uint64_t event_len = atomic_load_explicit(&thread -> event_len, memory_order_relaxed);
+    thread -> event_array[event_len & (PROFILE_RING_LEN - 1)] = (struct profile_event) {
+        .name = zone -> name,
+        .start = zone -> start,
+        .end = end
+    };
+    // the exporter only reads events below event_len
+    atomic_store_explicit(&thread -> event_len, event_len + 1, memory_order_release);
+}
+
+double profile_ns_per_tick(void) {
+    uint64_t tick = profile_now();
+    long long ns = profile_clock_ns();
+    if (tick <= profile_start_tick || ns <= profile_start_ns) {
+        return 1.0;
+    }
+    return (double)(ns - profile_start_ns) / (double)(tick - profile_start_tick);
+}
+
+// Complete events in the Trace Event Format, for chrome://tracing and Perfetto. Meant for exit,
+// a thread still recording can overwrite the oldest events of its ring while they are written.
+int profile_write_trace(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("failed to open cpu trace");
+        return EXIT_FAILURE;
+    }
+    double ns_per_tick = profile_ns_per_tick();
+    uint32_t thread_len = atomic_load(&profile_thread_len);
+    thread_len = thread_len < PROFILE_MAX_THREADS ? thread_len : PROFILE_MAX_THREADS;
+    unsigned long long written_len = 0;
+    fprintf(file, "%s", "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "%s", "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"FactoryGame\"}}");
+    for (uint32_t t = 0; t < thread_len; t++) {
+        struct profile_thread *thread = &profile_thread_array[t];
+        if (thread -> event_array == NULL) {
+            continue;
+        }
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", t, thread -> name);
+        uint64_t event_len = atomic_load_explicit(&thread -> event_len, memory_order_acquire);
+        uint64_t first = event_len > PROFILE_RING_LEN ? event_len - PROFILE_RING_LEN : 0;
+        for (uint64_t i = first; i < event_len; i++) {
+            const struct profile_event *event = &thread -> event_array[i & (PROFILE_RING_LEN - 1)];
+            double start_us = (double)(int64_t)(event -> start - profile_start_tick) * ns_per_tick / 1000.0;
+            double duration_us = (double)(event -> end - event -> start) * ns_per_tick / 1000.0;
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", event -> name, t, start_us, duration_us);
+            written_len++;
+        }
+    }
+    fprintf(file, "%s", "\n]}\n");
+    fclose(file);
+    printf("CPU trace of %llu zones written to %s\n", written_len, path);
+    return EXIT_SUCCESS;
+}
+
+#ifdef FACTORY_PROFILE
+#define PROFILE_INIT() profile_init()
+#define PROFILE_THREAD(name) profile_register_thread(name)
+#define PROFILE_BEGIN(zone, name) struct profile_zone zone = profile_zone_begin(name)
+#define PROFILE_END(zone) profile_zone_end(&zone)
+#define PROFILE_WRITE_TRACE(path) profile_write_trace(path)
+#else
+#define PROFILE_INIT() ((void)0)
+#define PROFILE_THREAD(name) ((void)0)
+#define PROFILE_BEGIN(zone, name) ((void)0)
+#define PROFILE_END(zone) ((void)0)
+#define PROFILE_WRITE_TRACE(path) ((void)0)
+#endif
+
+// Times zones that do nothing, so what is printed is the cost the profiler adds to every zone.
+// Measured at 38-45 ns per zone on a one core virtualized Intel Xeon and 48-55 ns on another
+// machine, so it sits around the 50 ns budget rather than safely under it.
+int benchmark_profiler(uint32_t zone_len) {
+#ifdef FACTORY_PROFILE
+    if (PROFILE_THREAD("main") != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    long long start_ns = profile_clock_ns();
+    for (uint32_t i = 0; i < zone_len; i++) {
+        PROFILE_BEGIN(zone, "empty zone");
+        PROFILE_END(zone);
+    }
+    long long elapsed_ns = profile_clock_ns() - start_ns;
+    printf("%u empty zones: %.2f ns per zone (%s timestamps)\n", zone_len, (double)elapsed_ns / (double)zone_len,
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+        "rdtsc"
+#else
+        "clock_gettime"
+#endif
+    );
+#else
+    (void)zone_len;
+    printf("%s", "Profiler compiled out, zones cost nothing (build with FACTORY_PROFILE to measure them)\n");
+#endif
+    return EXIT_SUCCESS;
+}
@@ -1,15 +1,20 @@
 #version 450
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 matrix;
+    mat4 matrix; // view projection
 } ubo;
 
 layout(location = 0) in vec3 in_position;
-layout(location = 1) in vec3 in_color;
+layout(location = 1) in vec3 in_normal;
+layout(location = 2) in vec2 in_uv;
+layout(location = 3) in mat4 in_instance_model; // locations 3 to 6
+layout(location = 7) in vec4 in_instance_color;
 
 layout(location = 0) out vec3 frag_color;
+// the depth pre-pass and the main pass must produce bit identical depth for the EQUAL test
+invariant gl_Position;
 
 void main() {
-    gl_Position = ubo.matrix * vec4(in_position, 1.0);
-    frag_color = in_color;
+    gl_Position = ubo.matrix * in_instance_model * vec4(in_position, 1.0);
+    frag_color = in_instance_color.rgb * (in_normal * 0.5 + 0.5);
 }
\ No newline at end of file
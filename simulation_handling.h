@@ -0,0 +1,648 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include "arena_handling.h"
+#include "job_handling.h"
+#include "world_handling.h"
+#include "belt_handling.h"
+
+// Deterministic factory simulation. The world advances in fixed ticks using only integer math and
+// a fixed iteration order, so the same world and tick count always give the same state. Machine
+// data is stored as a struct of arrays so a tick streams through tightly packed columns.
+//
+// A tick only touches machines whose state changes. A machine that starts a craft is put in a
+// timing wheel under the tick the craft finishes and is not looked at until then. A machine that
+// cannot start sleeps until an item arrives or its output drains, and a machine whose output
+// target is full waits on that target until it consumes. Progress is derived from the tick a
+// craft ends instead of being counted up every tick.
+//
+// Machines are split into partitions of consecutive indices that a tick can run on separate
+// threads. Starting and finishing crafts only touches a partition's own machines, and output is
+// handed over by the partition holding the target, in source order. What other partitions add to
+// a partition during a phase goes into lists whose order does not change the result, so a tick
+// gives the same state on any number of threads.
+
+#define SIMULATION_TICK_NS 10000000 // 1/100 of a sec
+#define RECIPE_INPUT_LEN 2
+#define MACHINE_STACK_SIZE 50
+#define MACHINE_NO_TARGET UINT32_MAX
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOT_LEN (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVEL_LEN 3 // reaches 2^18 ticks ahead, past the longest recipe
+#define SIMULATION_PARTITION_LEN 1024 // machines per partition, fixed so results do not depend on thread count
+
+enum item {
+    ITEM_NONE,
+    ITEM_IRON_ORE,
+    ITEM_IRON_PLATE,
+    ITEM_IRON_GEAR,
+    ITEM_LEN
+};
+
+enum recipe_kind {
+    RECIPE_MINE_IRON_ORE,
+    RECIPE_SMELT_IRON_PLATE,
+    RECIPE_CRAFT_IRON_GEAR,
+    RECIPE_LEN
+};
+
+enum machine_state {
+    MACHINE_WORKING,
+    MACHINE_NO_INPUT,
+    MACHINE_OUTPUT_FULL
+};
+
+struct recipe {
+    uint16_t duration; // in ticks
+    uint16_t input_item[RECIPE_INPUT_LEN];
+    uint16_t input_amount[RECIPE_INPUT_LEN];
+    uint16_t output_item;
+    uint16_t output_amount;
+};
+
+struct machine_array {
+    uint32_t len;
+    uint32_t capacity;
+    uint16_t* recipe_array;
+    uint64_t* craft_end_array; // tick the current craft finishes in, or the last one did when not crafting
+    uint16_t* input_stock_array[RECIPE_INPUT_LEN];
+    uint16_t* output_stock_array;
+    uint32_t* output_target_array; // machine the output is handed to, or MACHINE_NO_TARGET for storage
+    uint8_t* output_target_slot_array;
+    uint8_t* state_array;
+    float* position_array; // x, y pairs, only read by rendering
+};
+
+// Hierarchical timing wheel. Level 0 has a slot per tick, each level above covers the whole level
+// below per slot. Entries far ahead sit in a coarse slot and move down a level when the wheel
+// reaches it, so inserting and expiring are O(1) per entry however far ahead it is due.
+struct timer_wheel {
+    uint32_t slot_array[TIMER_WHEEL_LEVEL_LEN][TIMER_WHEEL_SLOT_LEN]; // list heads, MACHINE_NO_TARGET when empty
+    uint32_t* next_array; // per machine, the next machine in the same slot
+};
+
+struct machine_partition {
+    struct timer_wheel wheel; // crafts of the partition's machines
+    uint32_t awake_len; // in the scheduler's awake_array, from the partition's first machine on
+    _Atomic uint32_t next_awake_len;
+    uint32_t* transfer_array; // sources handing output to the partition's machines, or storing it from one of them
+    _Atomic uint32_t transfer_len;
+    uint32_t transfer_capacity;
+    uint32_t source_len; // machines handing over in this partition, each is queued at most twice a tick
+    uint64_t stored_item_array[ITEM_LEN]; // added to the simulation's after every tick
+    uint64_t event_len;
+};
+
+// A machine is sleeping when it is neither awake nor crafting.
+struct machine_scheduler {
+    struct machine_partition* partition_array;
+    uint32_t partition_len;
+    uint32_t* wheel_next_array; // shared by the partitions' wheels, each only links its own machines
+    uint32_t* awake_array; // idle machines trying to start a craft this tick, SIMULATION_PARTITION_LEN per partition
+    uint32_t* next_awake_array;
+    uint32_t* blocked_head_array; // per machine, the first source waiting for it to consume
+    uint32_t* blocked_next_array; // per machine, the next source waiting on the same target
+    _Atomic uint8_t* awake_flag_array; // tries to start a craft next tick
+    uint8_t* crafting_array; // in the timing wheel, written by the machine's own partition
+    uint8_t* blocked_array; // waits for its output target to consume, written by the target's partition
+    uint64_t event_len; // machines touched over all ticks
+};
+
+struct simulation {
+    struct recipe recipe_array[RECIPE_LEN];
+    struct machine_array machines;
+    uint64_t tick;
+    uint64_t stored_item_array[ITEM_LEN]; // output of machines without a target
+    struct world world; // the tile each machine stands on
+    struct belt_network belts;
+    struct machine_scheduler scheduler;
+    struct job_system *jobs; // spreads ticks over threads, NULL runs them on the calling thread
+};
+
+int create_simulation(struct simulation *simulation, uint32_t machine_capacity) {
+    *simulation = (struct simulation) {0};
+
+    simulation -> recipe_array[RECIPE_MINE_IRON_ORE] = (struct recipe) {
+        .duration = 50,
+        .input_item = {ITEM_NONE, ITEM_NONE},
+        .input_amount = {0, 0},
+        .output_item = ITEM_IRON_ORE,
+        .output_amount = 1
+    };
+    simulation -> recipe_array[RECIPE_SMELT_IRON_PLATE] = (struct recipe) {
+        .duration = 32,
+        .input_item = {ITEM_IRON_ORE, ITEM_NONE},
+        .input_amount = {1, 0},
+        .output_item = ITEM_IRON_PLATE,
+        .output_amount = 1
+    };
+    simulation -> recipe_array[RECIPE_CRAFT_IRON_GEAR] = (struct recipe) {
+        .duration = 50,
+        .input_item = {ITEM_IRON_PLATE, ITEM_NONE},
+        .input_amount = {2, 0},
+        .output_item = ITEM_IRON_GEAR,
+        .output_amount = 1
+    };
+
+    struct machine_array *machines = &simulation -> machines;
+    machines -> capacity = machine_capacity;
+    machines -> recipe_array = counted_malloc(sizeof(uint16_t) * machine_capacity);
+    machines -> craft_end_array = counted_malloc(sizeof(uint64_t) * machine_capacity);
+    for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+        machines -> input_stock_array[k] = counted_malloc(sizeof(uint16_t) * machine_capacity);
+    }
+    machines -> output_stock_array = counted_malloc(sizeof(uint16_t) * machine_capacity);
+    machines -> output_target_array = counted_malloc(sizeof(uint32_t) * machine_capacity);
+    machines -> output_target_slot_array = counted_malloc(sizeof(uint8_t) * machine_capacity);
+    machines -> state_array = counted_malloc(sizeof(uint8_t) * machine_capacity);
+    machines -> position_array = counted_malloc(sizeof(float) * 2 * machine_capacity);
+    struct machine_scheduler *scheduler = &simulation -> scheduler;
+    scheduler -> partition_len = machine_capacity / SIMULATION_PARTITION_LEN + 1;
+    scheduler -> partition_array = counted_calloc(scheduler -> partition_len, sizeof(struct machine_partition));
+    scheduler -> wheel_next_array = counted_malloc(sizeof(uint32_t) * machine_capacity);
+    scheduler -> awake_array = counted_malloc(sizeof(uint32_t) * scheduler -> partition_len * SIMULATION_PARTITION_LEN);
+    scheduler -> next_awake_array = counted_malloc(sizeof(uint32_t) * scheduler -> partition_len * SIMULATION_PARTITION_LEN);
+    scheduler -> blocked_head_array = counted_malloc(sizeof(uint32_t) * machine_capacity);
+    scheduler -> blocked_next_array = counted_malloc(sizeof(uint32_t) * machine_capacity);
+    scheduler -> awake_flag_array = counted_malloc(sizeof(_Atomic uint8_t) * machine_capacity);
+    scheduler -> crafting_array = counted_malloc(sizeof(uint8_t) * machine_capacity);
+    scheduler -> blocked_array = counted_malloc(sizeof(uint8_t) * machine_capacity);
+    for (uint32_t p = 0; scheduler -> partition_array != NULL && p < scheduler -> partition_len; p++) {
+        struct machine_partition *partition = &scheduler -> partition_array[p];
+        partition -> wheel.next_array = scheduler -> wheel_next_array;
+        for (int level = 0; level < TIMER_WHEEL_LEVEL_LEN; level++) {
+            for (int slot = 0; slot < TIMER_WHEEL_SLOT_LEN; slot++) {
+                partition -> wheel.slot_array[level][slot] = MACHINE_NO_TARGET;
+            }
+        }
+    }
+    if (create_world(&simulation -> world, machine_capacity / CHUNK_TILE_LEN + 1) != EXIT_SUCCESS
+        || create_belt_network(&simulation -> belts, 0) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    int allocated = machines -> recipe_array != NULL && machines -> craft_end_array != NULL
+        && machines -> output_stock_array != NULL && machines -> output_target_array != NULL
+        && machines -> output_target_slot_array != NULL && machines -> state_array != NULL
+        && machines -> position_array != NULL;
+    for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+        allocated = allocated && machines -> input_stock_array[k] != NULL;
+    }
+    allocated = allocated && scheduler -> partition_array != NULL && scheduler -> wheel_next_array != NULL && scheduler -> awake_array != NULL
+        && scheduler -> next_awake_array != NULL && scheduler -> blocked_head_array != NULL && scheduler -> blocked_next_array != NULL
+        && scheduler -> awake_flag_array != NULL && scheduler -> crafting_array != NULL && scheduler -> blocked_array != NULL;
+    if (!allocated) {
+        fprintf(stderr, "ERR: failed to allocate simulation for %u machines\n", machine_capacity);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void destroy_simulation(struct simulation *simulation) {
+    struct machine_array *machines = &simulation -> machines;
+    free(machines -> recipe_array);
+    free(machines -> craft_end_array);
+    for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+        free(machines -> input_stock_array[k]);
+    }
+    free(machines -> output_stock_array);
+    free(machines -> output_target_array);
+    free(machines -> output_target_slot_array);
+    free(machines -> state_array);
+    free(machines -> position_array);
+    struct machine_scheduler *scheduler = &simulation -> scheduler;
+    for (uint32_t p = 0; scheduler -> partition_array != NULL && p < scheduler -> partition_len; p++) {
+        free(scheduler -> partition_array[p].transfer_array);
+    }
+    free(scheduler -> partition_array);
+    free(scheduler -> wheel_next_array);
+    free(scheduler -> awake_array);
+    free(scheduler -> next_awake_array);
+    free(scheduler -> blocked_head_array);
+    free(scheduler -> blocked_next_array);
+    free((void*)scheduler -> awake_flag_array);
+    free(scheduler -> crafting_array);
+    free(scheduler -> blocked_array);
+    destroy_belt_network(&simulation -> belts);
+    destroy_world(&simulation -> world);
+    *simulation = (struct simulation) {0};
+}
+
+// Files machine under the tick its craft ends in, which must not come before tick, the one being run.
+void timer_wheel_insert(struct timer_wheel *wheel, uint64_t tick, uint32_t machine, uint64_t end) {
+    int level = 0;
+    if (end - tick >= TIMER_WHEEL_SLOT_LEN) {
+        // the first level whose slot for end comes up again no earlier than end's own window
+        level = 1;
+        while ((end >> (TIMER_WHEEL_SLOT_BITS * level)) - (tick >> (TIMER_WHEEL_SLOT_BITS * level)) > TIMER_WHEEL_SLOT_LEN) {
+            level++;
+        }
+        assert(level < TIMER_WHEEL_LEVEL_LEN);
+    }
+    uint32_t slot = (uint32_t)(end >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOT_LEN - 1);
+    wheel -> next_array[machine] = wheel -> slot_array[level][slot];
+    wheel -> slot_array[level][slot] = machine;
+}
+
+// Returns the list of machines due in tick, linked through next_array. Ticks have to be expired
+// one after the other, at the start of each a coarse slot that has come up is spread over the
+// levels below, highest level first so its entries can move down more than one level.
+uint32_t timer_wheel_expire(struct timer_wheel *wheel, uint64_t tick, const uint64_t* end_array) {
+    for (int level = TIMER_WHEEL_LEVEL_LEN - 1; level > 0; level--) {
+        if ((tick & ((1ull << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0) {
+            continue;
+        }
+        uint32_t slot = (uint32_t)(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOT_LEN - 1);
+        uint32_t machine = wheel -> slot_array[level][slot];
+        wheel -> slot_array[level][slot] = MACHINE_NO_TARGET;
+        while (machine != MACHINE_NO_TARGET) {
+            uint32_t next = wheel -> next_array[machine];
+            // entries due in this very tick land in the level 0 slot taken off below
+            timer_wheel_insert(wheel, tick, machine, end_array[machine]);
+            machine = next;
+        }
+    }
+    uint32_t slot = (uint32_t)tick & (TIMER_WHEEL_SLOT_LEN - 1);
+    uint32_t due = wheel -> slot_array[0][slot];
+    wheel -> slot_array[0][slot] = MACHINE_NO_TARGET;
+    return due;
+}
+
+static inline uint32_t machine_partition(uint32_t machine) {
+    return machine / SIMULATION_PARTITION_LEN;
+}
+
+// The partition that hands machine's output over: its target's, or its own when it stores output.
+static inline uint32_t transfer_partition(const struct machine_array *machines, uint32_t machine) {
+    uint32_t target = machines -> output_target_array[machine];
+    return machine_partition(target == MACHINE_NO_TARGET ? machine : target);
+}
+
+// Has a sleeping machine try to start a craft next tick. Safe from any partition while crafting
+// flags are not being written.
+static inline void wake_machine(struct machine_scheduler *scheduler, uint32_t machine) {
+    if (scheduler -> crafting_array[machine] || atomic_load_explicit(&scheduler -> awake_flag_array[machine], memory_order_relaxed)) {
+        return;
+    }
+    if (atomic_exchange_explicit(&scheduler -> awake_flag_array[machine], 1, memory_order_relaxed) == 0) {
+        uint32_t partition = machine_partition(machine);
+        uint32_t a = atomic_fetch_add_explicit(&scheduler -> partition_array[partition].next_awake_len, 1, memory_order_relaxed);
+        scheduler -> next_awake_array[partition * SIMULATION_PARTITION_LEN + a] = machine;
+    }
+}
+
+// A machine can be queued twice in a tick, the hand over phase skips the repeat after sorting.
+static inline void queue_machine_transfer(struct simulation *simulation, uint32_t machine) {
+    struct machine_partition *partition = &simulation -> scheduler.partition_array[transfer_partition(&simulation -> machines, machine)];
+    uint32_t t = atomic_fetch_add_explicit(&partition -> transfer_len, 1, memory_order_relaxed);
+    assert(t < partition -> transfer_capacity);
+    partition -> transfer_array[t] = machine;
+}
+
+// Grows the partition's transfer list for one more source, outside of ticks so they never allocate.
+int reserve_machine_source(struct machine_partition *partition) {
+    uint32_t needed = (partition -> source_len + 1) * 2;
+    if (needed <= partition -> transfer_capacity) {
+        return EXIT_SUCCESS;
+    }
+    uint32_t new_capacity = partition -> transfer_capacity < 16 ? 16 : partition -> transfer_capacity * 2;
+    new_capacity = new_capacity < needed ? needed : new_capacity;
+    uint32_t* new_array = counted_realloc(partition -> transfer_array, sizeof(uint32_t) * new_capacity);
+    if (new_array == NULL) {
+        perror("failed to grow machine transfer list");
+        return EXIT_FAILURE;
+    }
+    partition -> transfer_array = new_array;
+    partition -> transfer_capacity = new_capacity;
+    return EXIT_SUCCESS;
+}
+
+// Returns the new machine's index, or MACHINE_NO_TARGET when the simulation is full or the tile
+// at x, y is taken.
+uint32_t add_machine(struct simulation *simulation, enum recipe_kind recipe, float x, float y) {
+    struct machine_array *machines = &simulation -> machines;
+    if (machines -> len == machines -> capacity) {
+        return MACHINE_NO_TARGET;
+    }
+    struct machine_partition *partition = &simulation -> scheduler.partition_array[machine_partition(machines -> len)];
+    if (reserve_machine_source(partition) != EXIT_SUCCESS) {
+        return MACHINE_NO_TARGET;
+    }
+    if (place_building(&simulation -> world, (int32_t)floorf(x), (int32_t)floorf(y), TILE_MACHINE, machines -> len, 0) != EXIT_SUCCESS) {
+        return MACHINE_NO_TARGET;
+    }
+    uint32_t i = machines -> len++;
+    machines -> recipe_array[i] = recipe;
+    machines -> craft_end_array[i] = 0;
+    for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+        machines -> input_stock_array[k][i] = 0;
+    }
+    machines -> output_stock_array[i] = 0;
+    machines -> output_target_array[i] = MACHINE_NO_TARGET;
+    machines -> output_target_slot_array[i] = 0;
+    machines -> state_array[i] = MACHINE_NO_INPUT;
+    machines -> position_array[i * 2] = x;
+    machines -> position_array[i * 2 + 1] = y;
+    partition -> source_len++;
+    atomic_store_explicit(&simulation -> scheduler.awake_flag_array[i], 0, memory_order_relaxed);
+    simulation -> scheduler.crafting_array[i] = 0;
+    simulation -> scheduler.blocked_array[i] = 0;
+    simulation -> scheduler.blocked_head_array[i] = MACHINE_NO_TARGET;
+    wake_machine(&simulation -> scheduler, i);
+    return i;
+}
+
+// Sends the output of one machine into an input slot of another, fails when the target's recipe
+// does not take that item.
+int connect_machines(struct simulation *simulation, uint32_t source, uint32_t target) {
+    struct machine_array *machines = &simulation -> machines;
+    uint16_t item = simulation -> recipe_array[machines -> recipe_array[source]].output_item;
+    const struct recipe *target_recipe = &simulation -> recipe_array[machines -> recipe_array[target]];
+    for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+        if (target_recipe -> input_item[k] == item) {
+            struct machine_partition *old_partition = &simulation -> scheduler.partition_array[transfer_partition(machines, source)];
+            struct machine_partition *new_partition = &simulation -> scheduler.partition_array[machine_partition(target)];
+            if (new_partition != old_partition) {
+                if (reserve_machine_source(new_partition) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                old_partition -> source_len--;
+                new_partition -> source_len++;
+            }
+            machines -> output_target_array[source] = target;
+            machines -> output_target_slot_array[source] = (uint8_t)k;
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+// Lays out mine -> smelter -> gear assembler chains on a grid, one machine per cell.
+int populate_simulation(struct simulation *simulation, uint32_t machine_len) {
+    uint32_t side = 1;
+    while (side * side < machine_len) {
+        side++;
+    }
+    for (uint32_t i = 0; i < machine_len; i++) {
+        enum recipe_kind recipe = (enum recipe_kind)(i % RECIPE_LEN);
+        uint32_t machine = add_machine(simulation, recipe, (float)(i % side), (float)(i / side));
+        if (machine == MACHINE_NO_TARGET) {
+            return EXIT_FAILURE;
+        }
+        if (recipe != RECIPE_MINE_IRON_ORE && connect_machines(simulation, machine - 1, machine) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static int compare_machine_index(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Finishes and starts the crafts of one partition's machines, which only touches their own columns.
+void tick_machine_partition(void *data, uint32_t partition_index, uint32_t thread) {
+    (void)thread;
+    struct simulation *simulation = data;
+    struct machine_array *machines = &simulation -> machines;
+    struct machine_scheduler *scheduler = &simulation -> scheduler;
+    struct machine_partition *partition = &scheduler -> partition_array[partition_index];
+    const struct recipe *recipe_array = simulation -> recipe_array;
+    uint64_t tick = simulation -> tick;
+
+    uint32_t machine = timer_wheel_expire(&partition -> wheel, tick, machines -> craft_end_array);
+    while (machine != MACHINE_NO_TARGET) {
+        uint32_t next = scheduler -> wheel_next_array[machine];
+        machines -> output_stock_array[machine] += recipe_array[machines -> recipe_array[machine]].output_amount;
+        scheduler -> crafting_array[machine] = 0;
+        wake_machine(scheduler, machine);
+        queue_machine_transfer(simulation, machine);
+        partition -> event_len++;
+        machine = next;
+    }
+
+    const uint32_t* awake_array = scheduler -> awake_array + partition_index * SIMULATION_PARTITION_LEN;
+    for (uint32_t a = 0; a < partition -> awake_len; a++) {
+        uint32_t i = awake_array[a];
+        atomic_store_explicit(&scheduler -> awake_flag_array[i], 0, memory_order_relaxed);
+        partition -> event_len++;
+        const struct recipe *recipe = &recipe_array[machines -> recipe_array[i]];
+        // a machine that cannot start sleeps, its output draining or an input arriving wakes it
+        if (machines -> output_stock_array[i] + recipe -> output_amount > MACHINE_STACK_SIZE) {
+            machines -> state_array[i] = MACHINE_OUTPUT_FULL;
+            continue;
+        }
+        int has_input = 1;
+        for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+            has_input &= machines -> input_stock_array[k][i] >= recipe -> input_amount[k];
+        }
+        if (!has_input) {
+            machines -> state_array[i] = MACHINE_NO_INPUT;
+            continue;
+        }
+        for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+            machines -> input_stock_array[k][i] -= recipe -> input_amount[k];
+        }
+        // the sources waiting for room in this machine's inputs can try again, they hand over in this partition
+        for (uint32_t source = scheduler -> blocked_head_array[i]; source != MACHINE_NO_TARGET; source = scheduler -> blocked_next_array[source]) {
+            scheduler -> blocked_array[source] = 0;
+            queue_machine_transfer(simulation, source);
+        }
+        scheduler -> blocked_head_array[i] = MACHINE_NO_TARGET;
+        machines -> state_array[i] = MACHINE_WORKING;
+        machines -> craft_end_array[i] = tick + recipe -> duration - 1;
+        if (recipe -> duration <= 1) {
+            machines -> output_stock_array[i] += recipe -> output_amount;
+            wake_machine(scheduler, i);
+            queue_machine_transfer(simulation, i);
+        } else {
+            scheduler -> crafting_array[i] = 1;
+            timer_wheel_insert(&partition -> wheel, tick, i, machines -> craft_end_array[i]);
+        }
+    }
+}
+
+// Hands over the output of the sources queued in a partition. Every target of these sources is
+// in the partition and every source is queued in only one, so partitions do not share anything
+// they write except the awake lists.
+void hand_over_machine_partition(void *data, uint32_t partition_index, uint32_t thread) {
+    (void)thread;
+    struct simulation *simulation = data;
+    struct machine_array *machines = &simulation -> machines;
+    struct machine_scheduler *scheduler = &simulation -> scheduler;
+    struct machine_partition *partition = &scheduler -> partition_array[partition_index];
+    const struct recipe *recipe_array = simulation -> recipe_array;
+
+    uint32_t transfer_len = atomic_load_explicit(&partition -> transfer_len, memory_order_relaxed);
+    // sorted so a target with too little room fills up from the lowest source the way a full scan would
+    qsort(partition -> transfer_array, transfer_len, sizeof(uint32_t), compare_machine_index);
+    for (uint32_t t = 0; t < transfer_len; t++) {
+        uint32_t i = partition -> transfer_array[t];
+        if (t > 0 && partition -> transfer_array[t - 1] == i) {
+            continue;
+        }
+        partition -> event_len++;
+        uint16_t stock = machines -> output_stock_array[i];
+        if (stock == 0) {
+            continue;
+        }
+        uint32_t target = machines -> output_target_array[i];
+        if (target == MACHINE_NO_TARGET) {
+            partition -> stored_item_array[recipe_array[machines -> recipe_array[i]].output_item] += stock;
+            machines -> output_stock_array[i] = 0;
+            wake_machine(scheduler, i);
+            continue;
+        }
+        uint16_t* target_stock = &machines -> input_stock_array[machines -> output_target_slot_array[i]][target];
+        uint16_t moved = MACHINE_STACK_SIZE - *target_stock;
+        if (moved > stock) {
+            moved = stock;
+        }
+        if (moved > 0) {
+            *target_stock += moved;
+            machines -> output_stock_array[i] -= moved;
+            wake_machine(scheduler, target);
+            wake_machine(scheduler, i);
+        }
+        if (machines -> output_stock_array[i] > 0 && !scheduler -> blocked_array[i]) {
+            scheduler -> blocked_array[i] = 1;
+            scheduler -> blocked_next_array[i] = scheduler -> blocked_head_array[target];
+            scheduler -> blocked_head_array[target] = i;
+        }
+    }
+    atomic_store_explicit(&partition -> transfer_len, 0, memory_order_relaxed);
+}
+
+// One fixed step. Crafting runs for all partitions, then handing output over does, each phase on
+// as many threads as simulation -> jobs has.
+void simulation_tick(struct simulation *simulation) {
+    struct machine_scheduler *scheduler = &simulation -> scheduler;
+
+    // the machines woken during the last tick try to start in this one
+    uint32_t* swap = scheduler -> awake_array;
+    scheduler -> awake_array = scheduler -> next_awake_array;
+    scheduler -> next_awake_array = swap;
+    for (uint32_t p = 0; p < scheduler -> partition_len; p++) {
+        struct machine_partition *partition = &scheduler -> partition_array[p];
+        partition -> awake_len = atomic_load_explicit(&partition -> next_awake_len, memory_order_relaxed);
+        atomic_store_explicit(&partition -> next_awake_len, 0, memory_order_relaxed);
+    }
+
+    run_jobs(simulation -> jobs, tick_machine_partition, simulation, scheduler -> partition_len);
+    run_jobs(simulation -> jobs, hand_over_machine_partition, simulation, scheduler -> partition_len);
+
+    // sums, so the order partitions finished in does not matter
+    for (uint32_t p = 0; p < scheduler -> partition_len; p++) {
+        struct machine_partition *partition = &scheduler -> partition_array[p];
+        for (int item = 0; item < ITEM_LEN; item++) {
+            simulation -> stored_item_array[item] += partition -> stored_item_array[item];
+            partition -> stored_item_array[item] = 0;
+        }
+        scheduler -> event_len += partition -> event_len;
+        partition -> event_len = 0;
+    }
+
+    belt_tick(&simulation -> belts, simulation -> jobs);
+
+    simulation -> tick += 1;
+}
+
+// Ticks into the current craft after the last tick, 0 when not crafting.
+uint16_t machine_progress(const struct simulation *simulation, uint32_t machine) {
+    const struct machine_array *machines = &simulation -> machines;
+    if (!simulation -> scheduler.crafting_array[machine]) {
+        return 0;
+    }
+    uint16_t duration = simulation -> recipe_array[machines -> recipe_array[machine]].duration;
+    return (uint16_t)(duration - (machines -> craft_end_array[machine] - (simulation -> tick - 1)));
+}
+
+// Craft progress from 0 to 1 at alpha between the last two ticks before tick, so a frame alpha
+// past the newest tick shows where the craft was at the tick before plus alpha of a tick. Only
+// needs the machine's craft end and crafting flag, which change when it tries to start a craft.
+static inline float craft_progress(uint64_t tick, uint64_t end, int crafting, uint16_t duration, float alpha) {
+    if (tick == 0) {
+        return 0.0f;
+    }
+    uint64_t last_tick = tick - 1;
+    // a craft that finished in the last tick still runs out to 1 over the frames before it
+    if (!crafting && end != last_tick) {
+        return 0.0f;
+    }
+    float progress = ((float)duration - ((float)(end - last_tick) + 1.0f - alpha)) / (float)duration;
+    return progress < 0.0f ? 0.0f : progress;
+}
+
+float interpolate_machine_progress(const struct simulation *simulation, uint32_t machine, float alpha) {
+    const struct machine_array *machines = &simulation -> machines;
+    return craft_progress(simulation -> tick, machines -> craft_end_array[machine], simulation -> scheduler.crafting_array[machine],
+        simulation -> recipe_array[machines -> recipe_array[machine]].duration, alpha);
+}
+
+static inline uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// FNV-1a over the machine columns, for checking that two runs reached the same state.
+uint64_t simulation_checksum(const struct simulation *simulation) {
+    const struct machine_array *machines = &simulation -> machines;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < machines -> len; i++) {
+        uint16_t progress = machine_progress(simulation, i);
+        hash = hash_bytes(hash, &progress, sizeof(progress));
+    }
+    hash = hash_bytes(hash, machines -> output_stock_array, sizeof(uint16_t) * machines -> len);
+    hash = hash_bytes(hash, machines -> state_array, machines -> len);
+    hash = hash_bytes(hash, simulation -> stored_item_array, sizeof(simulation -> stored_item_array));
+    for (int k = 0; k < RECIPE_INPUT_LEN; k++) {
+        hash = hash_bytes(hash, machines -> input_stock_array[k], sizeof(uint16_t) * machines -> len);
+    }
+    return hash;
+}
+
+// thread_len of 1 ticks on the calling thread without a job system.
+int benchmark_simulation(uint32_t machine_len, uint32_t tick_len, uint32_t thread_len) {
+    struct simulation simulation;
+    struct job_system jobs;
+    if (create_simulation(&simulation, machine_len) != EXIT_SUCCESS || populate_simulation(&simulation, machine_len) != EXIT_SUCCESS) {
+        destroy_simulation(&simulation);
+        return EXIT_FAILURE;
+    }
+    if (thread_len > 1) {
+        if (create_job_system(&jobs, thread_len) != EXIT_SUCCESS) {
+            destroy_simulation(&simulation);
+            return EXIT_FAILURE;
+        }
+        simulation.jobs = &jobs;
+    }
+
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (uint32_t i = 0; i < tick_len; i++) {
+        simulation_tick(&simulation);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+    printf("Simulated %u machines on %u threads for %u ticks: %.3f ms per tick, %.0f ticks/s (budget %.0f ms), %.0f machines touched per tick, %llu gears, checksum %016llx\n",
+        machine_len, simulation.jobs != NULL ? jobs.thread_len : 1, tick_len, seconds * 1000.0 / tick_len, tick_len / seconds, SIMULATION_TICK_NS / 1000000.0,
+        (double)simulation.scheduler.event_len / tick_len,
+        (unsigned long long)simulation.stored_item_array[ITEM_IRON_GEAR], (unsigned long long)simulation_checksum(&simulation));
+
+    if (simulation.jobs != NULL) {
+        destroy_job_system(&jobs);
+    }
+    destroy_simulation(&simulation);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include "profiler_handling.h"
+#include "pacing_handling.h"
+#include "simulation_handling.h"
+
+// Runs the simulation on its own thread and hands the renderer read-only snapshots of what it
+// draws. Snapshots are triple buffered: the simulation fills one, the renderer reads another, and
+// the third is the newest published one, which either side trades its own for with one atomic
+// exchange. Neither thread ever waits for the other, a slow frame just skips snapshots and a slow
+// tick leaves the renderer on the last one.
+//
+// A snapshot carries each machine's craft end rather than its progress, so a frame works out the
+// progress between the last two ticks from the one buffer it holds, and a machine's entry only
+// changes in the ticks it tries to start a craft. Each snapshot keeps a list of the machines
+// that changed since it was last filled, the simulation thread only copies those into it.
+
+#define SNAPSHOT_LEN 3
+#define SNAPSHOT_FRESH 0x4 // set on the published index until the renderer takes it
+#define SIMULATION_MAX_BEHIND_NS 250000000 // a simulation further behind drops the backlog, like the frame loop's clamp
+
+struct render_snapshot {
+    uint64_t tick; // ticks run when it was taken
+    long long time_ns; // when its last tick was due, frames past this interpolate toward the next
+    uint32_t machine_len;
+    uint8_t* state_array;
+    uint8_t* crafting_array;
+    uint64_t* craft_end_array;
+    const uint16_t* duration_array; // per machine, shared by every snapshot since recipes do not change
+    // simulation thread only, the machines changed since the snapshot was last filled
+    uint32_t* stale_array;
+    uint32_t stale_len;
+    uint8_t* stale_flag_array;
+};
+
+struct snapshot_exchange {
+    struct render_snapshot snapshot_array[SNAPSHOT_LEN];
+    _Atomic uint32_t published; // snapshot index, with SNAPSHOT_FRESH while the renderer has not taken it
+    uint32_t write_index; // simulation thread only
+    uint32_t read_index; // render thread only
+};
+
+struct simulation_thread {
+    struct simulation *simulation;
+    struct snapshot_exchange exchange;
+    uint16_t* duration_array; // craft duration of every machine's recipe
+    thrd_t thread;
+    _Atomic int quit;
+    _Atomic uint64_t dropped_tick_len; // ticks skipped after falling too far behind
+};
+
+static inline void copy_snapshot_machine(struct render_snapshot *snapshot, const struct simulation *simulation, uint32_t machine) {
+    snapshot -> state_array[machine] = simulation -> machines.state_array[machine];
+    snapshot -> crafting_array[machine] = simulation -> scheduler.crafting_array[machine];
+    snapshot -> craft_end_array[machine] = simulation -> machines.craft_end_array[machine];
+}
+
+// Copies every machine, for snapshots taken before the simulation thread starts.
+void capture_render_snapshot(struct render_snapshot *snapshot, const struct simulation *simulation, long long time_ns) {
+    snapshot -> tick = simulation -> tick;
+    snapshot -> time_ns = time_ns;
+    snapshot -> machine_len = simulation -> machines.len;
+    for (uint32_t i = 0; i < simulation -> machines.len; i++) {
+        copy_snapshot_machine(snapshot, simulation, i);
+    }
+}
+
+// Simulation thread only, brings the snapshot being filled up to the tick just run. Only machines
+// that tried to start a craft change their entry: one whose craft ended draws the same until its
+// machine tries again in the next tick, and every machine whose craft ends is woken for it. The
+// other snapshots queue those machines for when they are filled again.
+void update_render_snapshot(struct simulation_thread *thread, long long time_ns) {
+    struct snapshot_exchange *exchange = &thread -> exchange;
+    const struct simulation *simulation = thread -> simulation;
+    const struct machine_scheduler *scheduler = &simulation -> scheduler;
+    struct render_snapshot *snapshot = &exchange -> snapshot_array[exchange -> write_index];
+    for (uint32_t s = 0; s < snapshot -> stale_len; s++) {
+        uint32_t i = snapshot -> stale_array[s];
+        copy_snapshot_machine(snapshot, simulation, i);
+        snapshot -> stale_flag_array[i] = 0;
+    }
+    snapshot -> stale_len = 0;
+    for (uint32_t p = 0; p < scheduler -> partition_len; p++) {
+        // still the list the tick just run went through, the next one is built in next_awake_array
+        const uint32_t* awake_array = scheduler -> awake_array + p * SIMULATION_PARTITION_LEN;
+        for (uint32_t a = 0; a < scheduler -> partition_array[p].awake_len; a++) {
+            uint32_t i = awake_array[a];
+            copy_snapshot_machine(snapshot, simulation, i);
+            for (uint32_t k = 0; k < SNAPSHOT_LEN; k++) {
+                struct render_snapshot *other = &exchange -> snapshot_array[k];
+                if (other != snapshot && !other -> stale_flag_array[i]) {
+                    other -> stale_flag_array[i] = 1;
+                    other -> stale_array[other -> stale_len++] = i;
+                }
+            }
+        }
+    }
+    snapshot -> tick = simulation -> tick;
+    snapshot -> time_ns = time_ns;
+}
+
+// Simulation thread only, makes the filled snapshot the newest and takes the stale one back.
+void publish_render_snapshot(struct snapshot_exchange *exchange) {
+    uint32_t previous = atomic_exchange_explicit(&exchange -> published, exchange -> write_index | SNAPSHOT_FRESH, memory_order_acq_rel);
+    exchange -> write_index = previous & ~SNAPSHOT_FRESH;
+}
+
+// Render thread only, the newest snapshot, or the one it already had when nothing newer came.
+const struct render_snapshot* acquire_render_snapshot(struct snapshot_exchange *exchange) {
+    if (atomic_load_explicit(&exchange -> published, memory_order_relaxed) & SNAPSHOT_FRESH) {
+        uint32_t previous = atomic_exchange_explicit(&exchange -> published, exchange -> read_index, memory_order_acq_rel);
+        exchange -> read_index = previous & ~SNAPSHOT_FRESH;
+    }
+    return &exchange -> snapshot_array[exchange -> read_index];
+}
+
+static inline float snapshot_machine_progress(const struct render_snapshot *snapshot, uint32_t machine, float alpha) {
+    return craft_progress(snapshot -> tick, snapshot -> craft_end_array[machine], snapshot -> crafting_array[machine], snapshot -> duration_array[machine], alpha);
+}
+
+// Between 0 at the snapshot's tick and 1 at the next one.
+static inline float snapshot_alpha(const struct render_snapshot *snapshot, long long now_ns) {
+    float alpha = (float)(now_ns - snapshot -> time_ns) / (float)SIMULATION_TICK_NS;
+    return alpha < 0.0f ? 0.0f : alpha > 1.0f ? 1.0f : alpha;
+}
+
+// Ticks whenever the next tick is due and sleeps in between, publishing a snapshot after each.
+int simulation_thread_main(void *argument) {
+    struct simulation_thread *thread = argument;
+    struct snapshot_exchange *exchange = &thread -> exchange;
+    PROFILE_THREAD("simulation");
+    long long next_tick_ns = pacing_now_ns() + SIMULATION_TICK_NS;
+    while (!atomic_load_explicit(&thread -> quit, memory_order_relaxed)) {
+        long long now_ns = pacing_now_ns();
+        if (now_ns < next_tick_ns) {
+            long long wait_ns = next_tick_ns - now_ns;
+            thrd_sleep(&(struct timespec) {.tv_sec = wait_ns / 1000000000, .tv_nsec = wait_ns % 1000000000}, NULL);
+            continue;
+        }
+        if (now_ns - next_tick_ns > SIMULATION_MAX_BEHIND_NS) {
+            atomic_fetch_add_explicit(&thread -> dropped_tick_len, (uint64_t)((now_ns - next_tick_ns) / SIMULATION_TICK_NS), memory_order_relaxed);
+            next_tick_ns = now_ns;
+        }
+        PROFILE_BEGIN(tick_zone, "simulation tick");
+        simulation_tick(thread -> simulation);
+        PROFILE_END(tick_zone);
+        PROFILE_BEGIN(snapshot_zone, "snapshot");
+        update_render_snapshot(thread, next_tick_ns);
+        publish_render_snapshot(exchange);
+        PROFILE_END(snapshot_zone);
+        next_tick_ns += SIMULATION_TICK_NS;
+    }
+    return 0;
+}
+
+void destroy_simulation_thread(struct simulation_thread *thread) {
+    for (int i = 0; i < SNAPSHOT_LEN; i++) {
+        struct render_snapshot *snapshot = &thread -> exchange.snapshot_array[i];
+        free(snapshot -> state_array);
+        free(snapshot -> crafting_array);
+        free(snapshot -> craft_end_array);
+        free(snapshot -> stale_array);
+        free(snapshot -> stale_flag_array);
+    }
+    free(thread -> duration_array);
+    *thread = (struct simulation_thread) {0};
+}
+
+// Waits for the tick in progress, the simulation belongs to the calling thread again afterwards.
+void stop_simulation_thread(struct simulation_thread *thread) {
+    atomic_store(&thread -> quit, 1);
+    thrd_join(thread -> thread, NULL);
+    uint64_t dropped_tick_len = atomic_load(&thread -> dropped_tick_len);
+    if (dropped_tick_len > 0) {
+        printf("Simulation fell behind and dropped %llu ticks\n", (unsigned long long)dropped_tick_len);
+    }
+}
+
+// Snapshots the current state into every buffer so the renderer has one before the first tick,
+// then hands the simulation to the new thread. Until stop_simulation_thread it must only be read
+// through snapshots.
+int start_simulation_thread(struct simulation_thread *thread, struct simulation *simulation) {
+    *thread = (struct simulation_thread) {.simulation = simulation};
+    uint32_t capacity = simulation -> machines.capacity > 0 ? simulation -> machines.capacity : 1;
+    long long now_ns = pacing_now_ns();
+    thread -> duration_array = counted_malloc(sizeof(uint16_t) * capacity);
+    if (thread -> duration_array == NULL) {
+        perror("failed to allocate render snapshot");
+        destroy_simulation_thread(thread);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < simulation -> machines.len; i++) {
+        thread -> duration_array[i] = simulation -> recipe_array[simulation -> machines.recipe_array[i]].duration;
+    }
+    for (int i = 0; i < SNAPSHOT_LEN; i++) {
+        struct render_snapshot *snapshot = &thread -> exchange.snapshot_array[i];
+        snapshot -> state_array = counted_malloc(sizeof(uint8_t) * capacity);
+        snapshot -> crafting_array = counted_malloc(sizeof(uint8_t) * capacity);
+        snapshot -> craft_end_array = counted_malloc(sizeof(uint64_t) * capacity);
+        snapshot -> stale_array = counted_malloc(sizeof(uint32_t) * capacity);
+        snapshot -> stale_flag_array = counted_calloc(capacity, sizeof(uint8_t));
+        if (snapshot -> state_array == NULL || snapshot -> crafting_array == NULL || snapshot -> craft_end_array == NULL
+            || snapshot -> stale_array == NULL || snapshot -> stale_flag_array == NULL) {
+            perror("failed to allocate render snapshot");
+            destroy_simulation_thread(thread);
+            return EXIT_FAILURE;
+        }
+        snapshot -> duration_array = thread -> duration_array;
+        capture_render_snapshot(snapshot, simulation, now_ns);
+    }
+    thread -> exchange.read_index = 0;
+    atomic_store(&thread -> exchange.published, 1);
+    thread -> exchange.write_index = 2;
+    if (thrd_create(&thread -> thread, simulation_thread_main, thread) != thrd_success) {
+        fprintf(stderr, "%s", "ERR: failed to start simulation thread\n");
+        destroy_simulation_thread(thread);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
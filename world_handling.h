@@ -0,0 +1,306 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena_handling.h"
+
+// The tile grid buildings are placed on. The map is split into square chunks, each a dense array
+// of tiles, and only chunks that hold something are allocated, so an unbounded map costs what is
+// built on it. Chunks are found through an open addressing hash map keyed by chunk coordinates
+// and also kept in a dense array, so systems that walk the whole world only touch loaded chunks.
+
+#define CHUNK_SHIFT 5
+#define CHUNK_SIZE (1 << CHUNK_SHIFT) // 32 tiles per side
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+#define CHUNK_TILE_LEN (CHUNK_SIZE * CHUNK_SIZE)
+#define WORLD_NO_CHUNK UINT32_MAX
+#define WORLD_NO_BUILDING UINT32_MAX
+#define WORLD_MIN_SLOT_LEN 64 // a power of two
+
+enum tile_kind {
+    TILE_EMPTY,
+    TILE_MACHINE,
+    TILE_BELT,
+    TILE_SPLITTER,
+    TILE_KIND_LEN
+};
+
+// Unit steps for each direction, and the direction 90 degrees counterclockwise is (direction + 1) & 3.
+static const int32_t direction_dx[4] = {1, 0, -1, 0};
+static const int32_t direction_dy[4] = {0, 1, 0, -1};
+
+struct tile {
+    uint32_t building; // index into the array of its kind, WORLD_NO_BUILDING when empty
+    uint8_t kind;
+    uint8_t direction; // 0 to 3, east, north, west, south
+};
+
+struct chunk {
+    int32_t x; // in chunks, tile x >> CHUNK_SHIFT
+    int32_t y;
+    uint32_t building_len; // tiles that are not empty
+    struct tile tile_array[CHUNK_TILE_LEN]; // row major, y * CHUNK_SIZE + x
+};
+
+struct world_slot {
+    uint64_t key;
+    uint32_t chunk; // index into chunk_array, WORLD_NO_CHUNK when the slot is free
+};
+
+struct world {
+    struct chunk** chunk_array; // loaded chunks in load order, each allocated on its own so tiles never move
+    uint32_t chunk_len;
+    uint32_t chunk_capacity;
+    struct world_slot* slot_array;
+    uint32_t slot_len; // a power of two, kept at least twice chunk_len
+};
+
+static inline uint64_t chunk_key(int32_t chunk_x, int32_t chunk_y) {
+    return ((uint64_t)(uint32_t)chunk_x << 32) | (uint64_t)(uint32_t)chunk_y;
+}
+
+// Fibonacci hashing, the multiply spreads neighbouring chunks over the whole table.
+static inline uint32_t chunk_slot(const struct world *world, uint64_t key) {
+    return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & (world -> slot_len - 1);
+}
+
+int create_world(struct world *world, uint32_t chunk_capacity) {
+    *world = (struct world) {0};
+    world -> slot_len = WORLD_MIN_SLOT_LEN;
+    while (world -> slot_len < chunk_capacity * 2) {
+        world -> slot_len *= 2;
+    }
+    world -> chunk_capacity = chunk_capacity < 16 ? 16 : chunk_capacity;
+    world -> chunk_array = counted_malloc(sizeof(struct chunk*) * world -> chunk_capacity);
+    world -> slot_array = counted_malloc(sizeof(struct world_slot) * world -> slot_len);
+    if (world -> chunk_array == NULL || world -> slot_array == NULL) {
+        fprintf(stderr, "ERR: failed to allocate world for %u chunks\n", chunk_capacity);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < world -> slot_len; i++) {
+        world -> slot_array[i].chunk = WORLD_NO_CHUNK;
+    }
+    return EXIT_SUCCESS;
+}
+
+void destroy_world(struct world *world) {
+    for (uint32_t i = 0; i < world -> chunk_len; i++) {
+        free(world -> chunk_array[i]);
+    }
+    free(world -> chunk_array);
+    free(world -> slot_array);
+    *world = (struct world) {0};
+}
+
+// Index of the slot holding key, or of the free slot where it would go.
+static inline uint32_t find_world_slot(const struct world *world, uint64_t key) {
+    uint32_t slot = chunk_slot(world, key);
+    while (world -> slot_array[slot].chunk != WORLD_NO_CHUNK && world -> slot_array[slot].key != key) {
+        slot = (slot + 1) & (world -> slot_len - 1);
+    }
+    return slot;
+}
+
+static inline struct chunk* find_chunk(const struct world *world, int32_t chunk_x, int32_t chunk_y) {
+    const struct world_slot *slot = &world -> slot_array[find_world_slot(world, chunk_key(chunk_x, chunk_y))];
+    return slot -> chunk == WORLD_NO_CHUNK ? NULL : world -> chunk_array[slot -> chunk];
+}
+
+// NULL when the tile's chunk is not loaded, which means the tile is empty.
+static inline struct tile* world_tile(const struct world *world, int32_t x, int32_t y) {
+    struct chunk *chunk = find_chunk(world, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+    return chunk == NULL ? NULL : &chunk -> tile_array[(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)];
+}
+
+int grow_world_slots(struct world *world) {
+    uint32_t old_slot_len = world -> slot_len;
+    struct world_slot* old_slot_array = world -> slot_array;
+    struct world_slot* new_slot_array = counted_malloc(sizeof(struct world_slot) * old_slot_len * 2);
+    if (new_slot_array == NULL) {
+        perror("failed to grow world slots");
+        return EXIT_FAILURE;
+    }
+    world -> slot_array = new_slot_array;
+    world -> slot_len = old_slot_len * 2;
+    for (uint32_t i = 0; i < world -> slot_len; i++) {
+        world -> slot_array[i].chunk = WORLD_NO_CHUNK;
+    }
+    for (uint32_t i = 0; i < old_slot_len; i++) {
+        if (old_slot_array[i].chunk != WORLD_NO_CHUNK) {
+            world -> slot_array[find_world_slot(world, old_slot_array[i].key)] = old_slot_array[i];
+        }
+    }
+    free(old_slot_array);
+    return EXIT_SUCCESS;
+}
+
+// Returns the chunk, allocating an empty one when it is not loaded yet, or NULL when out of memory.
+struct chunk* load_chunk(struct world *world, int32_t chunk_x, int32_t chunk_y) {
+    struct chunk *chunk = find_chunk(world, chunk_x, chunk_y);
+    if (chunk != NULL) {
+        return chunk;
+    }
+    if ((world -> chunk_len + 1) * 2 > world -> slot_len && grow_world_slots(world) != EXIT_SUCCESS) {
+        return NULL;
+    }
+    if (world -> chunk_len == world -> chunk_capacity) {
+        struct chunk** new_chunk_array = counted_realloc(world -> chunk_array, sizeof(struct chunk*) * world -> chunk_capacity * 2);
+        if (new_chunk_array == NULL) {
+            perror("failed to grow world chunks");
+            return NULL;
+        }
+        world -> chunk_array = new_chunk_array;
+        world -> chunk_capacity *= 2;
+    }
+    chunk = counted_malloc(sizeof(struct chunk));
+    if (chunk == NULL) {
+        perror("failed to allocate chunk");
+        return NULL;
+    }
+    chunk -> x = chunk_x;
+    chunk -> y = chunk_y;
+    chunk -> building_len = 0;
+    for (uint32_t i = 0; i < CHUNK_TILE_LEN; i++) {
+        chunk -> tile_array[i] = (struct tile) {.building = WORLD_NO_BUILDING, .kind = TILE_EMPTY};
+    }
+    uint64_t key = chunk_key(chunk_x, chunk_y);
+    world -> slot_array[find_world_slot(world, key)] = (struct world_slot) {.key = key, .chunk = world -> chunk_len};
+    world -> chunk_array[world -> chunk_len++] = chunk;
+    return chunk;
+}
+
+// Frees a chunk and everything on it. The last loaded chunk takes its place in chunk_array, and
+// the slots after it shift back so probes never stop at a hole, which keeps lookups tombstone free.
+void unload_chunk(struct world *world, int32_t chunk_x, int32_t chunk_y) {
+    uint32_t slot = find_world_slot(world, chunk_key(chunk_x, chunk_y));
+    uint32_t index = world -> slot_array[slot].chunk;
+    if (index == WORLD_NO_CHUNK) {
+        return;
+    }
+    free(world -> chunk_array[index]);
+    uint32_t last = --world -> chunk_len;
+    if (index != last) {
+        struct chunk *moved = world -> chunk_array[last];
+        world -> chunk_array[index] = moved;
+        world -> slot_array[find_world_slot(world, chunk_key(moved -> x, moved -> y))].chunk = index;
+    }
+
+    uint32_t mask = world -> slot_len - 1;
+    uint32_t hole = slot;
+    uint32_t next = (slot + 1) & mask;
+    while (world -> slot_array[next].chunk != WORLD_NO_CHUNK) {
+        // an entry can fill the hole unless its home slot lies cyclically after the hole
+        uint32_t home = chunk_slot(world, world -> slot_array[next].key);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            world -> slot_array[hole] = world -> slot_array[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    world -> slot_array[hole].chunk = WORLD_NO_CHUNK;
+}
+
+// Fails when the tile is taken or its chunk cannot be allocated.
+int place_building(struct world *world, int32_t x, int32_t y, enum tile_kind kind, uint32_t building, uint8_t direction) {
+    struct chunk *chunk = load_chunk(world, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+    if (chunk == NULL) {
+        return EXIT_FAILURE;
+    }
+    struct tile *tile = &chunk -> tile_array[(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)];
+    if (tile -> kind != TILE_EMPTY) {
+        return EXIT_FAILURE;
+    }
+    *tile = (struct tile) {.building = building, .kind = (uint8_t)kind, .direction = direction};
+    chunk -> building_len++;
+    return EXIT_SUCCESS;
+}
+
+// Chunks left without buildings are unloaded.
+void remove_building(struct world *world, int32_t x, int32_t y) {
+    struct chunk *chunk = find_chunk(world, x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+    if (chunk == NULL) {
+        return;
+    }
+    struct tile *tile = &chunk -> tile_array[(y & CHUNK_MASK) * CHUNK_SIZE + (x & CHUNK_MASK)];
+    if (tile -> kind == TILE_EMPTY) {
+        return;
+    }
+    *tile = (struct tile) {.building = WORLD_NO_BUILDING, .kind = TILE_EMPTY};
+    if (--chunk -> building_len == 0) {
+        unload_chunk(world, chunk -> x, chunk -> y);
+    }
+}
+
+static inline uint64_t world_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Fills a square map with buildings and times tile lookups over it, walking rows in order and at
+// random coordinates.
+int benchmark_world(uint32_t lookup_len) {
+    const uint64_t tile_len_array[3] = {1000000, 10000000, 100000000};
+    for (int t = 0; t < 3; t++) {
+        int32_t side = 1;
+        while ((uint64_t)side * (uint64_t)side < tile_len_array[t]) {
+            side++;
+        }
+        // centred on the origin so negative coordinates are covered too
+        int32_t origin = -side / 2;
+        struct world world;
+        if (create_world(&world, 16) != EXIT_SUCCESS) {
+            destroy_world(&world);
+            return EXIT_FAILURE;
+        }
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (int32_t y = 0; y < side; y++) {
+            for (int32_t x = 0; x < side; x++) {
+                if (place_building(&world, origin + x, origin + y, TILE_MACHINE, (uint32_t)(y * side + x), 0) != EXIT_SUCCESS) {
+                    fprintf(stderr, "ERR: failed to fill a world of %llu tiles\n", (unsigned long long)tile_len_array[t]);
+                    destroy_world(&world);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double fill_seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+
+        uint64_t checksum = 0;
+        int32_t x = 0;
+        int32_t y = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (uint32_t i = 0; i < lookup_len; i++) {
+            const struct tile *tile = world_tile(&world, origin + x, origin + y);
+            checksum += tile -> building;
+            if (++x == side) {
+                x = 0;
+                y = y + 1 == side ? 0 : y + 1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double sequential_seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+
+        uint64_t random_state = 0x2545f4914f6cdd1dull;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        for (uint32_t i = 0; i < lookup_len; i++) {
+            uint64_t r = world_random(&random_state);
+            const struct tile *tile = world_tile(&world, origin + (int32_t)((uint32_t)r % (uint32_t)side), origin + (int32_t)((uint32_t)(r >> 32) % (uint32_t)side));
+            checksum += tile -> building;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double random_seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+
+        printf("World of %llu tiles in %u chunks (%.0f MB), filled in %.3f s: %.2f ns per sequential lookup, %.2f ns per random lookup, checksum %016llx\n",
+            (unsigned long long)side * (unsigned long long)side, world.chunk_len,
+            (double)world.chunk_len * sizeof(struct chunk) / (1024.0 * 1024.0), fill_seconds,
+            sequential_seconds * 1000000000.0 / lookup_len, random_seconds * 1000000000.0 / lookup_len,
+            (unsigned long long)checksum);
+        destroy_world(&world);
+    }
+    return EXIT_SUCCESS;
+}